@@ -0,0 +1,182 @@
+/*******************************************************************************
+ * arena.c - bump allocator for per-command scratch memory
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>		/* size_t, max_align_t */
+#include <stdint.h>		/* SIZE_MAX */
+#include <stdlib.h>		/* malloc, free */
+#include <string.h>		/* memset, memcpy, strlen */
+
+#include "arena.h"		/* struct arena */
+#include "utils.h"		/* SAFE_FREE */
+
+/* Smallest main block an arena allocates. */
+#define ARENA_MIN_SIZE 4096
+/* Alignment of everything an arena hands out. */
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+/* A block taken when the main block of an arena was full. */
+struct arena_block {
+	struct arena_block *next;	/* Next block taken, or NULL */
+	max_align_t	data[];	/* Memory handed out */
+};
+
+static size_t	round_up(size_t len);
+
+/* Sets up an empty arena.  Nothing is allocated until it is first used. */
+void
+init_arena(struct arena *arena)
+{
+	arena->base = NULL;
+	arena->size = 0;
+	arena->used = 0;
+	arena->extra = NULL;
+	arena->extra_size = 0;
+}
+
+/* Releases everything held by 'arena', which can then be used again as if
+ * just set up.
+ */
+void
+free_arena(struct arena *arena)
+{
+	reset_arena(arena);
+	SAFE_FREE(&(arena->base));
+	arena->size = 0;
+}
+
+/* Takes back everything handed out by 'arena', which MUST then not be used.
+ * This takes constant time unless the arena had to take extra blocks, in
+ * which case the main block is regrown so that it won't next time.
+ */
+void
+reset_arena(struct arena *arena)
+{
+	char           *base;
+	struct arena_block *block;
+
+	arena->used = 0;
+	if (arena->extra == NULL)
+		return;
+
+	while (arena->extra != NULL) {
+		block = arena->extra;
+		arena->extra = block->next;
+		free(block);
+	}
+
+	/* The old contents don't matter, so don't bother with realloc */
+	base = malloc(arena->size + arena->extra_size);
+	if (base != NULL) {
+		free(arena->base);
+		arena->base = base;
+		arena->size += arena->extra_size;
+	}
+	arena->extra_size = 0;
+}
+
+/* Hands out room for 'count' items of 'size' bytes from 'arena', aligned for
+ * any type, or returns NULL if the heap is exhausted.  The memory lasts
+ * until the arena is next reset.
+ */
+void	       *
+arena_alloc(struct arena *arena, size_t count, size_t size)
+{
+	size_t		len;
+	void	       *ptr = NULL;
+	struct arena_block *block;
+
+	if (size != 0 && SIZE_MAX / size < count)
+		return NULL;
+	len = round_up(count * size);
+	if (len < count * size)
+		return NULL;
+	if (len == 0)
+		len = ARENA_ALIGN;
+
+	if (arena->base == NULL) {
+		arena->size = (len < ARENA_MIN_SIZE) ? ARENA_MIN_SIZE : len;
+		arena->base = malloc(arena->size);
+		if (arena->base == NULL)
+			arena->size = 0;
+	}
+
+	if (len <= arena->size - arena->used) {
+		ptr = arena->base + arena->used;
+		arena->used += len;
+	} else {
+		block = malloc(sizeof(*block) + len);
+		if (block != NULL) {
+			block->next = arena->extra;
+			arena->extra = block;
+			arena->extra_size += len;
+			ptr = block->data;
+		}
+	}
+
+	return ptr;
+}
+
+/* As arena_alloc, but the memory is zeroed, as with calloc. */
+void	       *
+arena_calloc(struct arena *arena, size_t count, size_t size)
+{
+	void	       *ptr;
+
+	ptr = arena_alloc(arena, count, size);
+	if (ptr != NULL)
+		memset(ptr, 0, count * size);
+
+	return ptr;
+}
+
+/* Copies the string 'str' into 'arena', returning NULL if there's no room. */
+char	       *
+arena_strdup(struct arena *arena, const char *str)
+{
+	size_t		len;
+	char	       *copy;
+
+	len = strlen(str) + 1;
+	copy = arena_alloc(arena, len, 1);
+	if (copy != NULL)
+		memcpy(copy, str, len);
+
+	return copy;
+}
+
+/* Rounds 'len' up to a multiple of ARENA_ALIGN. */
+static size_t
+round_up(size_t len)
+{
+	return (len + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
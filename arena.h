@@ -0,0 +1,67 @@
+/*******************************************************************************
+ * arena.h - bump allocator for per-command scratch memory
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CUPPA_ARENA_H
+#define CUPPA_ARENA_H
+
+#include <stddef.h>		/* size_t */
+
+/*
+ * Arena - hands out memory by bumping a pointer through one block, and takes
+ * it all back at once with reset_arena, so that scratch memory doesn't cost a
+ * malloc and free each time.
+ *
+ * If the block runs out, extra blocks are allocated to make up the
+ * difference; the next reset frees them and grows the main block to fit
+ * everything, so an arena that sees the same work over and over soon stops
+ * touching the heap altogether.
+ *
+ * Set up with init_arena and release with free_arena.  Don't touch the
+ * fields directly.
+ */
+struct arena {
+	char	       *base;	/* Main block, or NULL if not yet needed */
+	size_t		size;	/* Size of 'base' in bytes */
+	size_t		used;	/* Bytes of 'base' handed out */
+	struct arena_block *extra;	/* Blocks taken since the last reset */
+	size_t		extra_size;	/* Bytes handed out from 'extra' */
+};
+
+void		init_arena(struct arena *arena);
+void		free_arena(struct arena *arena);
+void		reset_arena(struct arena *arena);
+void	       *arena_alloc(struct arena *arena, size_t count, size_t size);
+void	       *arena_calloc(struct arena *arena, size_t count, size_t size);
+char	       *arena_strdup(struct arena *arena, const char *str);
+
+#endif				/* !CUPPA_ARENA_H */
@@ -0,0 +1,538 @@
+/*******************************************************************************
+ * bench/bench.c - micro-benchmarks for the command and response paths
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Build and run with 'make run' in this directory.  Each case prints the
+ * mean time and number of heap allocations (malloc, calloc and realloc
+ * calls made by cuppa) per operation; pass a scale factor to run more or
+ * fewer operations.  Responses and logs go to /dev/null while timing.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <fcntl.h>		/* open */
+#include <pthread.h>		/* pthread_create, pthread_join */
+#include <stdarg.h>		/* va_list etc. */
+#include <stdbool.h>		/* bool */
+#include <stdio.h>		/* snprintf, FILE */
+#include <stdlib.h>		/* atol, malloc */
+#include <string.h>		/* memcpy, strlen */
+#include <time.h>		/* clock_gettime */
+#include <unistd.h>		/* dup, dup2, write, lseek, unlink */
+
+#include "../cmd.h"		/* handle_cmd, run_cmd_line, struct cmd */
+#include "../ctx.h"		/* struct cuppa_ctx, run_cuppa_ctx */
+#include "../errors.h"		/* error */
+#include "../io.h"		/* response, flush_responses, input_waiting */
+#include "../shm.h"		/* struct shm_ring, shm_ring_* */
+#include "../stream.h"		/* fd_stream, ring_stream */
+#include "../utils.h"		/* tokenize_line, skip_space etc. */
+
+/* Operations per case, before scaling. */
+#define BASE_OPS 200000
+/* Largest command table used for lookups. */
+#define MAX_TABLE 512
+/* Bytes in each of the rings between the benchmark and a context. */
+#define RING_SIZE 65536
+
+void	       *__real_malloc(size_t size);
+void	       *__real_calloc(size_t num, size_t size);
+void	       *__real_realloc(void *ptr, size_t size);
+void	       *__wrap_malloc(size_t size);
+void	       *__wrap_calloc(size_t num, size_t size);
+void	       *__wrap_realloc(void *ptr, size_t size);
+
+/* A benchmark case, timing 'ops' runs of whatever it measures. */
+struct bench {
+	const char     *name;	/* Name printed in the results */
+	void		(*run) (size_t ops);	/* Runs the case */
+	size_t		ops;	/* Operations, before scaling */
+};
+
+/* Heap allocations made since the program started. */
+static size_t	num_allocs = 0;
+/* Where results go, as standard out is taken over by responses. */
+static FILE    *results;
+/* The null device, which responses, logs and forwarded commands go to. */
+static int	null_fd;
+/* Command table for the lookup cases, and its command words. */
+static struct cmd table[MAX_TABLE + 1];
+static char	words[MAX_TABLE][WORD_LEN];
+
+static enum error nop(void *usr);
+static enum error set(void *usr, const char *arg);
+static void	run_stream(size_t ops, const char *line, const struct cmd_prop *prop);
+static void	bench_nullary(size_t ops);
+static void	bench_unary(size_t ops);
+static void	bench_propagate(size_t ops);
+static void	bench_unknown(size_t ops);
+static void	run_lookup(size_t ops, size_t size, bool prepared);
+static void	bench_lookup_8(size_t ops);
+static void	bench_lookup_64(size_t ops);
+static void	bench_lookup_512(size_t ops);
+static void	bench_lookup_walked(size_t ops);
+static bool	make_ring(struct shm_ring *producer, struct shm_ring *consumer);
+static void    *run_ring_ctx(void *data);
+static void	bench_ring_ctx(size_t ops);
+static void	bench_response(size_t ops);
+static void	bench_response_flush(size_t ops);
+static void	bench_error(size_t ops);
+static void	bench_input_waiting(size_t ops);
+static void	bench_tokenize(size_t ops);
+static void	bench_scanners(size_t ops);
+static uint64_t	now_nsecs(void);
+
+static const struct cmd CMDS[] = {
+	NCMD("nop", nop),
+	UCMD("set", set),
+	PROPAGATE("fwd"),
+	END_CMDS
+};
+
+static const struct bench BENCHES[] = {
+	{"handle_cmd nullary", bench_nullary, BASE_OPS},
+	{"handle_cmd unary", bench_unary, BASE_OPS},
+	{"handle_cmd PROPAGATE", bench_propagate, BASE_OPS},
+	{"handle_cmd unknown", bench_unknown, BASE_OPS},
+	{"lookup, 8 commands", bench_lookup_8, BASE_OPS},
+	{"lookup, 64 commands", bench_lookup_64, BASE_OPS},
+	{"lookup, 512 commands", bench_lookup_512, BASE_OPS},
+	{"lookup, 64 unprepared", bench_lookup_walked, BASE_OPS},
+	{"context over rings", bench_ring_ctx, BASE_OPS},
+	{"vresponse, buffered", bench_response, BASE_OPS},
+	{"vresponse, flushed", bench_response_flush, BASE_OPS},
+	{"error", bench_error, BASE_OPS},
+	{"input_waiting", bench_input_waiting, BASE_OPS},
+	{"tokenize_line", bench_tokenize, BASE_OPS * 5},
+	{"skip_space etc.", bench_scanners, BASE_OPS * 5},
+	{NULL, NULL, 0}
+};
+
+int
+main(int argc, char *argv[])
+{
+	double		scale = 1.0;
+	size_t		ops;
+	size_t		allocs;
+	uint64_t	start;
+	uint64_t	nsecs;
+	int		input[2];
+	struct stream	out;
+	const struct bench *b;
+
+	if (argc > 1)
+		scale = atof(argv[1]);
+	if (scale <= 0.0)
+		scale = 1.0;
+
+	results = fdopen(dup(STDOUT_FILENO), "w");
+	null_fd = open("/dev/null", O_WRONLY);
+	if (results == NULL || null_fd == -1 || pipe(input) == -1) {
+		perror("bench");
+		return EXIT_FAILURE;
+	}
+
+	/* Keep responses and logs out of the results; leave stdin empty */
+	dup2(null_fd, STDERR_FILENO);
+	dup2(input[0], STDIN_FILENO);
+	out = fd_stream(null_fd);
+	set_stdout_stream(&out);
+	set_dbug_level(DL_NONE);
+
+	fprintf(results, "%-24s %12s %12s\n", "case", "ns/op", "allocs/op");
+	for (b = BENCHES; b->name != NULL; b++) {
+		ops = (size_t)(b->ops * scale);
+		if (ops == 0)
+			ops = 1;
+
+		allocs = num_allocs;
+		start = now_nsecs();
+		b->run(ops);
+		nsecs = now_nsecs() - start;
+		allocs = num_allocs - allocs;
+
+		fprintf(results, "%-24s %12.1f %12.6f\n",
+			b->name,
+			(double)nsecs / (double)ops,
+			(double)allocs / (double)ops);
+	}
+
+	flush_responses();
+	fclose(results);
+	return EXIT_SUCCESS;
+}
+
+void *
+__wrap_malloc(size_t size)
+{
+	num_allocs++;
+	return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t num, size_t size)
+{
+	num_allocs++;
+	return __real_calloc(num, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+	num_allocs++;
+	return __real_realloc(ptr, size);
+}
+
+static enum error
+nop(void *usr)
+{
+	(void)usr;
+	return E_OK;
+}
+
+static enum error
+set(void *usr, const char *arg)
+{
+	(void)usr;
+	(void)arg;
+	return E_OK;
+}
+
+/* Runs 'ops' copies of 'line' through handle_cmd, from a temporary file so
+ * that the whole stream is there to be read.  Writing the file is timed
+ * too, but costs little next to handling the commands.
+ */
+static void
+run_stream(size_t ops, const char *line, const struct cmd_prop *prop)
+{
+	char		path[] = "/tmp/cuppa-bench-XXXXXX";
+	char		chunk[4096];
+	size_t		len = strlen(line);
+	size_t		per_chunk = sizeof(chunk) / len;
+	size_t		i;
+	size_t		n;
+	int		fd;
+	struct cmd_reader reader;
+
+	fd = mkstemp(path);
+	if (fd == -1)
+		return;
+	unlink(path);
+
+	for (i = 0; i < per_chunk; i++)
+		memcpy(chunk + i * len, line, len);
+	for (i = 0; i < ops; i += n) {
+		n = ops - i < per_chunk ? ops - i : per_chunk;
+		if (write(fd, chunk, n * len) == -1)
+			break;
+	}
+	lseek(fd, 0, SEEK_SET);
+
+	init_cmd_reader(&reader, fd);
+	while (handle_cmd(NULL, CMDS, &reader, prop) != E_EOF)
+		continue;
+	free_cmd_reader(&reader);
+	close(fd);
+}
+
+static void
+bench_nullary(size_t ops)
+{
+	run_stream(ops, "nop\n", NULL);
+}
+
+static void
+bench_unary(size_t ops)
+{
+	run_stream(ops, "set 12345\n", NULL);
+}
+
+static void
+bench_propagate(size_t ops)
+{
+	struct stream	target = fd_stream(null_fd);
+	struct cmd_prop	prop = {&target, 1};
+
+	run_stream(ops, "fwd 12345\n", &prop);
+}
+
+static void
+bench_unknown(size_t ops)
+{
+	run_stream(ops, "zzz 12345\n", NULL);
+}
+
+/* Looks up the last of 'size' generated commands 'ops' times, through
+ * run_cmd_line so that nothing but tokenizing, lookup and the OKAY
+ * response is measured.  Unless 'prepared', the table is walked.
+ */
+static void
+run_lookup(size_t ops, size_t size, bool prepared)
+{
+	char		line[WORD_LEN + 8];
+	char		copy[sizeof(line)];
+	size_t		len;
+	size_t		i;
+
+	for (i = 0; i < size; i++) {
+		snprintf(words[i], WORD_LEN, "c%03zu", i);
+		table[i] = (struct cmd)UCMD(words[i], set);
+	}
+	table[size] = (struct cmd)END_CMDS;
+	if (prepared)
+		prepare_cmds(table);
+
+	len = (size_t)snprintf(line, sizeof(line), "%s 1", words[size - 1]);
+	for (i = 0; i < ops; i++) {
+		memcpy(copy, line, len + 1);
+		run_cmd_line(NULL, table, NULL, copy, len);
+	}
+	flush_responses();
+
+	/* The table is about to be rewritten for the next case */
+	forget_cmds(table);
+}
+
+static void
+bench_lookup_8(size_t ops)
+{
+	run_lookup(ops, 8, true);
+}
+
+static void
+bench_lookup_64(size_t ops)
+{
+	run_lookup(ops, 64, true);
+}
+
+static void
+bench_lookup_512(size_t ops)
+{
+	run_lookup(ops, MAX_TABLE, true);
+}
+
+static void
+bench_lookup_walked(size_t ops)
+{
+	run_lookup(ops, 64, false);
+}
+
+/* Lays out a ring in an unlinked temporary file, with a pipe for its
+ * doorbell, and attaches both ends of it.
+ */
+static bool
+make_ring(struct shm_ring *producer, struct shm_ring *consumer)
+{
+	char		path[] = "/tmp/cuppa-ring-XXXXXX";
+	int		fd;
+	int		bell[2];
+	bool		made = false;
+
+	fd = mkstemp(path);
+	if (fd == -1)
+		return false;
+	unlink(path);
+
+	if (pipe(bell) == 0 &&
+	    shm_ring_create(producer, fd, RING_SIZE, bell[1]) == E_OK) {
+		made = (shm_ring_attach(consumer, fd, bell[0]) == E_OK);
+		if (!made)
+			shm_ring_detach(producer);
+	}
+	close(fd);
+
+	return made;
+}
+
+/* Thread body for bench_ring_ctx: runs the context 'data', then tells the
+ * benchmark it has finished by detaching from the response ring.
+ */
+static void *
+run_ring_ctx(void *data)
+{
+	struct cuppa_ctx *ctx = data;
+
+	set_dbug_level(DL_NONE);
+	run_cuppa_ctx(ctx);
+	shm_ring_detach(ctx->out.data);
+
+	return NULL;
+}
+
+/* Sends 'ops' commands one at a time to a context on its own thread over
+ * one ring, waiting for each answer over another, as co-located shards do.
+ * The context goes idle between commands, so each operation is a round trip
+ * including the ring's wakeup.
+ */
+static void
+bench_ring_ctx(size_t ops)
+{
+	static const char line[] = "nop\n";
+	char		buf[4096];
+	size_t		lines = 0;
+	size_t		num_read;
+	size_t		i;
+	size_t		j;
+	bool		started;
+	bool		eof = false;
+	struct shm_ring	cmd_out;
+	struct shm_ring	cmd_in;
+	struct shm_ring	resp_out;
+	struct shm_ring	resp_in;
+	struct stream	in;
+	struct stream	out;
+	struct cuppa_ctx ctx;
+	pthread_t	thread;
+
+	if (!make_ring(&cmd_out, &cmd_in))
+		return;
+	if (!make_ring(&resp_out, &resp_in)) {
+		shm_ring_detach(&cmd_out);
+		shm_ring_detach(&cmd_in);
+		return;
+	}
+
+	in = ring_stream(&cmd_in);
+	out = ring_stream(&resp_out);
+	init_cuppa_ctx(&ctx, NULL, CMDS, &in, &out);
+	started = (pthread_create(&thread, NULL, run_ring_ctx, &ctx) == 0);
+	if (!started)
+		shm_ring_detach(&resp_out);
+
+	for (i = 0; i < ops && !eof; i++) {
+		if (!shm_ring_write_all(&cmd_out, line, sizeof(line) - 1))
+			break;
+		for (num_read = 0; num_read == 0 && !eof;) {
+			num_read = shm_ring_read(&resp_in, buf, sizeof(buf),
+						 &eof);
+			for (j = 0; j < num_read; j++)
+				lines += (buf[j] == '\n');
+		}
+	}
+
+	/* Hang up, then wait for the context to finish */
+	shm_ring_detach(&cmd_out);
+	while (!eof)
+		(void)shm_ring_read(&resp_in, buf, sizeof(buf), &eof);
+	if (started)
+		pthread_join(thread, NULL);
+
+	if (lines != ops)
+		fprintf(results, "context over rings: %zu of %zu answered\n",
+			lines, ops);
+
+	free_cuppa_ctx(&ctx);
+	shm_ring_detach(&cmd_in);
+	shm_ring_detach(&resp_in);
+}
+
+static void
+bench_response(size_t ops)
+{
+	size_t		i;
+
+	for (i = 0; i < ops; i++)
+		response(R_STAT, "%s %zu", "playing", i);
+	flush_responses();
+}
+
+static void
+bench_response_flush(size_t ops)
+{
+	size_t		i;
+
+	for (i = 0; i < ops; i++) {
+		response(R_STAT, "%s %zu", "playing", i);
+		flush_responses();
+	}
+}
+
+static void
+bench_error(size_t ops)
+{
+	size_t		i;
+
+	for (i = 0; i < ops; i++)
+		error(E_BAD_COMMAND, "%s %zu", "benchmark", i);
+	flush_responses();
+}
+
+static void
+bench_input_waiting(size_t ops)
+{
+	size_t		i;
+
+	for (i = 0; i < ops; i++)
+		input_waiting();
+}
+
+static void
+bench_tokenize(size_t ops)
+{
+	static const char line[] = "  load   /music/some track.mp3   ";
+	size_t		i;
+	struct line_tokens tokens;
+
+	for (i = 0; i < ops; i++)
+		tokenize_line(line, sizeof(line) - 1, &tokens);
+}
+
+/* Splits a line the way the old handle_cmd did: skip leading space, find
+ * the end of the word, then skip to the argument and trim it.
+ */
+static void
+bench_scanners(size_t ops)
+{
+	static const char line[] = "  load   /music/some track.mp3   ";
+	char		copy[sizeof(line)];
+	char           *word;
+	char           *arg;
+	size_t		i;
+
+	for (i = 0; i < ops; i++) {
+		memcpy(copy, line, sizeof(line));
+		word = skip_space(copy);
+		arg = nullify_space(skip_nonspace(word));
+		nullify_tspace(arg, endof(arg));
+	}
+}
+
+/* Returns a monotonic time in nanoseconds. */
+static uint64_t
+now_nsecs(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
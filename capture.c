@@ -0,0 +1,412 @@
+/*******************************************************************************
+ * capture.c - recording and replaying command and response streams
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <errno.h>		/* errno, EINTR */
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* uint32_t, uint64_t */
+#include <stdlib.h>		/* realloc */
+#include <string.h>		/* memcpy, memmove, strlen */
+#include <sys/uio.h>		/* writev, struct iovec */
+#include <time.h>		/* nanosleep */
+#include <unistd.h>		/* read */
+
+#include "capture.h"		/* enum capture_kind, enum replay_speed */
+#include "cmd.h"		/* run_cmd_line */
+#include "errors.h"		/* error, severity */
+#include "io.h"			/* enum response */
+#include "messages.h"		/* MSG_CAP_* */
+#include "utils.h"		/* SAFE_FREE, monotonic_usecs */
+#include "wire.h"		/* wire_get_u32, wire_put_u32, wire_put_u64 */
+
+/* Size of the buffer records are gathered in before being written. */
+#define CAPTURE_BUF_LEN 65536
+/* Number of bytes replay_capture reads at a time. */
+#define REPLAY_CHUNK 65536
+
+/* Capturing is per thread, like the streams it records. */
+_Thread_local bool capture_enabled = false;
+_Thread_local bool capture_failed = false;
+
+static _Thread_local int capture_fd = -1;	/* Log being captured to */
+static _Thread_local uint64_t capture_start = 0;	/* When capture started */
+static _Thread_local size_t capture_len = 0;	/* Bytes in CAPTURE_BUF */
+static _Thread_local char CAPTURE_BUF[CAPTURE_BUF_LEN];
+
+static void
+put_record(enum capture_kind kind,
+	   struct iovec *parts,
+	   int num_parts);
+static bool	write_parts(struct iovec *iov, int num_iov);
+static void	fail_capture(void);
+static enum error
+replay_record(void *usr,
+	      const struct cmd *cmds,
+	      const struct cmd_prop *prop,
+	      char *record,
+	      uint64_t *first,
+	      uint64_t started,
+	      enum replay_speed speed);
+static void	wait_until(uint64_t when);
+static uint64_t	get_u64(const char *buf);
+
+/* Starts capturing to 'fd', which should be open for appending.  Anything
+ * already being captured is flushed to its log first.
+ */
+enum error
+start_capture(int fd)
+{
+	stop_capture();
+
+	capture_fd = fd;
+	capture_start = monotonic_usecs();
+	capture_enabled = true;
+
+	return E_OK;
+}
+
+/* Stops capturing, flushing any buffered records.  The log is left open. */
+void
+stop_capture(void)
+{
+	flush_capture();
+	capture_enabled = false;
+	capture_fd = -1;
+}
+
+/* Writes out any buffered records.  If the log can't be written to, capture
+ * stops, and capture_failed is set for the response code to report it.
+ */
+void
+flush_capture(void)
+{
+	struct iovec	iov;
+
+	if (capture_len == 0)
+		return;
+
+	iov.iov_base = CAPTURE_BUF;
+	iov.iov_len = capture_len;
+	capture_len = 0;
+	if (!write_parts(&iov, 1))
+		fail_capture();
+}
+
+/* Reports that capture stopped because its log failed.  This is left to the
+ * response code (see io.c), which calls it once the response being captured
+ * has gone: capture happens in the middle of sending responses, and so can't
+ * send one of its own.
+ */
+void
+report_capture_failure(void)
+{
+	capture_failed = false;
+	error(E_INTERNAL_ERROR, "%s", MSG_CAP_WRITE);
+}
+
+/* Records the command line 'line', 'len' bytes long without its newline. */
+void
+capture_in(const char *line, size_t len)
+{
+	struct iovec	part;
+
+	part.iov_base = (void *)line;
+	part.iov_len = len;
+	put_record(CAPTURE_IN, &part, 1);
+}
+
+/* Records a command given as a word 'word' and argument 'arg' (NULL if
+ * none), as the text line that would have carried it.
+ */
+void
+capture_cmd(const char *word, const char *arg)
+{
+	struct iovec	parts[3];
+
+	parts[0].iov_base = (void *)word;
+	parts[0].iov_len = strlen(word);
+	parts[1].iov_base = (void *)" ";
+	parts[1].iov_len = (arg == NULL) ? 0 : 1;
+	parts[2].iov_base = (void *)arg;
+	parts[2].iov_len = (arg == NULL) ? 0 : strlen(arg);
+	put_record(CAPTURE_IN, parts, 3);
+}
+
+/* Records a response with code 'code' and the 'len'-byte body 'body'. */
+void
+capture_out(enum response code, const char *body, size_t len)
+{
+	char		byte;
+	struct iovec	parts[2];
+
+	byte = (char)code;
+	parts[0].iov_base = &byte;
+	parts[0].iov_len = 1;
+	parts[1].iov_base = (void *)body;
+	parts[1].iov_len = len;
+	put_record(CAPTURE_OUT, parts, 2);
+}
+
+/* Runs every command in the capture log 'fd' against 'cmds', in order, as
+ * if they had been read from a text command stream; see handle_cmd for
+ * 'usr' and 'prop'.  Responses in the log are skipped.  With REPLAY_TIMED,
+ * each command waits until as long after the first as it was captured.
+ *
+ * Commands that fail are reported in the usual way, and replay carries on
+ * unless the error is fatal.  Returns E_BAD_FILE, having stopped, if the log
+ * is cut short, holds a record of unknown kind, or can't be read.
+ */
+enum error
+replay_capture(int fd,
+	       void *usr,
+	       const struct cmd *cmds,
+	       const struct cmd_prop *prop,
+	       enum replay_speed speed)
+{
+	char           *buffer = NULL;
+	char           *grown;
+	size_t		size = 0;
+	size_t		start = 0;
+	size_t		end = 0;
+	size_t		need;
+	ssize_t		num_read;
+	char		saved;
+	uint64_t	first = UINT64_MAX;
+	uint64_t	started;
+	bool		eof = false;
+	enum error	err = E_OK;
+
+	started = monotonic_usecs();
+	while (err == E_OK) {
+		/* Run every whole record in the buffer */
+		need = CAPTURE_HEAD_LEN;
+		while (err == E_OK && need <= end - start) {
+			need += wire_get_u32(buffer + start + 9);
+			if (need <= end - start) {
+				/* Terminate the payload in place, borrowing
+				 * the first byte of the next record */
+				saved = buffer[start + need];
+				buffer[start + need] = '\0';
+				err = replay_record(usr, cmds, prop,
+						    buffer + start, &first,
+						    started, speed);
+				buffer[start + need] = saved;
+				start += need;
+				need = CAPTURE_HEAD_LEN;
+			}
+		}
+		if (err != E_OK)
+			break;
+		if (eof) {
+			if (start != end)
+				err = error(E_BAD_FILE, "%s", MSG_CAP_BADLOG);
+			break;
+		}
+
+		/* Make room for the rest of the record, and its terminator */
+		if (start != 0) {
+			memmove(buffer, buffer + start, end - start);
+			end -= start;
+			start = 0;
+		}
+		if (need < REPLAY_CHUNK)
+			need = REPLAY_CHUNK;
+		if (size < end + need + 1) {
+			grown = realloc(buffer, end + need + 1);
+			if (grown == NULL) {
+				err = error(E_NO_MEM, "%s", MSG_CMD_NOBUF);
+				break;
+			}
+			buffer = grown;
+			size = end + need + 1;
+		}
+
+		do
+			num_read = read(fd, buffer + end, size - end - 1);
+		while (num_read == -1 && errno == EINTR);
+
+		if (num_read == -1)
+			err = error(E_BAD_FILE, "%s", MSG_CAP_READ);
+		else if (num_read == 0)
+			eof = true;
+		else
+			end += (size_t)num_read;
+	}
+
+	SAFE_FREE(&buffer);
+	return err;
+}
+
+/* Appends a record of kind 'kind', whose payload is 'parts' in order. */
+static void
+put_record(enum capture_kind kind, struct iovec *parts, int num_parts)
+{
+	int		i;
+	size_t		len = 0;
+	char		head[CAPTURE_HEAD_LEN];
+	struct iovec	iov[4];
+
+	if (!capture_enabled)
+		return;
+
+	for (i = 0; i < num_parts; i++)
+		len += parts[i].iov_len;
+
+	head[0] = (char)kind;
+	wire_put_u64(head + 1, monotonic_usecs() - capture_start);
+	wire_put_u32(head + 9, (uint32_t)len);
+
+	if (CAPTURE_BUF_LEN - capture_len < CAPTURE_HEAD_LEN + len)
+		flush_capture();
+
+	if (CAPTURE_HEAD_LEN + len <= CAPTURE_BUF_LEN) {
+		memcpy(CAPTURE_BUF + capture_len, head, CAPTURE_HEAD_LEN);
+		capture_len += CAPTURE_HEAD_LEN;
+		for (i = 0; i < num_parts; i++) {
+			memcpy(CAPTURE_BUF + capture_len,
+			       parts[i].iov_base,
+			       parts[i].iov_len);
+			capture_len += parts[i].iov_len;
+		}
+	} else if (capture_enabled) {
+		/* Too big to buffer, so write it straight out */
+		iov[0].iov_base = head;
+		iov[0].iov_len = CAPTURE_HEAD_LEN;
+		for (i = 0; i < num_parts && i < 3; i++)
+			iov[i + 1] = parts[i];
+		if (!write_parts(iov, i + 1))
+			fail_capture();
+	}
+}
+
+/* Stops capture after its log failed, leaving it to be reported later (see
+ * report_capture_failure).
+ */
+static void
+fail_capture(void)
+{
+	capture_enabled = false;
+	capture_failed = true;
+	capture_fd = -1;
+	capture_len = 0;
+}
+
+/* Writes all of 'iov' to the log, retrying after signals and partial
+ * writes.  Returns false if the log fails.
+ */
+static bool
+write_parts(struct iovec *iov, int num_iov)
+{
+	ssize_t		num_written;
+	size_t		left;
+
+	while (0 < num_iov) {
+		num_written = writev(capture_fd, iov, num_iov);
+		if (num_written == -1 && errno == EINTR)
+			continue;
+		if (num_written <= 0)
+			return false;
+
+		/* Skip over whatever was written */
+		for (left = (size_t)num_written; 0 < num_iov &&
+		     iov->iov_len <= left; iov++, num_iov--)
+			left -= iov->iov_len;
+		if (0 < num_iov) {
+			iov->iov_base = (char *)iov->iov_base + left;
+			iov->iov_len -= left;
+		}
+	}
+
+	return true;
+}
+
+/* Replays the record at 'record', whose payload has been terminated, if it
+ * is a command.  'first' holds the capture time of the first command
+ * replayed, or UINT64_MAX if there hasn't been one, and 'started' when replay
+ * started.  Only fatal command errors are passed on, along with E_BAD_FILE
+ * for records of unknown kind.
+ */
+static enum error
+replay_record(void *usr,
+	      const struct cmd *cmds,
+	      const struct cmd_prop *prop,
+	      char *record,
+	      uint64_t *first,
+	      uint64_t started,
+	      enum replay_speed speed)
+{
+	uint64_t	when;
+	enum error	err = E_OK;
+
+	if (record[0] == CAPTURE_IN) {
+		when = get_u64(record + 1);
+		if (*first == UINT64_MAX)
+			*first = when;
+		else if (speed == REPLAY_TIMED && *first < when)
+			wait_until(started + (when - *first));
+
+		err = run_cmd_line(usr, cmds, prop,
+				   record + CAPTURE_HEAD_LEN,
+				   wire_get_u32(record + 9));
+
+		/* Failed commands have been answered, so needn't stop replay */
+		if (severity(err) == ES_NORMAL)
+			err = E_OK;
+	} else if (record[0] != CAPTURE_OUT)
+		err = error(E_BAD_FILE, "%s", MSG_CAP_BADLOG);
+
+	return err;
+}
+
+/* Sleeps until the monotonic time 'when', in usecs. */
+static void
+wait_until(uint64_t when)
+{
+	uint64_t	now;
+	struct timespec	wait;
+
+	for (now = monotonic_usecs(); now < when; now = monotonic_usecs()) {
+		wait.tv_sec = (time_t)((when - now) / 1000000);
+		wait.tv_nsec = (long)((when - now) % 1000000) * 1000;
+		nanosleep(&wait, NULL);
+	}
+}
+
+/* Reads a big-endian 64-bit integer from 'buf'. */
+static uint64_t
+get_u64(const char *buf)
+{
+	return ((uint64_t)wire_get_u32(buf) << 32) | wire_get_u32(buf + 4);
+}
@@ -0,0 +1,105 @@
+/*******************************************************************************
+ * capture.h - recording and replaying command and response streams
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CUPPA_CAPTURE_H
+#define CUPPA_CAPTURE_H
+
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* uint64_t */
+
+#include "cmd.h"		/* struct cmd, struct cmd_prop */
+#include "errors.h"		/* enum error */
+#include "io.h"			/* enum response */
+
+/*
+ * Capture - records every command line read and every response sent to an
+ * append-only log, so that real traffic can be replayed later through
+ * replay_capture for benchmarks and regression tests.
+ *
+ * A log is a sequence of records, each of which is:
+ *
+ *   kind (1 byte) | time (8 bytes) | length (4 bytes) | payload
+ *
+ * where integers are big-endian, the time is in microseconds since capture
+ * started, and the payload is the command line as received (CAPTURE_IN) or
+ * the response code as one byte followed by the response body
+ * (CAPTURE_OUT).  Commands that arrived as binary frames are recorded as the
+ * equivalent text line.
+ *
+ * Records are buffered, and written out when the buffer fills, on
+ * flush_responses and on stop_capture.  Only the thread running commands may
+ * capture, and capturing is per thread: with several contexts (see ctx.h),
+ * each thread records only its own streams.
+ */
+
+/* Length of a capture record's header. */
+#define CAPTURE_HEAD_LEN 13
+
+/* Kinds of capture record. */
+enum capture_kind {
+	CAPTURE_IN = 1,		/* Command line read */
+	CAPTURE_OUT = 2		/* Response sent */
+};
+
+/* How fast replay_capture feeds in commands. */
+enum replay_speed {
+	REPLAY_TIMED,		/* At the pace they were captured */
+	REPLAY_FAST		/* As fast as they can be run */
+};
+
+/* True while this thread is capturing; see start_capture and stop_capture. */
+extern _Thread_local bool capture_enabled;
+/* True if this thread's capture log failed and that is yet to be reported;
+ * see report_capture_failure.
+ */
+extern _Thread_local bool capture_failed;
+
+enum error	start_capture(int fd);
+void		stop_capture(void);
+void		flush_capture(void);
+void		report_capture_failure(void);
+void		capture_in(const char *line, size_t len);
+void		capture_cmd(const char *word, const char *arg);
+void
+capture_out(enum response code,
+	    const char *body,
+	    size_t len);
+enum error
+replay_capture(int fd,
+	       void *usr,
+	       const struct cmd *cmds,
+	       const struct cmd_prop *prop,
+	       enum replay_speed speed);
+
+#endif				/* !CUPPA_CAPTURE_H */
@@ -34,99 +34,1264 @@
 #define _POSIX_C_SOURCE 200809
 
 #include <ctype.h>
+#include <errno.h>		/* errno, EAGAIN */
 #include <stdbool.h>		/* bool */
-#include <stdio.h>		/* getline */
+#include <stdint.h>		/* uint32_t, uint64_t */
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>		/* struct iovec */
 
 #include "constants.h"		/* WORD_LEN */
+#include "arena.h"		/* init_arena, reset_arena, free_arena */
+#include "capture.h"		/* capture_enabled, capture_in, capture_cmd */
 #include "cmd.h"		/* struct cmd, enum cmd_type */
-#include "errors.h"		/* error */
+#include "errors.h"		/* error, DBUG */
 #include "io.h"			/* response */
 #include "messages.h"		/* Messages (usually errors) */
-#include "utils.h"		/* skip_space, nullify_space, skip_unspace */
+#include "stats.h"		/* stats_enabled, stats_count_cmd */
+#include "stream.h"		/* struct stream, stream_read */
+#include "utils.h"		/* tokenize_line, skip_space etc. */
+#include "wire.h"		/* decode_cmd_frame, parse_wire_mode */
+
+/* Minimum number of bytes to make room for each time a reader is filled. */
+#define READ_CHUNK 4096
+/* Number of pending bytes above which drain_commands stops reading more. */
+#define READ_HIGH_WATER 65536
+
+/* Readers must be able to take in enough of a line to see it is too long. */
+_Static_assert(CMD_MAX_LINE < READ_HIGH_WATER, "CMD_MAX_LINE is too long");
+
+/* Number of asynchronous commands that can be running at once. */
+#define NUM_CMD_JOBS 32
+
+/* Most lines ahead of an LWW command looked through for one superseding it. */
+#define LWW_LOOKAHEAD 64
+/* Longest argument checked for an LWW command; longer ones always run. */
+#define LWW_ARG_LEN 256
+
+/* Multiplier for the Fibonacci hash used to place words in an index. */
+#define INDEX_HASH_MUL UINT32_C(2654435761)
+
+/* Dispatch index for a command table.
+ *
+ * This maps each packed command word (see pack_word) to the first entry in
+ * the table with that word, and remembers the first ANY entry, which is
+ * enough to reproduce the top-down matching rules without walking the table.
+ */
+struct cmd_index {
+	const struct cmd *cmds;	/* Indexed table */
+	const struct cmd *any;	/* First ANY entry in the table, or NULL */
+	bool		scan;	/* Table can't be indexed; scan it instead */
+	unsigned	bits;	/* Binary logarithm of the number of slots */
+	uint32_t       *keys;	/* Packed words, 0 marking an empty slot */
+	const struct cmd **entries;	/* First entry for each slot's word */
+};
+
+/* An asynchronous command in progress (see ACMD). */
+struct cmd_job {
+	bool		in_use;	/* True if this job is running */
+	char		word [WORD_LEN];	/* Command word */
+	char	       *arg;	/* Copy of the argument, or NULL if none */
+	char		tag [MAX_TAG_LEN];	/* Tag the command came with */
+	size_t		tag_len;	/* Length of 'tag'; 0 if untagged */
+	uint64_t	sink;	/* ID of the pull sink; 0 for standard out */
+	uint64_t	read_at;	/* When the command was read, if timing */
+};
+
+/*
+ * Everything below is per thread, so that threads running different
+ * contexts (see ctx.h) never share command state.
+ */
+
+/* Pool of asynchronous commands. */
+static _Thread_local struct cmd_job JOBS[NUM_CMD_JOBS];
+/* Reader whose command is being run, or NULL if none is. */
+static _Thread_local struct cmd_reader *running = NULL;
+/* Scratch memory for commands run by run_cmd_line. */
+static _Thread_local struct arena line_arena;
+
+/* Indices for the tables prepared with prepare_cmds, in no particular order. */
+static _Thread_local struct cmd_index *indices = NULL;
+static _Thread_local size_t num_indices = 0;	/* Tables in 'indices' */
+static _Thread_local size_t indices_size = 0;	/* Room in 'indices' */
 
 static enum error
 exec_cmd(void *usr,
 	 const struct cmd *cmds,
+	 struct cmd_reader *reader,
 	 const char *word,
 	 const char *arg,
-	 FILE *prop);
+	 const struct cmd_prop *prop);
 static enum error
 exec_cmd_struct(void *usr,
 		const struct cmd *cmd,
+		struct cmd_reader *reader,
 		const char *word,
 		const char *arg,
-		FILE *prop);
+		const struct cmd_prop *prop);
+static void
+forward_cmd(const struct cmd_prop *prop,
+	    const char *word,
+	    const char *arg);
+static enum error handle_listener(void *data, int fd);
+static enum error
+drain(void *usr,
+      const struct cmd *cmds,
+      struct cmd_reader *reader,
+      const struct cmd_prop *prop,
+      const struct cmd_budget *budget,
+      bool ready);
+static enum error
+take_cmd(void *usr,
+	 const struct cmd *cmds,
+	 struct cmd_reader *reader,
+	 const struct cmd_prop *prop);
+static enum error
+take_frame(void *usr,
+	   const struct cmd *cmds,
+	   struct cmd_reader *reader,
+	   const struct cmd_prop *prop);
+static enum error
+run_line(void *usr,
+	 const struct cmd *cmds,
+	 struct cmd_reader *reader,
+	 char *line,
+	 size_t length,
+	 const struct cmd_prop *prop);
+static enum error
+run_cmd(void *usr,
+	const struct cmd *cmds,
+	struct cmd_reader *reader,
+	const char *word,
+	const char *arg,
+	const struct cmd_prop *prop);
+static enum error
+split_tag(char *line,
+	  struct line_tokens *tokens,
+	  struct cmd_reader *reader);
+static enum error
+start_job(void *usr,
+	  const struct cmd *cmd,
+	  const struct cmd_reader *reader,
+	  const char *word,
+	  const char *arg);
+static void	free_job(struct cmd_job *job);
+static enum error
+run_nary(void *usr,
+	 const struct cmd *cmd,
+	 struct cmd_reader *reader,
+	 const char *arg);
+static enum error
+parse_nary(const char *spec,
+	   char *rest,
+	   union cmd_arg *argv,
+	   size_t *argc,
+	   const char **why);
+static enum error
+parse_arg(char spec,
+	  char *token,
+	  union cmd_arg *value,
+	  const char **why);
+static bool	parse_int(const char *token, int64_t *value);
+static bool	parse_usecs(const char *token, uint64_t *value);
+static bool	has_input(const struct cmd_reader *reader);
+static enum error next_line(struct cmd_reader *reader, char **line, size_t *length);
+static void	skip_line(struct cmd_reader *reader);
+static enum error fill_reader(struct cmd_reader *reader, bool *full);
+static bool	accepts(const struct cmd *cmd, const char *arg, size_t len);
+static bool
+superseded(const struct cmd *cmds,
+	   const struct cmd_reader *reader,
+	   const struct cmd *cmd,
+	   const char *word);
+static const struct cmd *find_cmd(const struct cmd *cmds, const char *word);
+static const struct cmd *scan_cmds(const struct cmd *cmds, const char *word);
+static struct cmd_index *find_index(const struct cmd *cmds);
+static void	build_index(struct cmd_index *index, const struct cmd *cmds);
+static void	free_index(struct cmd_index *index);
+static size_t	index_slot(unsigned bits, const uint32_t *keys, uint32_t key);
+
+/* Sets up 'reader' to read commands from the file descriptor 'fd'.
+ *
+ * The reader reads from the descriptor directly, so nothing else should read
+ * from it (in particular through stdio) while the reader is in use.  Its
+ * buffer is allocated when the first command arrives and then reused
+ * (growing if necessary) for every later command, so it MUST be released
+ * with free_cmd_reader when no longer needed.
+ */
+void
+init_cmd_reader(struct cmd_reader *reader, int fd)
+{
+	struct stream	stream = fd_stream(fd);
+
+	init_stream_reader(reader, &stream);
+}
+
+/* Sets up 'reader' to read commands from 'stream' (see stream.h), which is
+ * copied; otherwise, this is as init_cmd_reader.
+ *
+ * Streams that never block, such as shared-memory rings, work with every
+ * way of taking commands; handle_cmd waits on them with stream_wait.
+ */
+void
+init_stream_reader(struct cmd_reader *reader, const struct stream *stream)
+{
+	reader->stream = *stream;
+	reader->buffer = NULL;
+	reader->size = 0;
+	reader->start = 0;
+	reader->end = 0;
+	reader->eof = false;
+	reader->batch = false;
+	reader->skipping = false;
+	reader->mode = WIRE_TEXT;
+	reader->next_mode = WIRE_TEXT;
+	reader->tag = NULL;
+	reader->tag_len = 0;
+	reader->read_at = 0;
+	init_arena(&(reader->arena));
+}
+
+/* Releases the buffer and arena of 'reader'.  The stream is left open. */
+void
+free_cmd_reader(struct cmd_reader *reader)
+{
+	SAFE_FREE(&(reader->buffer));
+	reader->size = 0;
+	reader->start = 0;
+	reader->end = 0;
+	free_arena(&(reader->arena));
+}
 
 /*
- * Checks to see if there is a command waiting on stdin and, if there is,
- * sends it to the command handler.
+ * Checks to see if there is a complete command waiting on the reader's
+ * stream and, if there is, runs it; this never waits for input.  This is a
+ * wrapper around 'try_cmd' that doesn't count half a command as an error.
  *
  * 'usr' is a pointer to any user data that should be passed to executed
  * commands; 'cmds' is a pointer to an END_CMDS-terminated array of command
  * definitions (see cmd.h for details).
  */
 enum error
-check_commands(void *usr, const struct cmd *cmds)
+check_commands(void *usr, const struct cmd *cmds, struct cmd_reader *reader)
+{
+	enum error	err;
+
+	err = try_cmd(usr, cmds, reader, NULL);
+	if (err == E_INCOMPLETE)
+		err = E_OK;
+
+	return err;
+}
+
+/*
+ * Runs the next command on the reader's stream if all of it has arrived,
+ * reading whatever input is waiting (at most once) but never waiting for
+ * more.  Partial commands are kept in the reader until the rest arrives,
+ * and whole commands beyond the first are kept for later calls.
+ *
+ * Returns E_INCOMPLETE if there is no complete command yet, and E_EOF if
+ * there are no more commands at all; see handle_cmd for the arguments.
+ */
+enum error
+try_cmd(void *usr,
+	const struct cmd *cmds,
+	struct cmd_reader *reader,
+	const struct cmd_prop *prop)
+{
+	enum error	err;
+
+	err = take_cmd(usr, cmds, reader, prop);
+	if (err == E_INCOMPLETE &&
+	    !reader->eof &&
+	    stream_maybe_input(&(reader->stream))) {
+		err = fill_reader(reader, NULL);
+		if (err == E_OK)
+			err = take_cmd(usr, cmds, reader, prop);
+	}
+
+	return err;
+}
+
+/*
+ * As 'check_commands', but processes every command that is waiting on the
+ * reader's stream instead of just the first, reading whatever input has
+ * arrived without blocking.
+ *
+ * 'budget', if not NULL, limits how many commands are processed and how long
+ * is spent processing them; anything left over is kept for the next call.
+ * Processing also stops at the first command to fail, whose error is
+ * returned.
+ */
+enum error
+drain_commands(void *usr,
+	       const struct cmd *cmds,
+	       struct cmd_reader *reader,
+	       const struct cmd_prop *prop,
+	       const struct cmd_budget *budget)
 {
+	return drain(usr, cmds, reader, prop, budget, false);
+}
+
+/* Registers the listener's reader with 'reactor', so that whenever input
+ * arrives on it the reactor drains commands from it (see drain_commands)
+ * within the listener's budget.  Commands that fail with a normal-severity
+ * error are answered and skipped, so only end of file and fatal errors
+ * reach the reactor.  Commands already read in, say by try_cmd, and streams
+ * that aren't polled are seen to on the reactor's next turn.
+ *
+ * The listener MUST stay alive, and unmoved, until it is removed from the
+ * reactor with reactor_remove.
+ */
+enum error
+listen_commands(struct reactor *reactor, struct cmd_listener *listener)
+{
+	enum error	err;
+	struct cmd_reader *reader = listener->reader;
+
+	listener->reactor = reactor;
+	listener->again = false;
+
+	err = reactor_add(reactor, reader->stream.fd, handle_listener, listener);
+
+	/*
+	 * Input read before now won't show up in a poll, and nor will input
+	 * on streams that aren't polled until they have been read dry.
+	 */
+	if (err == E_OK && (!reader->stream.ops->polled || has_input(reader))) {
+		listener->again = true;
+		reactor_again(reactor, reader->stream.fd);
+	}
+
+	return err;
+}
+
+/* Reactor handler for command listeners. */
+static enum error
+handle_listener(void *data, int fd)
+{
+	enum error	err;
+	struct cmd_listener *l = data;
+
+	/* Being called back for leftovers doesn't mean more input came */
+	err = drain(l->usr, l->cmds, l->reader, l->prop, &(l->budget),
+		    !l->again);
+
+	/* Carry on past bad commands, and anything the budget held back */
+	l->again = has_input(l->reader);
+	if (l->again)
+		reactor_again(l->reactor, fd);
+
+	/* Bad commands have already been answered, so needn't stop the reactor */
+	if (err != E_OK && err != E_EOF && severity(err) == ES_NORMAL)
+		err = E_OK;
+
+	return err;
+}
+
+/* Implementation of drain_commands.  If 'ready' is true, the reader's
+ * descriptor is already known to have input waiting.
+ */
+static enum error
+drain(void *usr,
+      const struct cmd *cmds,
+      struct cmd_reader *reader,
+      const struct cmd_prop *prop,
+      const struct cmd_budget *budget,
+      bool ready)
+{
+	size_t		num_cmds;
+	size_t		pending;
+	bool		timed;
+	bool		polled;
+	bool		full = true;
+	uint64_t	started = 0;
 	enum error	err = E_OK;
 
-	if (input_waiting())
-		err = handle_cmd(usr, cmds, stdin, NULL);
+	timed = (budget != NULL && budget->max_usecs != 0);
+	if (timed)
+		started = monotonic_usecs();
+
+	/*
+	 * Read everything waiting, unless there's a backlog to get through.
+	 * For descriptors, only look for more if the last read filled the
+	 * buffer, as otherwise it would have got everything there was.
+	 * Streams that needn't be polled, like rings, are read until they come
+	 * up empty instead, as that is what arms their own wakeups.
+	 */
+	polled = reader->stream.ops->polled;
+	while (err == E_OK &&
+	       full &&
+	       !reader->eof &&
+	       reader->end - reader->start < READ_HIGH_WATER &&
+	       (ready || stream_maybe_input(&(reader->stream)))) {
+		pending = reader->end - reader->start;
+		err = fill_reader(reader, &full);
+		if (!polled)
+			full = (reader->end - reader->start != pending);
+		ready = false;
+	}
+
+	reader->batch = true;
+	for (num_cmds = 0; err == E_OK; num_cmds++) {
+		if (budget != NULL && budget->max_cmds != 0 &&
+		    budget->max_cmds <= num_cmds)
+			break;
+		if (timed &&
+		    budget->max_usecs <= monotonic_usecs() - started)
+			break;
+
+		err = take_cmd(usr, cmds, reader, prop);
+	}
+	reader->batch = false;
+
+	/* Running out of complete commands just means we're done for now */
+	if (err == E_INCOMPLETE)
+		err = E_OK;
+	else if (err == E_EOF)
+		DBUG(DL_NORMAL, "end of file");
+
+	return err;
+}
+
+/* Processes the command currently waiting on the given reader's stream,
+ * waiting for the rest of it to arrive if necessary.  Loops that mustn't
+ * block should use try_cmd or drain_commands instead.
+ *
+ * If the command is set to be handled by PROPAGATE, it will be sent to every
+ * target in prop; it is an error if prop is NULL and PROPAGATE is reached.
+ */
+enum error
+handle_cmd(void *usr,
+	   const struct cmd *cmds,
+	   struct cmd_reader *reader,
+	   const struct cmd_prop *prop)
+{
+	size_t		pending;
+	enum error	err;
+
+	err = take_cmd(usr, cmds, reader, prop);
+	while (err == E_INCOMPLETE) {
+		pending = reader->end - reader->start;
+		err = fill_reader(reader, NULL);
+
+		/* Streams that don't block need waiting on by hand */
+		if (err == E_OK && !reader->eof &&
+		    reader->end - reader->start == pending)
+			stream_wait(&(reader->stream), false);
+		if (err == E_OK)
+			err = take_cmd(usr, cmds, reader, prop);
+	}
+
+	/* Silently fail if the command is actually end of file */
+	if (err == E_EOF)
+		DBUG(DL_NORMAL, "end of file");
 
 	return err;
 }
-/* Processes the command currently waiting on the given stream.
- * If the command is set to be handled by PROPAGATE, it will be sent through
- * prop; it is an error if prop is NULL and PROPAGATE is reached.
+
+/* Waits on the reader's stream for a command with the word 'word', such as
+ * the takeover from a warm standby (see cuppa_standby), acknowledging it
+ * when it comes.  Every other command is refused with NOPE without being
+ * run.  Commands are only looked for as text lines.
+ *
+ * Returns E_OK once 'word' has arrived, or E_EOF if the stream ends first.
  */
 enum error
-handle_cmd(void *usr, const struct cmd *cmds, FILE *in, FILE *prop)
+await_cmd(struct cmd_reader *reader, const char *word)
 {
-	ssize_t		length;
+	bool		found = false;
+	char           *line = NULL;
+	size_t		length = 0;
+	size_t		pending;
+	size_t		word_len;
+	struct line_tokens tokens;
 	enum error	err = E_OK;
-	char           *buffer = NULL;
-	char           *word = NULL;
+
+	word_len = strlen(word);
+	while (!found && err != E_EOF && err != E_NO_MEM &&
+	       err != E_INTERNAL_ERROR) {
+		err = next_line(reader, &line, &length);
+		if (err == E_INCOMPLETE) {
+			pending = reader->end - reader->start;
+			err = fill_reader(reader, NULL);
+			if (err == E_OK && !reader->eof &&
+			    reader->end - reader->start == pending)
+				stream_wait(&(reader->stream), false);
+			continue;
+		}
+		if (err != E_OK)
+			continue;
+
+		if (capture_enabled)
+			capture_in(line, length);
+		tokenize_line(line, length, &tokens);
+		if (tokens.word_len != 0 && line[tokens.word] == '@')
+			err = split_tag(line, &tokens, reader);
+
+		set_response_tag(reader->tag, reader->tag_len);
+		if (err == E_OK && tokens.word_len == word_len &&
+		    memcmp(line + tokens.word, word, word_len) == 0 &&
+		    memchr(line, '\0', length) == NULL) {
+			response_word_arg(R_OKAY, word, NULL);
+			found = true;
+		} else if (err == E_OK)
+			err = error(E_COMMAND_REJECTED, "%s", MSG_CMD_STANDBY);
+		set_response_tag(NULL, 0);
+		reader->tag = NULL;
+		reader->tag_len = 0;
+	}
+
+	return found ? E_OK : err;
+}
+
+/* Builds a dispatch index for 'cmds', so that commands are looked up in it
+ * instead of by walking the table, until forget_cmds.  Tables generated by
+ * mkcmds.awk have theirs built in, and preparing one does nothing; so does
+ * preparing a table twice.  This is part of cuppa_init.
+ *
+ * Only 'cmds' itself is indexed.  Entries can't point at other tables, so
+ * there are none to follow: a handler that runs its own sub-commands with
+ * handle_cmd (or anything else taking a table) must prepare that table as
+ * well, on the thread that will run it.
+ *
+ * Indices belong to the calling thread, and are keyed by the table's
+ * address, so the table MUST NOT be changed or freed until it is forgotten.
+ * If there isn't the memory for an index, the table is walked as if it had
+ * never been prepared.
+ */
+void
+prepare_cmds(const struct cmd *cmds)
+{
+	size_t		size;
+	struct cmd_index *grown;
+
+	if (cmds->function_type == C_INDEX || find_index(cmds) != NULL)
+		return;
+
+	if (num_indices == indices_size) {
+		size = (indices_size == 0) ? 4 : indices_size * 2;
+		grown = realloc(indices, size * sizeof(*indices));
+		if (grown == NULL)
+			return;
+		indices = grown;
+		indices_size = size;
+	}
+
+	build_index(&(indices[num_indices++]), cmds);
+}
+
+/* Throws away the dispatch index prepare_cmds built for 'cmds' on this
+ * thread, if there is one.  Do this before changing or freeing a prepared
+ * table.
+ */
+void
+forget_cmds(const struct cmd *cmds)
+{
+	struct cmd_index *index;
+
+	index = find_index(cmds);
+	if (index != NULL) {
+		free_index(index);
+		*index = indices[--num_indices];
+	}
+	if (num_indices == 0) {
+		SAFE_FREE(&indices);
+		indices_size = 0;
+	}
+}
+
+/* Allocates the buffer and arena of 'reader' now, rather than when the first
+ * command arrives.  This is part of cuppa_init.
+ */
+enum error
+prepare_cmd_reader(struct cmd_reader *reader)
+{
+	char           *buffer;
+	enum error	err = E_OK;
+
+	if (reader->size < READ_CHUNK + 1) {
+		buffer = realloc(reader->buffer, READ_CHUNK + 1);
+		if (buffer == NULL)
+			err = error(E_NO_MEM, "%s", MSG_CMD_NOBUF);
+		else {
+			reader->buffer = buffer;
+			reader->size = READ_CHUNK + 1;
+		}
+	}
+
+	/* Scratch memory is only allocated on first use, so use it once */
+	if (err == E_OK) {
+		if (arena_alloc(&(reader->arena), 1, 1) == NULL)
+			err = error(E_NO_MEM, "%s", MSG_CMD_NOBUF);
+		reset_arena(&(reader->arena));
+	}
+
+	return err;
+}
+
+/* Parses and executes the single, null-terminated command line 'line', which
+ * is 'length' bytes long excluding the terminator, as if it had been read
+ * from a text command stream; see handle_cmd for the other arguments.  This
+ * is for commands that don't come from a reader, such as those replayed
+ * from a capture log (see capture.h).
+ *
+ * The line is tokenized in place, so it MUST be writable.
+ */
+enum error
+run_cmd_line(void *usr,
+	     const struct cmd *cmds,
+	     const struct cmd_prop *prop,
+	     char *line,
+	     size_t length)
+{
+	enum error	err;
+	struct cmd_reader reader;
+
+	init_cmd_reader(&reader, -1);
+	if (stats_enabled)
+		reader.read_at = monotonic_usecs();
+
+	/* Keep the arena between calls, so it needn't be set up every time */
+	reader.arena = line_arena;
+	err = run_line(usr, cmds, &reader, line, length, prop);
+	line_arena = reader.arena;
+
+	return err;
+}
+
+/* Takes the next command out of the reader's buffer, in whichever encoding
+ * the reader is in, and runs it.  Doesn't read any more input.
+ *
+ * Returns E_INCOMPLETE if there is no complete command yet, and E_EOF if
+ * there are no more commands at all.
+ */
+static enum error
+take_cmd(void *usr,
+	 const struct cmd *cmds,
+	 struct cmd_reader *reader,
+	 const struct cmd_prop *prop)
+{
+	char           *line = NULL;
+	size_t		length = 0;
+	enum error	err;
+
+	if (reader->mode == WIRE_BINARY)
+		err = take_frame(usr, cmds, reader, prop);
+	else {
+		err = next_line(reader, &line, &length);
+		if (err == E_OK && capture_enabled)
+			capture_in(line, length);
+		if (err == E_OK)
+			err = run_line(usr, cmds, reader, line, length, prop);
+	}
+
+	return err;
+}
+
+/* As 'take_cmd', but for readers in binary mode (see wire.h).  Malformed
+ * frames are thrown away, and a frame cut short by end of file is ignored.
+ */
+static enum error
+take_frame(void *usr,
+	   const struct cmd *cmds,
+	   struct cmd_reader *reader,
+	   const struct cmd_prop *prop)
+{
+	char		word[WORD_LEN];
 	char           *arg = NULL;
-	char           *end = NULL;
-	size_t		num_bytes = 0;
+	size_t		used = 0;
+	enum error	err;
 
-	length = getline(&buffer, &num_bytes, in);
-	dbug("got command: %s", buffer);
+	err = decode_cmd_frame(reader->buffer + reader->start,
+			       reader->end - reader->start,
+			       &used,
+			       word,
+			       &arg);
+	reader->start += used;
 
-	/* Silently fail if the command is actually end of file */
-	if (length == -1) {
-		dbug("end of file");
+	if (err == E_INCOMPLETE && reader->eof) {
+		reader->start = reader->end;
 		err = E_EOF;
+	} else if (err == E_OK) {
+		DBUG(DL_VERBOSE, "got command frame: %s", word);
+		if (capture_enabled)
+			capture_cmd(word, arg);
+
+		if (word[0] == '\0')
+			err = error(E_BAD_COMMAND, "%s", MSG_CMD_NOWORD);
+		else
+			err = run_cmd(usr, cmds, reader, word, arg, prop);
 	}
+
+	return err;
+}
+
+/* Parses and executes the single, null-terminated command line 'line',
+ * which is 'length' bytes long excluding the terminator and has had its
+ * newline removed.
+ */
+static enum error
+run_line(void *usr,
+	 const struct cmd *cmds,
+	 struct cmd_reader *reader,
+	 char *line,
+	 size_t length,
+	 const struct cmd_prop *prop)
+{
+	enum error	err = E_OK;
+	char           *word = NULL;
+	char           *arg = NULL;
+	struct line_tokens tokens;
+
+	DBUG(DL_VERBOSE, "got command: %s", line);
+
+	/* A null would cut the line short without anyone noticing */
+	if (memchr(line, '\0', length) != NULL)
+		err = error(E_BAD_COMMAND, "%s", MSG_CMD_NUL);
+
+	tokenize_line(line, length, &tokens);
+	if (err == E_OK && tokens.word_len != 0 && line[tokens.word] == '@')
+		err = split_tag(line, &tokens, reader);
+	if (err == E_OK && tokens.word_len == 0)
+		err = error(E_BAD_COMMAND, MSG_CMD_NOWORD);
 	if (err == E_OK) {
-		end = (buffer + length);
+		/* Terminate the word and argument in place */
+		word = line + tokens.word;
+		word[tokens.word_len] = '\0';
+		if (tokens.arg_len != 0) {
+			arg = line + tokens.arg;
+			arg[tokens.arg_len] = '\0';
+		}
 
-		word = skip_space(buffer);
-		if (*word == '\0')
-			err = error(E_BAD_COMMAND, MSG_CMD_NOWORD);
+		err = run_cmd(usr, cmds, reader, word, arg, prop);
 	}
+	reader->tag = NULL;
+	reader->tag_len = 0;
+	DBUG(DL_VERBOSE, "command processed");
+
+	return err;
+}
+
+/* Takes the tag off the front of a command line, whose tokens are in
+ * 'tokens', and re-tokenizes the rest of the line.  The tag is left in the
+ * reader for the command to be run under.
+ */
+static enum error
+split_tag(char *line,
+	  struct line_tokens *tokens,
+	  struct cmd_reader *reader)
+{
+	size_t		offset;
+	enum error	err = E_OK;
+
+	/* The tag is the first word, less its '@' */
+	if (tokens->word_len == 1 || MAX_TAG_LEN < tokens->word_len - 1)
+		err = error(E_BAD_COMMAND, "%s", MSG_CMD_BADTAG);
+	else {
+		reader->tag = line + tokens->word + 1;
+		reader->tag_len = tokens->word_len - 1;
+
+		offset = tokens->arg;
+		tokenize_line(line + offset, tokens->arg_len, tokens);
+		tokens->word += offset;
+		tokens->arg += offset;
+	}
+
+	return err;
+}
+
+/* Executes the command 'word', with argument 'arg' (NULL if none), and
+ * acknowledges it if it succeeds.  Any encoding switch the command asked
+ * for happens after the acknowledgement.
+ */
+static enum error
+run_cmd(void *usr,
+	const struct cmd *cmds,
+	struct cmd_reader *reader,
+	const char *word,
+	const char *arg,
+	const struct cmd_prop *prop)
+{
+	enum error	err;
+
+	running = reader;
+	set_response_tag(reader->tag, reader->tag_len);
+	if (stats_enabled)
+		stats_count_cmd(word);
+
+	err = exec_cmd(usr, cmds, reader, word, arg, prop);
+
 	if (err == E_OK) {
-		/* Set up the argument, replace space around it with nullchar */
-		arg = nullify_space(skip_nonspace(word));
-		if (*arg == '\0')
-			arg = NULL;
-		else
-			nullify_tspace(buffer + length - 1);
+		response_word_arg(R_OKAY, word, arg);
+		if (stats_enabled && reader->read_at != 0)
+			stats_add_latency(monotonic_usecs() - reader->read_at);
+	} else if (err == E_COMMAND_IGNORED)
+		err = E_OK;
+
+	set_response_tag(NULL, 0);
+	running = NULL;
+	reset_arena(&(reader->arena));
 
-		err = exec_cmd(usr, cmds, word, arg, prop);
+	if (reader->next_mode != reader->mode) {
+		reader->mode = reader->next_mode;
+		set_response_mode(reader->mode);
+	}
+
+	return err;
+}
+
+/* Finishes the asynchronous command 'job', which MUST then not be used again.
+ * If 'err' is E_OK, the command is acknowledged; otherwise 'err' is reported
+ * with the message 'why'.  Either way, the response carries the command's tag
+ * and goes to the client the command came from (see set_pull_sink), unless
+ * that client has since gone away.
+ *
+ * This MUST be called from the thread that runs commands.
+ */
+void
+complete_cmd(struct cmd_job *job, enum error err, const char *why)
+{
+	struct response_sink *sink = NULL;
+	struct response_sink *old_sink;
+
+	/* The client the command came from may have gone since */
+	old_sink = get_pull_sink();
+	if (job->sink != 0)
+		sink = find_sink(job->sink);
+
+	if (job->sink == 0 || sink != NULL) {
+		set_pull_sink(sink);
+		set_response_tag(job->tag, job->tag_len);
 
 		if (err == E_OK) {
-			if (arg == NULL)
-				response(R_OKAY, "%s", word);
-			else
-				response(R_OKAY, "%s %s", word, arg);
-		} else if (err == E_COMMAND_IGNORED)
-			err = E_OK;
+			response_word_arg(R_OKAY, job->word, job->arg);
+			if (stats_enabled && job->read_at != 0)
+				stats_add_latency(monotonic_usecs() -
+						  job->read_at);
+		} else
+			error(err, "%s", why);
+
+		/* We might have been called from inside another command */
+		if (running != NULL)
+			set_response_tag(running->tag, running->tag_len);
+		else
+			set_response_tag(NULL, 0);
+		set_pull_sink(old_sink);
+	}
+
+	free_job(job);
+}
+
+/* Starts the asynchronous command 'cmd' in a job from the pool, copying
+ * everything it needs out of the reader's buffer.
+ */
+static enum error
+start_job(void *usr,
+	  const struct cmd *cmd,
+	  const struct cmd_reader *reader,
+	  const char *word,
+	  const char *arg)
+{
+	size_t		i;
+	struct cmd_job *job = NULL;
+	enum error	err = E_OK;
+
+	for (i = 0; i < NUM_CMD_JOBS && job == NULL; i++)
+		if (!JOBS[i].in_use)
+			job = &(JOBS[i]);
+
+	if (job == NULL)
+		err = error(E_COMMAND_REJECTED, "%s", MSG_CMD_NOJOB);
+	else if (arg != NULL && (job->arg = strdup(arg)) == NULL)
+		err = error(E_NO_MEM, "%s", MSG_CMD_NOBUF);
+
+	if (err == E_OK) {
+		job->in_use = true;
+		strncpy(job->word, word, WORD_LEN - 1);
+		job->word[WORD_LEN - 1] = '\0';
+		job->sink = (get_pull_sink() == NULL) ? 0 :
+		    sink_id(get_pull_sink());
+		job->tag_len = reader->tag_len;
+		job->read_at = reader->read_at;
+		if (reader->tag != NULL)
+			memcpy(job->tag, reader->tag, reader->tag_len);
+
+		err = cmd->function.acmd(usr, job->arg, job);
+
+		/* Finished commands are acknowledged like any other */
+		if (err == E_INCOMPLETE)
+			err = E_COMMAND_IGNORED;
+		else
+			free_job(job);
+	}
+
+	return err;
+}
+
+/* Splits the argument of the NARG command 'cmd' (NULL if none) according to
+ * its spec, and runs the command on the result.  The argument is split in a
+ * copy in the reader's arena, so it isn't touched.
+ */
+static enum error
+run_nary(void *usr,
+	 const struct cmd *cmd,
+	 struct cmd_reader *reader,
+	 const char *arg)
+{
+	size_t		argc;
+	char           *rest = NULL;
+	const char     *why = NULL;
+	union cmd_arg	argv[CMD_MAX_ARGS];
+	enum error	err = E_OK;
+
+	if (arg != NULL && (rest = arena_strdup(&(reader->arena),
+						arg)) == NULL)
+		err = error(E_NO_MEM, "%s", MSG_CMD_NOBUF);
+	else if ((err = parse_nary(cmd->function.narg.spec,
+				   rest,
+				   argv,
+				   &argc,
+				   &why)) != E_OK)
+		err = error(err, "%s", why);
+	else
+		err = cmd->function.narg.func(usr, argc, argv);
+
+	return err;
+}
+
+/* Splits 'rest' (NULL if there is no argument), in place, into the arguments
+ * 'spec' asks for, putting them in 'argv' and their number in *argc.  Spaces
+ * are what tokenize_line takes them to be (see skip_space).  On
+ * failure, returns the error without reporting it, and points *why at the
+ * message to report it with.
+ */
+static enum error
+parse_nary(const char *spec,
+	   char *rest,
+	   union cmd_arg *argv,
+	   size_t *argc,
+	   const char **why)
+{
+	char           *token;
+	enum error	err = E_OK;
+
+	if (CMD_MAX_ARGS < strlen(spec)) {
+		*why = MSG_CMD_BADSPEC;
+		return E_INTERNAL_ERROR;
+	}
+
+	for (*argc = 0; err == E_OK && spec[*argc] != '\0'; (*argc)++) {
+		rest = skip_space(rest);
+		if (rest == NULL || *rest == '\0') {
+			*why = MSG_CMD_ARGC;
+			err = E_BAD_COMMAND;
+			break;
+		}
+
+		/* Everything but the rest of the line stops at a space */
+		token = rest;
+		if (spec[*argc] == 'r')
+			rest += strlen(rest);
+		else {
+			rest = skip_nonspace(rest);
+			if (*rest != '\0')
+				*(rest++) = '\0';
+		}
+
+		err = parse_arg(spec[*argc], token, &(argv[*argc]), why);
+	}
+
+	if (err == E_OK)
+		rest = skip_space(rest);
+	if (err == E_OK && rest != NULL && *rest != '\0') {
+		*why = MSG_CMD_ARGC;
+		err = E_BAD_COMMAND;
+	}
+
+	return err;
+}
+
+/* Parses the argument 'token' as the type 'spec' stands for (see NARG).  On
+ * failure, returns the error unreported, with its message in *why.
+ */
+static enum error
+parse_arg(char spec, char *token, union cmd_arg *value, const char **why)
+{
+	enum error	err = E_OK;
+
+	switch (spec) {
+	case 'i':
+		if (!parse_int(token, &(value->i))) {
+			*why = MSG_CMD_BADINT;
+			err = E_BAD_COMMAND;
+		}
+		break;
+	case 'u':
+		if (!parse_usecs(token, &(value->usecs))) {
+			*why = MSG_CMD_BADTIME;
+			err = E_BAD_COMMAND;
+		}
+		break;
+	case 'w':
+	case 'r':
+		value->str = token;
+		break;
+	default:
+		*why = MSG_CMD_BADSPEC;
+		err = E_INTERNAL_ERROR;
+		break;
 	}
-	dbug("command processed");
-	free(buffer);
+
+	return err;
+}
+
+/* Parses 'token' as a whole signed decimal integer. */
+static bool
+parse_int(const char *token, int64_t *value)
+{
+	char           *end;
+	long long	parsed;
+
+	errno = 0;
+	parsed = strtoll(token, &end, 10);
+	if (end == token || *end != '\0' || errno != 0 ||
+	    parsed < INT64_MIN || INT64_MAX < parsed)
+		return false;
+
+	*value = (int64_t)parsed;
+	return true;
+}
+
+/* Parses 'token' as a whole unsigned decimal number of microseconds, or of
+ * milliseconds or seconds if followed by "ms" or "s".
+ */
+static bool
+parse_usecs(const char *token, uint64_t *value)
+{
+	char           *end;
+	uint64_t	unit;
+	unsigned long long parsed;
+
+	/* strtoull would take a sign, and quietly negate */
+	if (!isdigit((unsigned char)*token))
+		return false;
+
+	errno = 0;
+	parsed = strtoull(token, &end, 10);
+	if (errno != 0 || UINT64_MAX < parsed)
+		return false;
+
+	if (*end == '\0' || strcmp(end, "us") == 0)
+		unit = 1;
+	else if (strcmp(end, "ms") == 0)
+		unit = 1000;
+	else if (strcmp(end, "s") == 0)
+		unit = 1000000;
+	else
+		return false;
+
+	if (UINT64_MAX / unit < parsed)
+		return false;
+
+	*value = (uint64_t)parsed * unit;
+	return true;
+}
+
+/* Returns 'job' to the pool. */
+static void
+free_job(struct cmd_job *job)
+{
+	SAFE_FREE(&(job->arg));
+	job->in_use = false;
+}
+
+/* Returns true if the reader has a complete command buffered, so that
+ * draining it again would run a command without waiting for input.  After
+ * end of file this is true until everything left has been taken.
+ */
+bool
+cmd_waiting(const struct cmd_reader *reader)
+{
+	return has_input(reader);
+}
+
+/* Returns the scratch arena of the command being run, or NULL if none is.
+ * Everything taken from it is freed when the command returns.
+ */
+struct arena   *
+cmd_arena(void)
+{
+	return (running == NULL) ? NULL : &(running->arena);
+}
+
+/* Returns true if the reader has a complete command buffered.  Once the
+ * stream has ended, anything left counts, as taking it needn't wait: a last
+ * line without a newline is run, and a cut-short frame is thrown away.
+ */
+static bool
+has_input(const struct cmd_reader *reader)
+{
+	size_t		len;
+	uint32_t	frame_len;
+	bool		ready = false;
+
+	len = reader->end - reader->start;
+	if (reader->eof)
+		ready = (len != 0);
+	else if (len != 0 && reader->mode == WIRE_BINARY) {
+		if (WIRE_LEN_SIZE <= len) {
+			/* Frames too long to accept are ready to throw away */
+			frame_len = wire_get_u32(reader->buffer + reader->start);
+			ready = (frame_len <= len - WIRE_LEN_SIZE ||
+				 WIRE_MAX_FRAME < frame_len);
+		}
+	} else if (len != 0)
+		ready = (memchr(reader->buffer + reader->start, '\n', len) !=
+			 NULL);
+
+	return ready;
+}
+
+/* Takes the next line out of the reader's buffer, without reading any more
+ * input.  The line is null-terminated in place of its newline, and lives in
+ * the buffer until the reader is next filled.
+ *
+ * Returns E_INCOMPLETE if there is no complete line yet, and E_EOF if there
+ * are no more lines at all.  A trailing line with no newline is only
+ * returned once the stream has ended.
+ */
+static enum error
+next_line(struct cmd_reader *reader, char **line, size_t *length)
+{
+	char           *start = NULL;
+	char           *newline = NULL;
+	enum error	err = E_OK;
+
+	if (reader->skipping)
+		skip_line(reader);
+
+	if (reader->start != reader->end) {
+		start = reader->buffer + reader->start;
+		newline = memchr(start, '\n', reader->end - reader->start);
+	}
+
+	if ((newline == NULL && CMD_MAX_LINE < reader->end - reader->start) ||
+	    (newline != NULL && CMD_MAX_LINE < (size_t)(newline - start))) {
+		/* Throw the line away, including any of it still to come */
+		reader->skipping = true;
+		skip_line(reader);
+		err = error(E_BAD_COMMAND, "%s", MSG_CMD_LONGLINE);
+	} else if (reader->skipping)
+		err = reader->eof ? E_EOF : E_INCOMPLETE;
+	else if (newline != NULL) {
+		*newline = '\0';
+		*length = (size_t)(newline - start);
+		reader->start += *length + 1;
+	} else if (!reader->eof)
+		err = E_INCOMPLETE;
+	else if (reader->start == reader->end)
+		err = E_EOF;
+	else {
+		/* fill_reader always leaves room for this terminator */
+		reader->buffer[reader->end] = '\0';
+		*length = reader->end - reader->start;
+		reader->start = reader->end;
+	}
+
+	if (err == E_OK)
+		*line = start;
+
+	return err;
+}
+
+/* Throws away input up to and including the next newline, or all of it if
+ * there isn't one yet, in which case the rest of the line goes when it
+ * arrives.
+ */
+static void
+skip_line(struct cmd_reader *reader)
+{
+	char           *newline = NULL;
+
+	if (reader->start != reader->end)
+		newline = memchr(reader->buffer + reader->start,
+				 '\n',
+				 reader->end - reader->start);
+
+	if (newline == NULL)
+		reader->start = reader->end;
+	else {
+		reader->start = (size_t)(newline - reader->buffer) + 1;
+		reader->skipping = false;
+	}
+}
+
+/* Reads once from the reader's descriptor into its buffer, blocking if no
+ * input is waiting (unless the descriptor is non-blocking).  Hitting end of
+ * file, or failing to read, marks the reader as finished.
+ *
+ * If 'full' is not NULL, it is set to whether the read filled all of the
+ * space available, in which case there may be more input waiting.
+ */
+static enum error
+fill_reader(struct cmd_reader *reader, bool *full)
+{
+	char           *buffer;
+	size_t		size;
+	size_t		room = 0;
+	ssize_t		num_read = 0;
+	enum error	err = E_OK;
+
+	/* Move any unprocessed input back to the start of the buffer */
+	if (reader->start != 0) {
+		memmove(reader->buffer,
+			reader->buffer + reader->start,
+			reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+
+	/* Always keep a byte free to terminate an unfinished last line */
+	if (reader->size - reader->end < READ_CHUNK + 1) {
+		size = reader->end + READ_CHUNK + 1;
+		if (size < reader->size * 2)
+			size = reader->size * 2;
+
+		buffer = realloc(reader->buffer, size);
+		if (buffer == NULL)
+			err = error(E_NO_MEM, "%s", MSG_CMD_NOBUF);
+		else {
+			reader->buffer = buffer;
+			reader->size = size;
+		}
+	}
+
+	if (err == E_OK) {
+		room = reader->size - reader->end - 1;
+		num_read = stream_read(&(reader->stream),
+				       reader->buffer + reader->end,
+				       room);
+
+		/* Non-blocking streams may have had nothing after all */
+		if (num_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			num_read = 0;
+		else if (num_read == -1) {
+			/* There's no coming back from this, so treat it as EOF */
+			err = error(E_INTERNAL_ERROR, "%s", MSG_CMD_READ);
+			reader->eof = true;
+		} else if (num_read == 0)
+			reader->eof = true;
+		else {
+			reader->end += (size_t)num_read;
+			if (stats_enabled) {
+				stats_add_bytes(SS_IN, (uint64_t)num_read);
+				reader->read_at = monotonic_usecs();
+			}
+		}
+	}
+	if (full != NULL)
+		*full = (err == E_OK && (size_t)num_read == room);
 
 	return err;
 }
@@ -134,38 +1299,292 @@ handle_cmd(void *usr, const struct cmd *cmds, FILE *in, FILE *prop)
 static enum error
 exec_cmd(void *usr,
 	 const struct cmd *cmds,
+	 struct cmd_reader *reader,
 	 const char *word,
 	 const char *arg,
-	 FILE *prop)
+	 const struct cmd_prop *prop)
 {
-	bool		gotcmd;
 	const struct cmd *cmd;
 	enum error	err = E_OK;
 
-	for (cmd = cmds, gotcmd = false;
-	     cmd->function_type != C_END_OF_LIST && !gotcmd;
+	cmd = find_cmd(cmds, word);
+	if (cmd == NULL)
+		err = error(E_BAD_COMMAND, "%s", MSG_CMD_NOSUCH);
+	else if ((cmd->flags & CMD_LWW) && reader->batch &&
+		 accepts(cmd, arg, (arg == NULL) ? 0 : strlen(arg)) &&
+		 superseded(cmds, reader, cmd, word))
+		DBUG(DL_VERBOSE, "command superseded: %s", word);
+	else
+		err = exec_cmd_struct(usr, cmd, reader, word, arg, prop);
+
+	return err;
+}
+
+/* Returns true if 'cmd' would take the 'len'-byte argument 'arg' (which
+ * needn't be terminated, and is NULL if there is none) without complaint,
+ * short of running it.  Only LWW commands are checked, and arguments too long
+ * to check are taken as not fitting.
+ */
+static bool
+accepts(const struct cmd *cmd, const char *arg, size_t len)
+{
+	char		copy[LWW_ARG_LEN];
+	size_t		argc;
+	const char     *why;
+	union cmd_arg	argv[CMD_MAX_ARGS];
+
+	switch (cmd->function_type) {
+	case C_NULLARY:
+		return arg == NULL;
+	case C_UNARY:
+		return arg != NULL;
+	case C_NARY:
+		if (arg != NULL && LWW_ARG_LEN <= len)
+			return false;
+		if (arg != NULL) {
+			memcpy(copy, arg, len);
+			copy[len] = '\0';
+		}
+		return parse_nary(cmd->function.narg.spec,
+				  (arg == NULL) ? NULL : copy,
+				  argv,
+				  &argc,
+				  &why) == E_OK;
+	default:
+		return false;
+	}
+}
+
+/* Returns true if one of the next few complete text lines waiting in
+ * 'reader' is the command 'cmd' (called 'word' in 'cmds'), tagged or not,
+ * with an argument it would accept.  The search stops at the first command
+ * switching the encoding, as what follows it may not be text at all.
+ */
+static bool
+superseded(const struct cmd *cmds,
+	   const struct cmd_reader *reader,
+	   const struct cmd *cmd,
+	   const char *word)
+{
+	char		next[WORD_LEN];
+	size_t		i;
+	size_t		len;
+	size_t		offset;
+	size_t		word_len;
+	const char     *line;
+	const char     *newline;
+	const struct cmd *found;
+	struct line_tokens tokens;
+
+	if (reader->mode != WIRE_TEXT)
+		return false;
+
+	word_len = strlen(word);
+	line = reader->buffer + reader->start;
+	for (i = 0; i < LWW_LOOKAHEAD; i++, line = newline + 1) {
+		len = (size_t)(reader->buffer + reader->end - line);
+		newline = (len == 0) ? NULL : memchr(line, '\n', len);
+		if (newline == NULL)
+			break;
+
+		/* Lines run_line would throw out can't supersede anything */
+		len = (size_t)(newline - line);
+		if (CMD_MAX_LINE < len || memchr(line, '\0', len) != NULL)
+			continue;
+
+		tokenize_line(line, len, &tokens);
+		if (tokens.word_len != 0 && line[tokens.word] == '@') {
+			/* Look past the tag, as split_tag does */
+			if (tokens.word_len == 1 ||
+			    MAX_TAG_LEN < tokens.word_len - 1)
+				continue;
+			offset = tokens.arg;
+			tokenize_line(line + offset, tokens.arg_len, &tokens);
+			tokens.word += offset;
+			tokens.arg += offset;
+		}
+		if (tokens.word_len == 0 || WORD_LEN <= tokens.word_len)
+			continue;
+
+		memcpy(next, line + tokens.word, tokens.word_len);
+		next[tokens.word_len] = '\0';
+		found = find_cmd(cmds, next);
+		if (found != NULL && found->function_type == C_WIRE)
+			break;
+
+		if (tokens.word_len == word_len &&
+		    memcmp(next, word, word_len) == 0 &&
+		    accepts(cmd,
+			    (tokens.arg_len == 0) ? NULL : line + tokens.arg,
+			    tokens.arg_len))
+			return true;
+	}
+
+	return false;
+}
+
+/* Finds the first command in 'cmds' that handles 'word', or NULL if none do.
+ * This uses the table's dispatch index, if it has one (see prepare_cmds).
+ */
+static const struct cmd *
+find_cmd(const struct cmd *cmds, const char *word)
+{
+	uint32_t	key;
+	const struct cmd *cmd = NULL;
+	const struct cmd *any;
+	const struct cmd_index *index;
+	const struct cmd_prebuilt *prebuilt;
+
+	if (cmds->function_type == C_INDEX) {
+		/* Generated tables come with their index (see mkcmds.awk) */
+		prebuilt = cmds->function.index;
+		if (pack_word(word, &key))
+			cmd = prebuilt->entries[index_slot(prebuilt->bits,
+							   prebuilt->keys,
+							   key)];
+		any = prebuilt->any;
+	} else {
+		index = find_index(cmds);
+		if (index == NULL || index->scan)
+			return scan_cmds(cmds, word);
+
+		/* Unpackable words can't be in the index, but may hit ANY */
+		if (pack_word(word, &key))
+			cmd = index->entries[index_slot(index->bits,
+							index->keys,
+							key)];
+		any = index->any;
+	}
+
+	if (any != NULL && (cmd == NULL || any < cmd))
+		cmd = any;
+
+	return cmd;
+}
+
+/* As 'find_cmd', but walks the table top-down instead of using an index. */
+static const struct cmd *
+scan_cmds(const struct cmd *cmds, const char *word)
+{
+	const struct cmd *cmd;
+
+	for (cmd = cmds; cmd->function_type != C_END_OF_LIST; cmd++)
+		if (cmd->word == ANY || strcmp(cmd->word, word) == 0)
+			return cmd;
+
+	return NULL;
+}
+
+/* Returns this thread's dispatch index for 'cmds', or NULL if it hasn't
+ * been prepared.
+ */
+static struct cmd_index *
+find_index(const struct cmd *cmds)
+{
+	size_t		i;
+
+	for (i = 0; i < num_indices; i++)
+		if (indices[i].cmds == cmds)
+			return &(indices[i]);
+
+	return NULL;
+}
+
+/* Builds a dispatch index for 'cmds' into 'index'.
+ *
+ * If the table has words that can't be packed, or there isn't enough memory
+ * to index it, the index is instead marked as needing a linear scan.  This is
+ * remembered, so the build isn't retried on every command.
+ */
+static void
+build_index(struct cmd_index *index, const struct cmd *cmds)
+{
+	size_t		num_cmds;
+	size_t		num_slots;
+	size_t		slot;
+	uint32_t	key;
+	const struct cmd *cmd;
+
+	for (num_cmds = 0;
+	     cmds[num_cmds].function_type != C_END_OF_LIST;
+	     num_cmds++);
+
+	/* Keep the index at most half full, so probe runs stay short */
+	for (index->bits = 3;
+	     ((size_t)1 << index->bits) < num_cmds * 2;
+	     index->bits++);
+	num_slots = (size_t)1 << index->bits;
+
+	index->cmds = cmds;
+	index->any = NULL;
+	index->keys = calloc(num_slots, sizeof(*index->keys));
+	index->entries = calloc(num_slots, sizeof(*index->entries));
+	index->scan = (index->keys == NULL || index->entries == NULL);
+
+	for (cmd = cmds;
+	     cmd->function_type != C_END_OF_LIST && !index->scan;
 	     cmd++) {
-		if (cmd->word == ANY ||
-		    strcmp(cmd->word, word) == 0) {
-			gotcmd = true;
-			err = exec_cmd_struct(usr, cmd, word, arg, prop);
+		if (cmd->word == ANY) {
+			if (index->any == NULL)
+				index->any = cmd;
+		} else if (!pack_word(cmd->word, &key))
+			index->scan = true;
+		else {
+			/* Earlier words shadow later copies of themselves */
+			slot = index_slot(index->bits, index->keys, key);
+			if (index->keys[slot] == 0) {
+				index->keys[slot] = key;
+				index->entries[slot] = cmd;
+			}
 		}
 	}
 
-	if (!gotcmd)
-		err = error(E_BAD_COMMAND, "%s", MSG_CMD_NOSUCH);
+	if (index->scan) {
+		SAFE_FREE(&(index->keys));
+		SAFE_FREE(&(index->entries));
+	}
+}
 
-	return err;
+/* Frees the storage held by 'index'. */
+static void
+free_index(struct cmd_index *index)
+{
+	SAFE_FREE(&(index->keys));
+	SAFE_FREE(&(index->entries));
+	index->cmds = NULL;
+}
+
+/* Finds the slot in an index of 2^'bits' slots, whose keys are 'keys',
+ * holding 'key', or the empty slot where it would go if it isn't there.
+ *
+ * NOTE: mkcmds.awk lays out prebuilt indices the same way; keep it in step
+ * with any change here.
+ */
+static size_t
+index_slot(unsigned bits, const uint32_t *keys, uint32_t key)
+{
+	size_t		mask;
+	size_t		slot;
+
+	mask = ((size_t)1 << bits) - 1;
+	for (slot = (uint32_t)(key * INDEX_HASH_MUL) >> (32 - bits);
+	     keys[slot] != 0 && keys[slot] != key;
+	     slot = (slot + 1) & mask);
+
+	return slot;
 }
 
 static enum error
 exec_cmd_struct(void *usr,
 		const struct cmd *cmd,
+		struct cmd_reader *reader,
 		const char *word,
 		const char *arg,
-		FILE *prop)
+		const struct cmd_prop *prop)
 {
 	enum error	err = E_OK;
+	enum wire_mode	mode;
+	uint32_t	mask;
 
 	switch (cmd->function_type) {
 	case C_NULLARY:	/* No arguments */
@@ -180,6 +1599,12 @@ exec_cmd_struct(void *usr,
 		else
 			err = cmd->function.ucmd(usr, arg);
 		break;
+	case C_ASYNC:		/* Optional argument, may finish later */
+		err = start_job(usr, cmd, reader, word, arg);
+		break;
+	case C_NARY:		/* Typed arguments */
+		err = run_nary(usr, cmd, reader, arg);
+		break;
 	case C_REJECT:		/* Throw a wobbly */
 		err = error(E_COMMAND_REJECTED, "%s", cmd->function.reason);
 		break;
@@ -189,15 +1614,39 @@ exec_cmd_struct(void *usr,
 	case C_PROPAGATE:
 		if (prop == NULL)
 			err = error(E_INTERNAL_ERROR, "%s", MSG_CMD_NOPROP);
-		else {
-			if (arg == NULL)
-				fprintf(prop, "%s\n", word);
-			else
-				fprintf(prop, "%s %s\n", word, arg);
-			fflush(prop);
-		}
+		else
+			forward_cmd(prop, word, arg);
 		err = E_COMMAND_IGNORED;
 		break;
+	case C_WIRE:		/* Switched over by run_cmd after the OKAY */
+		if (arg == NULL)
+			err = error(E_BAD_COMMAND, "%s", MSG_CMD_ARGU);
+		else if (!parse_wire_mode(arg, &mode))
+			err = error(E_BAD_COMMAND, "%s", MSG_WIRE_NOSUCH);
+		else
+			reader->next_mode = mode;
+		break;
+	case C_SUBSCRIBE:
+		if (arg == NULL)
+			err = error(E_BAD_COMMAND, "%s", MSG_CMD_ARGU);
+		else if (!parse_response_mask(arg, &mask))
+			err = error(E_BAD_COMMAND, "%s", MSG_CMD_BADMASK);
+		else
+			set_response_mask(mask);
+		break;
+	case C_STATS:
+		if (arg == NULL)
+			dump_stats();
+		else if (strcmp(arg, "on") == 0)
+			set_stats_enabled(true);
+		else if (strcmp(arg, "off") == 0)
+			set_stats_enabled(false);
+		else if (strcmp(arg, "reset") == 0)
+			reset_stats();
+		else
+			err = error(E_BAD_COMMAND, "%s", MSG_CMD_BADSTATS);
+		break;
+	case C_INDEX:		/* Never matches, as its word is empty */
 	case C_END_OF_LIST:
 		err = error(E_INTERNAL_ERROR, "%s", MSG_CMD_HITEND);
 		break;
@@ -205,3 +1654,42 @@ exec_cmd_struct(void *usr,
 
 	return err;
 }
+
+/* Forwards a command to every one of the propagation targets in 'prop', as
+ * a line of text.  The word and argument are written straight out from
+ * wherever they are, so nothing is formatted or copied per target.
+ *
+ * A target that can't be written to is reported, but doesn't stop the
+ * command going to the others.
+ */
+static void
+forward_cmd(const struct cmd_prop *prop,
+	    const char *word,
+	    const char *arg)
+{
+	size_t		i;
+	int		num_iov;
+	struct iovec	iov[4];
+	struct iovec	todo[4];
+
+	iov[0].iov_base = (void *)word;
+	iov[0].iov_len = strlen(word);
+	num_iov = 1;
+	if (arg != NULL) {
+		iov[1].iov_base = (void *)" ";
+		iov[1].iov_len = 1;
+		iov[2].iov_base = (void *)arg;
+		iov[2].iov_len = strlen(arg);
+		num_iov = 3;
+	}
+	iov[num_iov].iov_base = (void *)"\n";
+	iov[num_iov].iov_len = 1;
+	num_iov++;
+
+	for (i = 0; i < prop->num_streams; i++) {
+		/* stream_writev_all eats its vector as it goes */
+		memcpy(todo, iov, sizeof(iov));
+		if (!stream_writev_all(&(prop->streams[i]), todo, num_iov))
+			error(E_INTERNAL_ERROR, "%s", MSG_CMD_PROPW);
+	}
+}
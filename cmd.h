@@ -34,16 +34,23 @@
 #ifndef CUPPA_CMD_H
 #define CUPPA_CMD_H
 
-#include <stdio.h>		/* FILE */
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* int64_t, uint64_t */
 
+#include "arena.h"		/* struct arena */
 #include "constants.h"		/* WORD_LEN */
 #include "errors.h"		/* enum error */
+#include "io.h"			/* struct reactor, enum wire_mode */
+#include "stream.h"		/* struct stream */
 
 /**
  * Any code defining a set of commands SHOULD use these macros and MUST
  * terminate with END_CMDS or an equivalent.
  *
- * Sets of commands are processed top-down.
+ * Sets are walked top-down for each command unless they have been given a
+ * dispatch index with prepare_cmds (which cuppa_init and run_cuppa_ctx do),
+ * in which case they MUST NOT be modified or freed until forget_cmds.
  *
  * Example:
  *
@@ -51,16 +58,83 @@
  * command_with_an_argument), REJECT("ecme", "this command is obsolete, use
  * acme instead"),
  * END_CMDS };
+ *
+ * WIRE commands take the name of an encoding ("text" or "binary") and switch
+ * both the reader they arrive on and standard out over to it, once they have
+ * been acknowledged in the old encoding.  Every command set works with either
+ * encoding; see wire.h for the binary one.
+ *
+ * SUBSCRIBE commands take a list of response names, or "*", and set which
+ * push responses the client sending them gets (see set_response_mask).
+ *
+ * STATS commands with no argument send the statistics gathered so far as PERF
+ * responses; with "on", "off" or "reset" they start gathering, stop gathering
+ * or clear them (see stats.h).
+ *
+ * A text command line can start with '@' and a tag of up to MAX_TAG_LEN
+ * characters, which is put on every pull response the command causes (see
+ * set_response_tag).  This lets clients pipeline commands, and match up the
+ * answers to ACMD commands that finish out of order.
+ *
+ * NARG commands take a fixed list of space-separated arguments, whose types
+ * are given by a spec string with one character per argument:
+ *
+ *   i - a signed decimal integer (.i)
+ *   u - a time in microseconds (.usecs), with an optional unit of "us", "ms"
+ *       or "s" straight after the number
+ *   w - a single word (.str)
+ *   r - the rest of the line, spaces and all (.str); this MUST come last
+ *
+ * The arguments are split and checked before the command is called, and a
+ * command with the wrong number or kind of arguments is reported as
+ * E_BAD_COMMAND without reaching it.  For example, NARG("seek", seek, "u")
+ * or NARG("qput", queue_put, "ir").
+ *
+ * Tables can instead be generated at build time by mkcmds.awk, which
+ * refuses duplicate or over-long words and emits the table with its
+ * dispatch index already built, behind a leading CMD_INDEX entry, so that
+ * nothing is set up at run time.  CMD_INDEX entries are only for generated
+ * tables, and only as their first entry.
+ *
+ * NCMD_LWW, UCMD_LWW and NARG_LWW define "last writer wins" commands, for
+ * things like seeks where only the latest matters.  When drain_commands (or
+ * a command listener) reaches one and the same word comes again later in
+ * the input it already has, the earlier command is acknowledged as usual
+ * but not run, so a flood of them costs one run and the pushes from one.
+ * Only text command lines are coalesced, and only when both commands have
+ * arguments they would accept (the right number, of the right types), so a
+ * bad command never takes the place of a good one.  The later command runs
+ * in place of the earlier whether or not the command itself then succeeds.
+ * Nothing past a WIRE command is looked at.
+ *
+ * Commands that need scratch memory (for parsing their arguments, say) can
+ * take it from cmd_arena, for example with SAFE_ACALLOC, instead of the heap.
+ * It is all taken back when the command returns, so MUST NOT be kept past
+ * then; ACMD commands that carry on in the background need their own.
  */
-#define NCMD(word, func) {word, C_NULLARY, {.ncmd = func}}
-#define UCMD(word, func) {word, C_UNARY, {.ucmd = func}}
-#define REJECT(word, why) {word, C_REJECT, {.reason = why}}
-#define PROPAGATE(word) {word, C_PROPAGATE, {.ignore = '\0'}}
-#define IGNORE(word) {word, C_IGNORE, {.ignore = '\0'}}
-#define END_CMDS {"XXXX", C_END_OF_LIST, {.ignore = '\0'}}
+#define NCMD(word, func) {word, C_NULLARY, {.ncmd = func}, 0}
+#define UCMD(word, func) {word, C_UNARY, {.ucmd = func}, 0}
+#define ACMD(word, func) {word, C_ASYNC, {.acmd = func}, 0}
+#define NARG(word, func, spec) {word, C_NARY, {.narg = {func, spec}}, 0}
+#define NCMD_LWW(word, func) {word, C_NULLARY, {.ncmd = func}, CMD_LWW}
+#define UCMD_LWW(word, func) {word, C_UNARY, {.ucmd = func}, CMD_LWW}
+#define NARG_LWW(word, func, spec) \
+	{word, C_NARY, {.narg = {func, spec}}, CMD_LWW}
+#define REJECT(word, why) {word, C_REJECT, {.reason = why}, 0}
+#define PROPAGATE(word) {word, C_PROPAGATE, {.ignore = '\0'}, 0}
+#define IGNORE(word) {word, C_IGNORE, {.ignore = '\0'}, 0}
+#define WIRE(word) {word, C_WIRE, {.ignore = '\0'}, 0}
+#define SUBSCRIBE(word) {word, C_SUBSCRIBE, {.ignore = '\0'}, 0}
+#define STATS(word) {word, C_STATS, {.ignore = '\0'}, 0}
+#define CMD_INDEX(prebuilt) {"", C_INDEX, {.index = prebuilt}, 0}
+#define END_CMDS {"XXXX", C_END_OF_LIST, {.ignore = '\0'}, 0}
 #define ANY NULL		/* Use for matching all commands not yet
 				 * matched */
 
+/* Flags for struct cmd. */
+#define CMD_LWW 0x1u		/* Later commands with the same word supersede
+				 * this one (see NCMD_LWW) */
+
 /*
  * Commands have to follow one of these signatures in order to fit into the
  * command parser - the macro to use is specified in the comment above each
@@ -72,6 +146,46 @@ typedef enum error (*nullary_cmd_ptr) (void *usr);
 /* UCMD - unary command - takes one string argument and user data */
 typedef enum error (*unary_cmd_ptr) (void *usr, const char *arg);
 
+/* Longest text command line accepted, in bytes, not counting the newline.
+ * Longer lines are thrown away and reported as E_BAD_COMMAND, so that a
+ * client can't make a reader buffer without limit.
+ */
+#define CMD_MAX_LINE 32768
+
+/* Most arguments a NARG command can take. */
+#define CMD_MAX_ARGS 8
+
+/* A parsed argument to a NARG command; which member is set depends on the
+ * command's spec (see NARG).
+ */
+union cmd_arg {
+	int64_t		i;	/* 'i' - integer */
+	uint64_t	usecs;	/* 'u' - time in microseconds */
+	const char     *str;	/* 'w', 'r' - word or rest of line */
+};
+
+/*
+ * NARG - n-ary command - takes user data and the arguments its spec asks
+ * for, already parsed.  They stay valid until the command returns.
+ */
+typedef enum error (*nary_cmd_ptr) (void *usr,
+				    size_t argc,
+				    const union cmd_arg *argv);
+
+/* Handle for an asynchronous command that hasn't finished yet. */
+struct cmd_job;
+
+/*
+ * ACMD - asynchronous command - takes user data, an argument (NULL if none)
+ * and a job handle.  Returning E_INCOMPLETE means the command carries on in
+ * the background, and will be finished later with complete_cmd; anything else
+ * finishes it there and then, like any other command.  The argument stays
+ * valid until the command finishes.
+ */
+typedef enum error (*async_cmd_ptr) (void *usr,
+				     const char *arg,
+				     struct cmd_job *job);
+
 /*
  * Type of command, used for the tagged union in struct cmd.  You shouldn't
  * need to use this outside of the macros above in an ideal world.
@@ -79,12 +193,33 @@ typedef enum error (*unary_cmd_ptr) (void *usr, const char *arg);
 enum cmd_type {
 	C_NULLARY,		/* Command accepts no arguments */
 	C_UNARY,		/* Command accepts one argument */
+	C_ASYNC,		/* Command may finish after returning */
+	C_NARY,			/* Command accepts typed arguments */
 	C_REJECT,		/* Command is to be rejected */
-	C_PROPAGATE,		/* Command is to be sent to the prop stream */
+	C_PROPAGATE,		/* Command is to be sent to the prop targets */
 	C_IGNORE,		/* Command is to be ignored without error */
+	C_WIRE,			/* Command switches the wire encoding */
+	C_SUBSCRIBE,		/* Command sets which pushes the client gets */
+	C_STATS,		/* Command dumps or controls statistics */
+	C_INDEX,		/* Not a command: a prebuilt dispatch index */
 	C_END_OF_LIST		/* Sentinel for end of command list */
 };
 
+struct cmd;
+
+/*
+ * Prebuilt dispatch index for a command table, as emitted by mkcmds.awk.
+ * This is an open-addressed hash table from packed command words (see
+ * pack_word) to their entries, with the same layout cmd.c builds at run
+ * time for tables without one.
+ */
+struct cmd_prebuilt {
+	unsigned	bits;	/* Binary logarithm of the number of slots */
+	const uint32_t *keys;	/* Packed words, 0 marking an empty slot */
+	const struct cmd *const *entries;	/* First entry for each word */
+	const struct cmd *any;	/* First ANY entry in the table, or NULL */
+};
+
 /*
  * Command structure - you shouldn't ever need to use this directly.  Use the
  * macros above where possible.
@@ -95,16 +230,119 @@ struct cmd {
 	union {
 		nullary_cmd_ptr	ncmd;	/* No-argument command */
 		unary_cmd_ptr	ucmd;	/* One-argument command */
+		async_cmd_ptr	acmd;	/* Asynchronous command */
+		struct {
+			nary_cmd_ptr	func;	/* The command */
+			const char     *spec;	/* Argument types */
+		}		narg;	/* Typed-argument command */
 		char           *reason;	/* Reason for error pseudo-commands */
+		const struct cmd_prebuilt *index;	/* For CMD_INDEX */
 		char		ignore;	/* Use with special commands */
 	}		function;	/* Function pointer to actual command */
+	unsigned	flags;	/* CMD_* flags; 0 if none */
+};
+
+/*
+ * Command reader - holds the stream commands are read from, and a buffer
+ * that is reused across commands so that reading them doesn't touch the heap
+ * once the buffer has grown to fit the input.
+ *
+ * Set up with init_cmd_reader (or init_stream_reader) and release with
+ * free_cmd_reader.  Don't touch the fields directly.
+ */
+struct cmd_reader {
+	struct stream	stream;	/* Stream to read commands from */
+	char	       *buffer;	/* Input buffer, reused between commands */
+	size_t		size;	/* Allocated size of 'buffer' in bytes */
+	size_t		start;	/* Offset of first unprocessed byte */
+	size_t		end;	/* Offset one past the last byte read */
+	bool		eof;	/* True if the stream has hit end of file */
+	enum wire_mode	mode;	/* Encoding commands arrive in */
+	enum wire_mode	next_mode;	/* Encoding to switch to after this
+					 * command */
+	const char     *tag;	/* Tag of the command being run, or NULL */
+	size_t		tag_len;	/* Length of 'tag' */
+	uint64_t	read_at;	/* When input last arrived, if timing */
+	bool		batch;	/* Draining, so LWW commands may coalesce? */
+	bool		skipping;	/* Throwing away an over-long line? */
+	struct arena	arena;	/* Scratch memory for commands (cmd_arena) */
+};
+
+/*
+ * Propagation targets - the streams that PROPAGATE commands are forwarded
+ * to.  Each command goes to every target in turn, as its word, a space and
+ * its argument (if any) and a newline, written straight from the reader's
+ * buffer with no per-target formatting.  Commands that arrived as binary
+ * frames are forwarded as text too.
+ */
+struct cmd_prop {
+	const struct stream *streams;	/* Streams to forward commands to */
+	size_t		num_streams;	/* Number of streams in 'streams' */
+};
+
+/*
+ * Limits on how much work drain_commands does in one call, so that a flood of
+ * commands can't starve the rest of the program.  A limit of 0 means no
+ * limit.
+ */
+struct cmd_budget {
+	size_t		max_cmds;	/* Maximum number of commands to run */
+	uint64_t	max_usecs;	/* Maximum time to spend, in usecs */
+};
+
+/*
+ * Command listener - everything a reactor needs to drain commands from a
+ * reader whenever input arrives on it.  Fill in everything but 'reactor',
+ * then pass to listen_commands.
+ */
+struct cmd_listener {
+	void	       *usr;	/* User data to pass to commands */
+	const struct cmd *cmds;	/* END_CMDS-terminated command set */
+	struct cmd_reader *reader;	/* Reader to take commands from */
+	const struct cmd_prop *prop;	/* PROPAGATE targets, or NULL if none */
+	struct cmd_budget budget;	/* Limits on each batch of commands */
+	struct reactor *reactor;	/* Reactor listened on (set for you) */
+	bool		again;	/* Called back without input? (set for you) */
 };
 
-enum error	check_commands(void *usr, const struct cmd *cmds);
+void		init_cmd_reader(struct cmd_reader *reader, int fd);
+void
+init_stream_reader(struct cmd_reader *reader,
+		   const struct stream *stream);
+void		free_cmd_reader(struct cmd_reader *reader);
+enum error
+check_commands(void *usr,
+	       const struct cmd *cmds,
+	       struct cmd_reader *reader);
+enum error
+try_cmd(void *usr,
+	const struct cmd *cmds,
+	struct cmd_reader *reader,
+	const struct cmd_prop *prop);
+enum error
+drain_commands(void *usr,
+	       const struct cmd *cmds,
+	       struct cmd_reader *reader,
+	       const struct cmd_prop *prop,
+	       const struct cmd_budget *budget);
+enum error	listen_commands(struct reactor *reactor, struct cmd_listener *listener);
 enum error 
 handle_cmd(void *usr,
 	   const struct cmd *cmds,
-	   FILE *in,
-	   FILE *prop);
+	   struct cmd_reader *reader,
+	   const struct cmd_prop *prop);
+enum error
+run_cmd_line(void *usr,
+	     const struct cmd *cmds,
+	     const struct cmd_prop *prop,
+	     char *line,
+	     size_t length);
+bool		cmd_waiting(const struct cmd_reader *reader);
+struct arena   *cmd_arena(void);
+void		complete_cmd(struct cmd_job *job, enum error err, const char *why);
+enum error	await_cmd(struct cmd_reader *reader, const char *word);
+void		prepare_cmds(const struct cmd *cmds);
+void		forget_cmds(const struct cmd *cmds);
+enum error	prepare_cmd_reader(struct cmd_reader *reader);
 
 #endif				/* !CUPPA_CMD_H */
@@ -0,0 +1,128 @@
+/*******************************************************************************
+ * ctx.c - contexts for running command loops on their own threads
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>		/* NULL */
+
+#include "cmd.h"		/* init_stream_reader, listen_commands etc. */
+#include "ctx.h"		/* struct cuppa_ctx */
+#include "errors.h"		/* enum error, severity */
+#include "io.h"			/* init_reactor, reactor_run, set_stdout_stream */
+#include "rqueue.h"		/* init_rqueue, set_drained_queue */
+#include "stream.h"		/* struct stream */
+
+/* Context the calling thread is running, or NULL if none. */
+static _Thread_local struct cuppa_ctx *current = NULL;
+
+/* Sets up 'ctx' to run the command set 'cmds', passing 'usr' to each
+ * command, on commands from 'in' and with responses going to 'out'.  Both
+ * streams are copied.  There are no PROPAGATE targets or budget until
+ * 'prop' and 'budget' are filled in.
+ */
+void
+init_cuppa_ctx(struct cuppa_ctx *ctx,
+	       void *usr,
+	       const struct cmd *cmds,
+	       const struct stream *in,
+	       const struct stream *out)
+{
+	ctx->usr = usr;
+	ctx->cmds = cmds;
+	ctx->prop = NULL;
+	ctx->budget.max_cmds = 0;
+	ctx->budget.max_usecs = 0;
+	ctx->out = *out;
+	init_stream_reader(&(ctx->reader), in);
+	init_reactor(&(ctx->reactor));
+	init_rqueue(&(ctx->queue));
+}
+
+/* Releases 'ctx'.  The streams are left open. */
+void
+free_cuppa_ctx(struct cuppa_ctx *ctx)
+{
+	free_cmd_reader(&(ctx->reader));
+	free_reactor(&(ctx->reactor));
+}
+
+/* Runs commands from 'ctx' on the calling thread until its input ends or
+ * something fatal happens, flushing responses (including those queued on
+ * the context's queue) as it goes.  Errors of normal severity, such as bad
+ * commands, have already been answered and don't stop the context.  Returns
+ * the fatal error that stopped it, or E_OK at end of input.
+ *
+ * Only one context may run on a thread at a time.  Other descriptors can be
+ * watched alongside the context's input by adding them to its reactor.  The
+ * command set is prepared (see prepare_cmds) while the context runs, and
+ * forgotten again afterwards, as a thread's indices outlive the thread.
+ */
+enum error
+run_cuppa_ctx(struct cuppa_ctx *ctx)
+{
+	enum error	err;
+
+	current = ctx;
+	set_stdout_stream(&(ctx->out));
+	set_drained_queue(&(ctx->queue));
+
+	ctx->listener.usr = ctx->usr;
+	ctx->listener.cmds = ctx->cmds;
+	ctx->listener.reader = &(ctx->reader);
+	ctx->listener.prop = ctx->prop;
+	ctx->listener.budget = ctx->budget;
+	prepare_cmds(ctx->cmds);
+
+	err = listen_commands(&(ctx->reactor), &(ctx->listener));
+	while (err != E_EOF && severity(err) == ES_NORMAL)
+		err = reactor_run(&(ctx->reactor), -1);
+	if (err == E_EOF)
+		err = E_OK;
+
+	reactor_remove(&(ctx->reactor), ctx->reader.stream.fd);
+	drain_response_queue();
+	flush_responses();
+	forget_cmds(ctx->cmds);
+	set_drained_queue(NULL);
+	set_stdout_stream(NULL);
+	current = NULL;
+
+	return err;
+}
+
+/* Returns the context the calling thread is running, or NULL if none.
+ * Commands can use this to find the context they were sent to.
+ */
+struct cuppa_ctx *
+current_ctx(void)
+{
+	return current;
+}
@@ -0,0 +1,87 @@
+/*******************************************************************************
+ * ctx.h - contexts for running command loops on their own threads
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CUPPA_CTX_H
+#define CUPPA_CTX_H
+
+#include "cmd.h"		/* struct cmd, struct cmd_reader etc. */
+#include "errors.h"		/* enum error */
+#include "io.h"			/* struct reactor */
+#include "rqueue.h"		/* struct rqueue */
+#include "stream.h"		/* struct stream */
+
+/*
+ * Contexts - everything one command loop needs: the stream commands come in
+ * on, the stream responses go out on in place of standard out, the command
+ * table and the reactor driving them.  Several contexts can run in one
+ * process, each on its own thread (pinned to its own core, say), to serve
+ * many channels without a process apiece.
+ *
+ * cuppa's per-loop state (response buffers, sinks, flush and push settings,
+ * asynchronous jobs, dispatch indices and capture) is kept per thread, so a
+ * thread running a context shares nothing with the others on the command
+ * or response path, and needs no locks.  The functions in io.h and cmd.h
+ * therefore act on the context of the thread calling them: set up sinks and
+ * policies from inside run_cuppa_ctx (in commands, say), not before it.
+ * Statistics (stats.h) stay process-wide.  Each context has its own
+ * response queue (rqueue.h), 'queue', drained by the thread running it:
+ * threads working for a context queue their responses there with
+ * rqueue_response, not queue_response.
+ *
+ * Set up with init_cuppa_ctx (filling in 'prop' and 'budget' afterwards if
+ * needed), run with run_cuppa_ctx on the thread that is to own it, and
+ * release with free_cuppa_ctx.  Don't touch the other fields directly.
+ */
+struct cuppa_ctx {
+	void	       *usr;	/* User data passed to commands */
+	const struct cmd *cmds;	/* END_CMDS-terminated command set */
+	const struct cmd_prop *prop;	/* PROPAGATE targets, or NULL if none */
+	struct cmd_budget budget;	/* Limits on each batch of commands */
+	struct stream	out;	/* Stream responses go to */
+	struct cmd_reader reader;	/* Reader commands come in on */
+	struct cmd_listener listener;	/* Listener for 'reader' */
+	struct reactor	reactor;	/* Reactor the context runs on */
+	struct rqueue	queue;	/* Responses from other threads */
+};
+
+void
+init_cuppa_ctx(struct cuppa_ctx *ctx,
+	       void *usr,
+	       const struct cmd *cmds,
+	       const struct stream *in,
+	       const struct stream *out);
+void		free_cuppa_ctx(struct cuppa_ctx *ctx);
+enum error	run_cuppa_ctx(struct cuppa_ctx *ctx);
+struct cuppa_ctx *current_ctx(void);
+
+#endif				/* !CUPPA_CTX_H */
@@ -32,12 +32,15 @@
  */
 
 #include <stdarg.h>		/* va_list etc. */
-#include <stdio.h>		/* snprintf */
-#include <stdlib.h>		/* calloc */
+#include <stdio.h>		/* vsnprintf */
+#include <string.h>		/* memcpy, strlen */
 
 #include "errors.h"		/* enum error, enum error_blame */
-#include "io.h"			/* vresponse, enum response */
-#include "messages.h"		/* MSG_ERR_NOMEM */
+#include "io.h"			/* vresponse, response_str, enum response */
+#include "stats.h"		/* stats_enabled, stats_count_error */
+
+/* Size of the buffer errors are rendered into, including the error name. */
+#define ERROR_BUF_LEN 1024
 
 /* Structure of information about how to handle an error. */
 struct e_data {
@@ -109,6 +112,9 @@ static const struct e_data ERRORS[NUM_ERRORS] = {
 	},
 };
 
+/* Per-thread buffer for rendering errors, so error() needn't allocate. */
+static _Thread_local char ERROR_BUF[ERROR_BUF_LEN];
+
 /* This maps error blame factors to response codes. */
 const enum response BLAME_RESPONSE[NUM_ERROR_BLAMES] = {
 	R_WHAT,			/* EB_USER */
@@ -117,16 +123,34 @@ const enum response BLAME_RESPONSE[NUM_ERROR_BLAMES] = {
 	R_OOPS,			/* EB_PROGRAMMER */
 };
 
-/* Sends a debug message. */
+/* Debug messages above this level are thrown away (see DBUG). */
+enum dbug_level	dbug_level = DL_VERBOSE;
+
+/* Sends a debug message at level DL_NORMAL.
+ *
+ * This checks the run-time debug level before doing anything else, but the
+ * DBUG macro is cheaper still as it also avoids the call.
+ */
 void
 dbug(const char *format,...)
 {
 	va_list		ap;
 
-	/* LINTED lint doesn't seem to like va_start */
-	va_start(ap, format);
-	vresponse(R_DBUG, format, ap);
-	va_end(ap);
+	if (dbug_level >= DL_NORMAL) {
+		/* LINTED lint doesn't seem to like va_start */
+		va_start(ap, format);
+		vresponse(R_DBUG, format, ap);
+		va_end(ap);
+	}
+}
+
+/* Sets the run-time debug level.  Levels above CUPPA_DBUG_MAX have no effect,
+ * as their messages aren't compiled in.
+ */
+void
+set_dbug_level(enum dbug_level level)
+{
+	dbug_level = level;
 }
 
 /* Throws an error message.
@@ -135,47 +159,37 @@ dbug(const char *format,...)
  * sent up the control chain and handled at the top of the player.  It merely
  * sends a response through stdout and potentially stderr to let the client/logs
  * know something went wrong.
+ *
+ * The error is rendered in one pass into a per-thread buffer, so this never
+ * allocates; overly long messages are truncated to fit.
  */
 enum error
 error(enum error code, const char *format,...)
 {
+	int		msglen;	/* Length of rendered message */
+	size_t		len;	/* Length of rendered error */
 	va_list		ap;	/* Variadic arguments */
-	va_list		ap2;	/* Variadic arguments */
-	char           *buf;	/* Temporary buffer for rendering error */
-	size_t		buflen;	/* Length for creating buffer */
 	const struct e_data *e;	/* Data for error code; */
 
 	e = &(ERRORS[(int)code]);
-	buf = NULL;
+
+	/* Render "NAME message" without touching the format string */
+	len = strlen(e->name);
+	memcpy(ERROR_BUF, e->name, len);
+	ERROR_BUF[len++] = ' ';
 
 	/* LINTED lint doesn't seem to like va_start */
 	va_start(ap, format);
-	va_copy(ap2, ap);
-
-	/*
-	 * Problem: adding the error name into the format without changing
-	 * the format string dynamically (a bad idea).
-	 *
-	 * Our strategy: render the error into a temporary buffer using magicks,
-	 * then send it to response.
-	 */
-
-	/*
-	 * Try printing the error into a null buffer to get required length
-	 * (see http://stackoverflow.com/questions/4899221)
-	 */
-	buflen = vsnprintf(NULL, 0, format, ap);
-	buf = calloc(buflen + 1, sizeof(char));
-	if (buf != NULL)
-		vsnprintf(buf, buflen + 1, format, ap2);
-
-	response(BLAME_RESPONSE[e->blame], "%s %s",
-		 e->name,
-		 buf == NULL ? MSG_ERR_NOMEM : buf);
+	msglen = vsnprintf(ERROR_BUF + len, ERROR_BUF_LEN - len, format, ap);
 	va_end(ap);
 
-	if (buf != NULL)
-		free(buf);
+	if (msglen > 0)
+		len += ((size_t)msglen < ERROR_BUF_LEN - len) ?
+		    (size_t)msglen : ERROR_BUF_LEN - len - 1;
+
+	if (stats_enabled)
+		stats_count_error(code);
+	response_str(BLAME_RESPONSE[e->blame], ERROR_BUF, len);
 
 	return code;
 }
@@ -185,3 +199,17 @@ severity(enum error code)
 {
 	return ERRORS[(int)code].severity;
 }
+
+/* Returns the symbolic name of 'code', without its leading E_. */
+const char     *
+error_name(enum error code)
+{
+	return ERRORS[(int)code].name;
+}
+
+/* Returns who is to blame for errors with 'code'. */
+enum error_blame
+error_blame(enum error code)
+{
+	return ERRORS[(int)code].blame;
+}
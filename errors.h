@@ -43,12 +43,42 @@
 		 	   "couldn't alloc ptr");		\
 	}							\
 } while (0)
+#define SAFE_ACALLOC(err, arena, ptr, count, size) do {		\
+	if (*err == E_OK) {					\
+		ptr = arena_calloc(arena, (size_t)count, size);	\
+		if (ptr == NULL)				\
+			*err = error(E_NO_MEM,			\
+		 	   "couldn't alloc ptr");		\
+	}							\
+} while (0)
 #define ERR_IF_NULL(err, ptr) do {				\
 	if (*err == E_OK && ptr == NULL)			\
 		*err = error(E_INTERNAL_ERROR,			\
 		    "passed NULL, expecting ptr");		\
 } while (0)
 
+/* Sends a debug message at the given level (see enum dbug_level).
+ *
+ * Messages above CUPPA_DBUG_MAX compile to nothing, and the rest check the
+ * run-time level before doing any formatting work, so prefer this to calling
+ * dbug directly on hot paths.
+ */
+#define DBUG(level, ...) do {					\
+	if ((level) <= CUPPA_DBUG_MAX && (level) <= dbug_level)	\
+		dbug(__VA_ARGS__);				\
+} while (0)
+
+/* Highest debug level compiled in; define this to override it.  Release
+ * (NDEBUG) builds have no debug messages at all by default.
+ */
+#ifndef CUPPA_DBUG_MAX
+#ifdef NDEBUG
+#define CUPPA_DBUG_MAX DL_NONE
+#else
+#define CUPPA_DBUG_MAX DL_VERBOSE
+#endif
+#endif
+
 /* Categories of error.
  *
  * NOTE: If you're adding new errors here, PLEASE update the arrays in errors.c
@@ -96,8 +126,23 @@ enum error_severity {
 	NUM_ERROR_SEVERITIES	/* Number of items in enum */
 };
 
+/* Levels of debug message, from least to most verbose. */
+enum dbug_level {
+	DL_NONE,		/* No debug messages at all */
+	DL_NORMAL,		/* Occasional messages, such as those from dbug */
+	DL_VERBOSE,		/* Per-command tracing */
+	/*--------------------------------------------------------------------*/
+	NUM_DBUG_LEVELS		/* Number of items in enum */
+};
+
+/* Run-time debug level; use set_dbug_level to change it. */
+extern enum dbug_level dbug_level;
+
 void		dbug      (const char *format,...);
+void		set_dbug_level(enum dbug_level level);
 enum error	error(enum error code, const char *format,...);
 enum error_severity severity(enum error code);
+const char     *error_name(enum error code);
+enum error_blame error_blame(enum error code);
 
 #endif				/* !CUPPA_ERRORS_H */
@@ -0,0 +1,287 @@
+/*******************************************************************************
+ * fuzz/dispatch.c - recording and cross-checking command dispatch
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdlib.h>		/* abort, free, realloc */
+#include <string.h>		/* memchr, memcmp, memcpy, strlen */
+#include <time.h>		/* clock_gettime */
+
+#include "../cmd.h"		/* handle_cmd, run_cmd_line, CMD_MAX_LINE */
+#include "../errors.h"		/* enum error */
+#include "../stream.h"		/* struct stream */
+#include "dispatch.h"		/* struct dispatch_log */
+
+/* Kinds of record in a dispatch log. */
+enum record {
+	REC_NULLARY = 'n',	/* The nullary command ran */
+	REC_UNARY = 'u',	/* The unary command ran, with an argument */
+	REC_ERROR = 'e'		/* Running a line failed */
+};
+
+/* Input for a memory stream: 'len' bytes of 'data', read 'chunk' at a time
+ * to vary where reads split lines.
+ */
+struct mem_input {
+	const char     *data;	/* The input */
+	size_t		len;	/* Length of the input */
+	size_t		pos;	/* Bytes read so far */
+	size_t		chunk;	/* Most bytes to give out in one read */
+};
+
+static enum error rec_nullary(void *usr);
+static enum error rec_unary(void *usr, const char *arg);
+static void	log_record(struct dispatch_log *log, enum record kind, const char *data, size_t len);
+static ssize_t	mem_read(const struct stream *stream, char *buf, size_t len);
+static ssize_t	mem_write(const struct stream *stream, const char *buf, size_t len);
+static double	now_nsecs(void);
+
+const struct cmd DISPATCH_CMDS[] = {
+	NCMD("n", rec_nullary),
+	UCMD("u", rec_unary),
+	UCMD("uu", rec_unary),
+	IGNORE("i"),
+	REJECT("r", "rejected"),
+	END_CMDS
+};
+
+/* Memory streams are input only, and never have to wait. */
+static const struct stream_ops MEM_STREAM_OPS = {
+	mem_read,
+	mem_write,
+	NULL,
+	NULL,
+	NULL,
+	false
+};
+
+void
+init_dispatch_log(struct dispatch_log *log)
+{
+	log->buf = NULL;
+	log->len = 0;
+	log->size = 0;
+}
+
+void
+free_dispatch_log(struct dispatch_log *log)
+{
+	free(log->buf);
+	init_dispatch_log(log);
+}
+
+/* Records 'err' as the result of a line, unless it means success or that
+ * input ran out.
+ */
+void
+log_error(struct dispatch_log *log, enum error err)
+{
+	char		code = (char)err;
+
+	if (err != E_OK && err != E_INCOMPLETE && err != E_EOF)
+		log_record(log, REC_ERROR, &code, 1);
+}
+
+/* Runs 'data' through handle_cmd on a memory stream handing out at most
+ * 'chunk' bytes per read, logging into 'log' (if not NULL, so that timings
+ * can leave out the logging).  If 'worst_nsecs' is not
+ * NULL, it is set to the longest any one call took.
+ */
+void
+run_reader(struct dispatch_log *log,
+	   const char *data,
+	   size_t len,
+	   size_t chunk,
+	   double *worst_nsecs)
+{
+	double		start;
+	double		nsecs;
+	enum error	err = E_OK;
+	struct mem_input input = {data, len, 0, chunk == 0 ? 1 : chunk};
+	struct stream	stream = {&MEM_STREAM_OPS, &input, -1};
+	struct cmd_reader reader;
+
+	if (worst_nsecs != NULL)
+		*worst_nsecs = 0.0;
+
+	init_stream_reader(&reader, &stream);
+	while (err != E_EOF) {
+		start = now_nsecs();
+		err = handle_cmd(log, DISPATCH_CMDS, &reader, NULL);
+		nsecs = now_nsecs() - start;
+
+		if (worst_nsecs != NULL && *worst_nsecs < nsecs)
+			*worst_nsecs = nsecs;
+		log_error(log, err);
+	}
+	free_cmd_reader(&reader);
+}
+
+/* Runs 'data' a line at a time through run_cmd_line, logging into 'log'.
+ * Lines too long for a command reader are rejected as a reader would.
+ */
+void
+run_reference(struct dispatch_log *log, const char *data, size_t len)
+{
+	char	       *line;
+	const char     *newline;
+	size_t		pos;
+	size_t		length;
+
+	for (pos = 0; pos < len; pos += length + 1) {
+		newline = memchr(data + pos, '\n', len - pos);
+		length = newline == NULL ? len - pos : (size_t)(newline -
+								(data + pos));
+
+		if (CMD_MAX_LINE < length) {
+			log_error(log, E_BAD_COMMAND);
+			continue;
+		}
+
+		line = malloc(length + 1);
+		if (line == NULL)
+			abort();
+		memcpy(line, data + pos, length);
+		line[length] = '\0';
+
+		log_error(log,
+			  run_cmd_line(log, DISPATCH_CMDS, NULL, line, length));
+		free(line);
+	}
+}
+
+/* Returns whether 'data' dispatches identically through a command reader
+ * (reading 'chunk' bytes at a time) and line by line.
+ */
+bool
+same_dispatch(const char *data, size_t len, size_t chunk)
+{
+	bool		same;
+	struct dispatch_log reader;
+	struct dispatch_log reference;
+
+	init_dispatch_log(&reader);
+	init_dispatch_log(&reference);
+
+	run_reader(&reader, data, len, chunk, NULL);
+	run_reference(&reference, data, len);
+	same = reader.len == reference.len &&
+	    (reader.len == 0 || memcmp(reader.buf, reference.buf, reader.len) == 0);
+
+	free_dispatch_log(&reader);
+	free_dispatch_log(&reference);
+	return same;
+}
+
+static enum error
+rec_nullary(void *usr)
+{
+	log_record(usr, REC_NULLARY, NULL, 0);
+	return E_OK;
+}
+
+static enum error
+rec_unary(void *usr, const char *arg)
+{
+	if (arg == NULL)
+		log_record(usr, REC_UNARY, NULL, 0);
+	else
+		log_record(usr, REC_UNARY, arg, strlen(arg) + 1);
+	return E_OK;
+}
+
+/* Appends a record of 'kind' holding the 'len' bytes at 'data' to 'log',
+ * if 'log' isn't NULL.
+ */
+static void
+log_record(struct dispatch_log *log,
+	   enum record kind,
+	   const char *data,
+	   size_t len)
+{
+	char	       *buf;
+	size_t		size;
+
+	if (log == NULL)
+		return;
+	if (log->size - log->len < 1 + sizeof(len) + len) {
+		size = 2 * (log->len + 1 + sizeof(len) + len);
+		buf = realloc(log->buf, size);
+		if (buf == NULL)
+			abort();
+		log->buf = buf;
+		log->size = size;
+	}
+
+	log->buf[log->len++] = (char)kind;
+	memcpy(log->buf + log->len, &len, sizeof(len));
+	log->len += sizeof(len);
+	if (len != 0)
+		memcpy(log->buf + log->len, data, len);
+	log->len += len;
+}
+
+static ssize_t
+mem_read(const struct stream *stream, char *buf, size_t len)
+{
+	struct mem_input *input = stream->data;
+
+	if (input->chunk < len)
+		len = input->chunk;
+	if (input->len - input->pos < len)
+		len = input->len - input->pos;
+
+	memcpy(buf, input->data + input->pos, len);
+	input->pos += len;
+	return (ssize_t)len;
+}
+
+static ssize_t
+mem_write(const struct stream *stream, const char *buf, size_t len)
+{
+	(void)stream;
+	(void)buf;
+	return (ssize_t)len;
+}
+
+/* Returns a monotonic time in nanoseconds. */
+static double
+now_nsecs(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
@@ -0,0 +1,76 @@
+/*******************************************************************************
+ * fuzz/dispatch.h - recording and cross-checking command dispatch
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CUPPA_FUZZ_DISPATCH_H
+#define CUPPA_FUZZ_DISPATCH_H
+
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+
+#include "../cmd.h"		/* struct cmd */
+#include "../errors.h"		/* enum error */
+
+/*
+ * Dispatch logs - a record of which commands a stream of input ran, with
+ * what arguments, and which errors it raised, in order.  Two ways of running
+ * the same input should give byte-identical logs: through handle_cmd and a
+ * command reader (the path real programs take), and by splitting the input
+ * into lines by hand and giving each to run_cmd_line.
+ *
+ * DISPATCH_CMDS is the command table to run with a log (or NULL, to record
+ * nothing) as the user data.
+ */
+struct dispatch_log {
+	char	       *buf;	/* Records, one after another */
+	size_t		len;	/* Bytes of records */
+	size_t		size;	/* Bytes allocated */
+};
+
+extern const struct cmd DISPATCH_CMDS[];
+
+void		init_dispatch_log(struct dispatch_log *log);
+void		free_dispatch_log(struct dispatch_log *log);
+void		log_error(struct dispatch_log *log, enum error err);
+void
+run_reader(struct dispatch_log *log,
+	   const char *data,
+	   size_t len,
+	   size_t chunk,
+	   double *worst_nsecs);
+void
+run_reference(struct dispatch_log *log,
+	      const char *data,
+	      size_t len);
+bool		same_dispatch(const char *data, size_t len, size_t chunk);
+
+#endif				/* !CUPPA_FUZZ_DISPATCH_H */
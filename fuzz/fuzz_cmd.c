@@ -0,0 +1,198 @@
+/*******************************************************************************
+ * fuzz/fuzz_cmd.c - fuzzing entry point for the command parsers
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * LLVMFuzzerTestOneInput feeds each input to tokenize_line, decode_cmd_frame
+ * and (through run_cmd_line and handle_cmd) run_line, aborting if any of
+ * them breaks its contract or the two ways of dispatching a stream disagree
+ * (see dispatch.h).  Build with 'make fuzz_cmd_libfuzzer' for libFuzzer; the
+ * plain 'fuzz_cmd' build runs each file named on its command line (or
+ * standard input, for AFL) once, for reproducing crashes.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <fcntl.h>		/* open */
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* uint8_t */
+#include <stdio.h>		/* FILE, fopen, fread */
+#include <stdlib.h>		/* abort, malloc, free */
+#include <string.h>		/* memcpy, strlen */
+#include <unistd.h>		/* dup2 */
+
+#include "../cmd.h"		/* prepare_cmds */
+#include "../constants.h"	/* WORD_LEN */
+#include "../errors.h"		/* set_dbug_level */
+#include "../io.h"		/* set_stdout_stream, flush_responses */
+#include "../stream.h"		/* fd_stream */
+#include "../utils.h"		/* tokenize_line */
+#include "../wire.h"		/* decode_cmd_frame */
+#include "dispatch.h"		/* same_dispatch */
+
+/* Largest input read by the standalone driver. */
+#define MAX_INPUT (4 * 1024 * 1024)
+
+int		LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+static void	setup(void);
+static void	check_tokens(const char *data, size_t size);
+static void	check_frame(const char *data, size_t size);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static bool	set_up = false;
+	const char     *input = (const char *)data;
+
+	if (!set_up) {
+		setup();
+		set_up = true;
+	}
+
+	check_tokens(input, size);
+	check_frame(input, size);
+
+	/* Vary where reads split the input with its first byte */
+	if (!same_dispatch(input, size, size == 0 ? 1 : 1 + data[0] % 64))
+		abort();
+	if (!same_dispatch(input, size, 65536))
+		abort();
+
+	flush_responses();
+	return 0;
+}
+
+#ifndef CUPPA_LIBFUZZER
+int
+main(int argc, char *argv[])
+{
+	char	       *buf;
+	size_t		len;
+	int		i;
+	FILE	       *in;
+
+	buf = malloc(MAX_INPUT);
+	if (buf == NULL)
+		return EXIT_FAILURE;
+
+	for (i = 1; i < argc || i == 1; i++) {
+		in = argc == 1 ? stdin : fopen(argv[i], "rb");
+		if (in == NULL) {
+			perror(argv[i]);
+			return EXIT_FAILURE;
+		}
+
+		len = fread(buf, 1, MAX_INPUT, in);
+		if (in != stdin)
+			fclose(in);
+		LLVMFuzzerTestOneInput((const uint8_t *)buf, len);
+	}
+
+	free(buf);
+	return EXIT_SUCCESS;
+}
+#endif				/* !CUPPA_LIBFUZZER */
+
+/* Sends responses and logs to /dev/null, as they are of no interest. */
+static void
+setup(void)
+{
+	static struct stream out;
+	int		null_fd;
+
+	null_fd = open("/dev/null", O_WRONLY);
+	if (null_fd == -1)
+		abort();
+
+	dup2(null_fd, STDERR_FILENO);
+	out = fd_stream(null_fd);
+	set_stdout_stream(&out);
+	set_dbug_level(DL_NONE);
+
+	/* Dispatch through an index, as prepared programs do */
+	prepare_cmds(DISPATCH_CMDS);
+}
+
+/* Checks tokenize_line's offsets against the input, as a line. */
+static void
+check_tokens(const char *data, size_t size)
+{
+	size_t		i;
+	struct line_tokens tokens;
+
+	tokenize_line(data, size, &tokens);
+
+	if (size < tokens.word || size - tokens.word < tokens.word_len ||
+	    size < tokens.arg || size - tokens.arg < tokens.arg_len)
+		abort();
+	for (i = 0; i < tokens.word_len; i++)
+		if (data[tokens.word + i] == ' ' ||
+		    data[tokens.word + i] == '\t')
+			abort();
+	if (tokens.arg_len != 0 && tokens.arg < tokens.word + tokens.word_len)
+		abort();
+}
+
+/* Checks that decode_cmd_frame stays within the input, as a frame, and
+ * hands back a terminated word and argument free of line breaks.
+ */
+static void
+check_frame(const char *data, size_t size)
+{
+	char	       *buf;
+	char	       *arg = NULL;
+	char		word[WORD_LEN];
+	size_t		used = 0;
+	enum error	err;
+
+	/* Copy, so reads past the end are caught by the sanitizers */
+	buf = malloc(size == 0 ? 1 : size);
+	if (buf == NULL)
+		abort();
+	memcpy(buf, data, size);
+
+	err = decode_cmd_frame(buf, size, &used, word, &arg);
+	if (err != E_INCOMPLETE && size < used)
+		abort();
+	if (err == E_OK) {
+		if (memchr(word, '\0', WORD_LEN) == NULL ||
+		    strcspn(word, "\r\n") != strlen(word))
+			abort();
+		if (arg != NULL && (arg < buf || buf + used <= arg ||
+			       memchr(arg, '\0', (size_t)(buf + used - arg)) ==
+				    NULL || strcspn(arg, "\r\n") != strlen(arg)))
+			abort();
+	}
+
+	free(buf);
+}
@@ -0,0 +1,225 @@
+/*******************************************************************************
+ * fuzz/hostile.c - throughput of the command reader on hostile input
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Runs streams built to be awkward (megabyte lines, lines of nothing but
+ * space, embedded nulls, no final newline) through handle_cmd, printing the
+ * throughput, the mean cost per line and the worst cost of any one call,
+ * and checking that each stream dispatches exactly as it does line by line
+ * through run_cmd_line (see dispatch.h).  Build and run with 'make run'.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <fcntl.h>		/* open */
+#include <stdbool.h>		/* bool */
+#include <stdio.h>		/* printf */
+#include <stdlib.h>		/* malloc, free */
+#include <string.h>		/* memcpy, memset, strlen */
+#include <time.h>		/* clock_gettime */
+#include <unistd.h>		/* dup, dup2 */
+
+#include "../cmd.h"		/* CMD_MAX_LINE */
+#include "../errors.h"		/* set_dbug_level */
+#include "../io.h"		/* set_stdout_stream, flush_responses */
+#include "../stream.h"		/* fd_stream */
+#include "dispatch.h"		/* run_reader, same_dispatch */
+
+/* Bytes handed out per read, as from a busy pipe. */
+#define READ_SIZE 65536
+/* Times each stream is run, after one run to warm up. */
+#define RUNS 5
+
+/* A hostile stream: 'lines' copies of 'line', then 'tail' unterminated. */
+struct hostile {
+	const char     *name;	/* Name printed in the results */
+	size_t		(*build) (char *buf, size_t line_len);	/* Makes a line */
+	size_t		line_len;	/* Length hint passed to 'build' */
+	size_t		lines;	/* Copies of the line */
+	bool		tail;	/* Leave the last line without a newline? */
+};
+
+static size_t	build_normal(char *buf, size_t line_len);
+static size_t	build_long(char *buf, size_t line_len);
+static size_t	build_space(char *buf, size_t line_len);
+static size_t	build_nul(char *buf, size_t line_len);
+static char    *build_stream(const struct hostile *h, size_t *len);
+static double	now_nsecs(void);
+
+static const struct hostile HOSTILES[] = {
+	{"normal lines", build_normal, 16, 200000, false},
+	{"longest lines", build_long, CMD_MAX_LINE, 200, false},
+	{"megabyte lines", build_long, 1024 * 1024, 8, false},
+	{"whitespace lines", build_space, 64, 100000, false},
+	{"embedded nulls", build_nul, 16, 200000, false},
+	{"no final newline", build_normal, 16, 200000, true},
+	{"megabyte, no newline", build_long, 1024 * 1024, 1, true},
+	{NULL, NULL, 0, 0, false}
+};
+
+int
+main(void)
+{
+	FILE	       *results;
+	char	       *data;
+	size_t		len;
+	int		i;
+	int		null_fd;
+	double		start;
+	double		nsecs;
+	double		worst;
+	double		run_worst;
+	bool		same;
+	bool		all_same = true;
+	struct stream	out;
+	const struct hostile *h;
+
+	results = fdopen(dup(STDOUT_FILENO), "w");
+	null_fd = open("/dev/null", O_WRONLY);
+	if (results == NULL || null_fd == -1) {
+		perror("hostile");
+		return EXIT_FAILURE;
+	}
+	dup2(null_fd, STDERR_FILENO);
+	out = fd_stream(null_fd);
+	set_stdout_stream(&out);
+	set_dbug_level(DL_NONE);
+
+	fprintf(results, "%-22s %10s %12s %14s %s\n",
+		"stream", "MB/s", "ns/line", "worst ns/call", "dispatch");
+	for (h = HOSTILES; h->name != NULL; h++) {
+		data = build_stream(h, &len);
+		if (data == NULL)
+			return EXIT_FAILURE;
+
+		same = same_dispatch(data, len, READ_SIZE);
+		all_same = all_same && same;
+
+		nsecs = 0.0;
+		worst = 0.0;
+		for (i = 0; i <= RUNS; i++) {
+			start = now_nsecs();
+			run_reader(NULL, data, len, READ_SIZE, &run_worst);
+			if (i != 0) {
+				nsecs += now_nsecs() - start;
+				if (worst < run_worst)
+					worst = run_worst;
+			}
+			flush_responses();
+		}
+		nsecs /= RUNS;
+
+		fprintf(results, "%-22s %10.1f %12.1f %14.1f %s\n",
+			h->name,
+			(double)len / nsecs * 1e3,
+			nsecs / (double)h->lines,
+			worst,
+			same ? "same" : "DIFFERENT");
+		free(data);
+	}
+
+	fclose(results);
+	return all_same ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static size_t
+build_normal(char *buf, size_t line_len)
+{
+	static const char line[] = "u 12345";
+
+	(void)line_len;
+	memcpy(buf, line, sizeof(line) - 1);
+	return sizeof(line) - 1;
+}
+
+/* A unary command with an argument making the line 'line_len' long. */
+static size_t
+build_long(char *buf, size_t line_len)
+{
+	memcpy(buf, "u ", 2);
+	memset(buf + 2, 'a', line_len - 2);
+	return line_len;
+}
+
+static size_t
+build_space(char *buf, size_t line_len)
+{
+	size_t		i;
+
+	for (i = 0; i < line_len; i++)
+		buf[i] = i % 3 == 0 ? '\t' : ' ';
+	return line_len;
+}
+
+static size_t
+build_nul(char *buf, size_t line_len)
+{
+	static const char line[] = "u ab\0cd";
+
+	(void)line_len;
+	memcpy(buf, line, sizeof(line) - 1);
+	return sizeof(line) - 1;
+}
+
+/* Builds the stream for 'h', setting *len to its length. */
+static char    *
+build_stream(const struct hostile *h, size_t *len)
+{
+	char	       *buf;
+	size_t		line_len;
+	size_t		i;
+
+	buf = malloc(h->lines * (h->line_len + 1));
+	if (buf == NULL)
+		return NULL;
+
+	*len = 0;
+	for (i = 0; i < h->lines; i++) {
+		line_len = h->build(buf + *len, h->line_len);
+		*len += line_len;
+		if (!h->tail || i + 1 < h->lines)
+			buf[(*len)++] = '\n';
+	}
+
+	return buf;
+}
+
+/* Returns a monotonic time in nanoseconds. */
+static double
+now_nsecs(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
@@ -0,0 +1,81 @@
+/*******************************************************************************
+ * init.c - one-time setup and warm standby
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>		/* NULL */
+
+#include "cmd.h"		/* prepare_cmds, prepare_cmd_reader, await_cmd */
+#include "errors.h"		/* enum error, DBUG */
+#include "init.h"		/* cuppa_init, cuppa_standby */
+#include "io.h"			/* prepare_responses */
+#include "utils.h"		/* monotonic_usecs */
+
+/* Does all of cuppa's one-time setup for running the command set 'cmds' on
+ * 'reader' (which may be NULL if there isn't one yet), so that none of it
+ * is left for the first commands.  This can be called again safely, for
+ * example for another command set: only 'cmds' itself is indexed, so any
+ * tables its handlers dispatch to themselves need a call of their own.
+ */
+enum error
+cuppa_init(const struct cmd *cmds, struct cmd_reader *reader)
+{
+	enum error	err = E_OK;
+
+	if (cmds != NULL)
+		prepare_cmds(cmds);
+	if (reader != NULL)
+		err = prepare_cmd_reader(reader);
+	if (err == E_OK)
+		err = prepare_responses();
+
+	/* The first read of the clock can be slow, so get it out of the way */
+	(void)monotonic_usecs();
+
+	return err;
+}
+
+/* Stands by, waiting on 'reader' for the takeover command 'word' (see
+ * init.h).  Returns E_OK once it has arrived and been acknowledged, or E_EOF
+ * if the command stream ends first.
+ */
+enum error
+cuppa_standby(struct cmd_reader *reader, const char *word)
+{
+	enum error	err;
+
+	DBUG(DL_NORMAL, "standing by for %s", word);
+	err = await_cmd(reader, word);
+	if (err == E_OK)
+		DBUG(DL_NORMAL, "taking over");
+
+	return err;
+}
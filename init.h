@@ -0,0 +1,73 @@
+/*******************************************************************************
+ * init.h - one-time setup and warm standby
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CUPPA_INIT_H
+#define CUPPA_INIT_H
+
+#include "cmd.h"		/* struct cmd, struct cmd_reader */
+#include "errors.h"		/* enum error */
+
+/*
+ * Start-up - cuppa otherwise sets things up lazily, when they are first
+ * needed: reader buffers and scratch memory on the first read, and so on,
+ * and command sets are walked rather than indexed (see prepare_cmds).
+ * Programs for which the time to their first answer matters, such as players
+ * spawned on failover, can instead do all of this in one go with cuppa_init
+ * before announcing themselves with OHAI.
+ *
+ * cuppa_init indexes only the command set it is given.  Sets that handlers
+ * dispatch to themselves, such as sub-commands run with handle_cmd, aren't
+ * reachable from it; call cuppa_init (or prepare_cmds) once for each.
+ *
+ * Going further, a program can be started ahead of time as a warm standby:
+ * it calls cuppa_init, then cuppa_standby, which waits on the command stream
+ * for a takeover command before returning.  Whatever manages failover then
+ * sends that command when the standby should go live, instead of spawning a
+ * new process and waiting for it to start:
+ *
+ *   init_cmd_reader(&reader, STDIN_FILENO);
+ *   if (cuppa_init(cmds, &reader) != E_OK)
+ *           ...
+ *   if (standby && cuppa_standby(&reader, "live") != E_OK)
+ *           ...
+ *   response(R_OHAI, "%s", "player ready");
+ *
+ * The standby acknowledges the takeover with OKAY, and refuses anything sent
+ * before it with NOPE.  Both functions act on the calling thread's context
+ * (see ctx.h), so call them on the thread that will run the commands.
+ */
+
+enum error	cuppa_init(const struct cmd *cmds, struct cmd_reader *reader);
+enum error	cuppa_standby(struct cmd_reader *reader, const char *word);
+
+#endif				/* !CUPPA_INIT_H */
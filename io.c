@@ -33,70 +33,259 @@
 
 #define _POSIX_C_SOURCE 200809
 
+#include <errno.h>		/* errno, EINTR, EAGAIN, EPIPE */
+#include <fcntl.h>		/* fcntl, O_NONBLOCK */
+#include <limits.h>		/* INT_MAX */
+#include <poll.h>		/* poll */
 #include <stdarg.h>		/* print functions */
 #include <stdbool.h>		/* booleans */
+#include <stdint.h>		/* int64_t */
 #include <stdio.h>		/* printf, fprintf */
-#include <time.h>		/* select etc. */
-#include <unistd.h>
-
-#include <sys/select.h>		/* select */
+#include <stdlib.h>		/* malloc, realloc, free */
+#include <string.h>		/* memcpy */
+#include <unistd.h>		/* STDOUT_FILENO, STDERR_FILENO */
 
+#include "capture.h"		/* capture_enabled, capture_out etc. */
 #include "constants.h"		/* WORD_LEN */
+#include "errors.h"		/* error */
 #include "io.h"			/* enum response */
+#include "messages.h"		/* MSG_IO_* */
+#include "rqueue.h"		/* drain_response_queue */
+#include "stats.h"		/* stats_enabled, stats_add_bytes */
+#include "stream.h"		/* struct stream, stream_write_all */
+#include "timer.h"		/* reactor_timeout, reactor_run_timers */
+#include "utils.h"		/* SAFE_FREE, monotonic_usecs, format_u64 */
+#include "wire.h"		/* encode_str_frame, encode_u64_frame */
+
+/* Size of each of the standard output buffers, in bytes. */
+#define OUT_BUF_LEN 8192
+/* Length of the name and space at the start of each response line. */
+#define PREFIX_LEN WORD_LEN
+/* Longest rendered tag: an '@', the tag and a space. */
+#define TAG_PREFIX_LEN (MAX_TAG_LEN + 2)
+/* Longest head a response can have before its body, in either encoding. */
+#define MAX_HEAD_LEN (WIRE_STR_HEAD + TAG_PREFIX_LEN)
+/* Longest rendered push response that can be coalesced (see held_push). */
+#define HELD_LEN 64
+
+/* Longest body response_word_arg renders without the formatter. */
+#define WORD_ARG_LEN 256
+
+/* Longest response body captured without allocating (see capture.h). */
+#define CAPTURE_BODY_LEN 256
+
+/* Masks have a bit for each response. */
+_Static_assert(NUM_RESPONSES < 32, "response masks are 32 bits");
 
 /* Structure of information about how to handle a response. */
 struct r_data {
-	const char	name [WORD_LEN];	/* Symbolic name of response */
-	bool		send_to_stdout;	/* Send response to client? */
-	bool		send_to_stderr;	/* Send response to error stream? */
+	const char	prefix [PREFIX_LEN + 1];	/* Name and a space */
+	unsigned	routes;	/* Where it goes (ROUTE_OUT, ROUTE_ERR) */
+	bool		urgent;	/* Flush immediately under FLUSH_URGENT? */
+	bool		pull;	/* Answer to a command, so carries its tag? */
 };
 
-/* Data for the responses used by cuppa. */
+/* Every name must fill a text response's prefix exactly. */
+#define X(name, routes, urgent, pull) \
+	_Static_assert(sizeof(#name) == PREFIX_LEN, #name " isn't 4 characters");
+RESPONSE_LIST(X)
+#undef X
+
+/* What an output buffer remembers about one push response, to coalesce it
+ * (see set_push_interval and set_push_dedup).
+ */
+struct held_push {
+	char		last [HELD_LEN];	/* Last one let through */
+	size_t		last_len;	/* Length of 'last'; 0 if none */
+	char		pending [HELD_LEN];	/* Newest one held back */
+	size_t		pending_len;	/* Length of 'pending'; 0 if none */
+	uint64_t	sent;	/* When one was last let through */
+};
+
+/* Buffer of responses waiting to be written to one of the standard streams,
+ * or to a sink.
+ */
+struct out_buf {
+	struct stream	stream;	/* Stream to write responses to */
+	size_t		len;	/* Number of bytes currently buffered */
+	uint64_t	since;	/* When the buffer last stopped being empty */
+	enum wire_mode	mode;	/* Encoding to write responses in */
+	bool		nonblock;	/* Never wait for the stream? */
+	bool		broken;	/* Dropped for falling behind or failing? */
+	uint32_t	mask;	/* Push responses wanted (RESPONSE_BIT) */
+	enum stats_stream stats;	/* Where traffic is counted (stats.h) */
+	struct held_push held [NUM_RESPONSES];	/* Coalescing state */
+	char		data [OUT_BUF_LEN];	/* Buffered response lines */
+};
+
+/* A client that responses can be sent to, besides standard out. */
+struct response_sink {
+	uint64_t	id;	/* Never reused, unlike the address */
+	struct out_buf	out;	/* Responses waiting to be written */
+};
+
+/* A push response rendered into a small buffer, so it can be coalesced. */
+struct small_line {
+	int		len;	/* Length; -1 if not tried, -2 if too long */
+	char		line [HELD_LEN];	/* Rendered response */
+};
+
+/* A response rendered in one encoding, to copy to other buffers. */
+struct rendering {
+	char	       *line;	/* Rendered response, or NULL if none yet */
+	size_t		len;	/* Length of 'line' */
+	char	       *heap;	/* 'line' if it was too long to buffer */
+};
+
+static char    *
+send_line(struct out_buf *out,
+	  enum response code,
+	  const char *format,
+	  va_list ap,
+	  size_t *len,
+	  char **heap);
+static char    *
+render_line(struct out_buf *out,
+	    enum response code,
+	    const char *format,
+	    va_list ap,
+	    size_t *len,
+	    char **heap);
+static int
+format_line(char *buf,
+	    size_t room,
+	    enum wire_mode mode,
+	    enum response code,
+	    const char *format,
+	    va_list ap);
+static size_t	head_len(enum wire_mode mode, enum response code);
+static void
+write_head(char *buf,
+	   enum wire_mode mode,
+	   enum response code,
+	   size_t len);
+static void
+send_to(struct out_buf *out,
+	enum response code,
+	const char *format,
+	va_list ap,
+	struct rendering *done);
+static struct out_buf *next_target(const struct r_data *r, size_t *pos);
+static void
+put_response(enum response code,
+	     const char *body,
+	     size_t len,
+	     const char *frame,
+	     size_t frame_len);
+static bool
+render_small(struct out_buf *out,
+	     enum response code,
+	     const char *format,
+	     va_list ap,
+	     struct small_line *small);
+static void
+hold_line(struct out_buf *out,
+	  enum response code,
+	  const char *line,
+	  size_t len);
+static void	release_held(struct out_buf *out, uint64_t now);
+static void	append_line(struct out_buf *out, const char *line, size_t len);
+static void
+put_line(struct out_buf *out,
+	 enum response code,
+	 const char *body,
+	 size_t len);
+static void
+capture_vresponse(enum response code,
+		  const char *format,
+		  va_list ap);
+static void	maybe_flush(struct out_buf *out, const struct r_data *r);
+static void	write_now(struct out_buf *out, const char *buf, size_t len);
+static void	push_out(struct out_buf *out);
+static void	out_write(struct out_buf *out, const char *buf, size_t len);
+static size_t	write_some(struct out_buf *out, const char *buf, size_t len);
+static void	flush_out(struct out_buf *out);
+static void	write_wait(struct out_buf *out, const char *buf, size_t len);
+static void	tidy_reactor(struct reactor *reactor);
+
+/* Data for the responses used by cuppa, in enum response order. */
 static const struct r_data RESPONSES[NUM_RESPONSES] = {
-	/* Name stdout? stderr? */
-	/* Pull */
-	{"OKAY", true, false},	/* R_OKAY */
-	{"WHAT", true, false},	/* R_WHAT */
-	{"FAIL", true, true},	/* R_FAIL */
-	{"OOPS", true, true},	/* R_OOPS */
-        {"NOPE", true, true},	/* R_NOPE */
-        /* Push */
-	{"OHAI", true, false},	/* R_OHAI */
-	{"TTFN", true, false},	/* R_TTFN */
-	{"STAT", true, false},	/* R_STAT */
-	{"TIME", true, false},	/* R_TIME */
-	{"DBUG", false, true},	/* R_DBUG */
-        /* Queue specific */
-	{"QPOS", true, false}, 	/* R_QPOS */
-        {"QENT", true, false},	/* R_QENT */
-	{"QMOD", true, false},	/* R_QMOD */
-	{"QNUM", true, false}	/* R_QNUM */
+#define X(name, routes, urgent, pull) {#name " ", routes, urgent, pull},
+	RESPONSE_LIST(X)
+#undef X
 };
 
+/*
+ * Everything below is per thread, so that each context (see ctx.h) has
+ * its own buffers, sinks and settings, and threads running different
+ * contexts share nothing on the response path.
+ */
+static _Thread_local struct out_buf OUT_STDOUT = {
+	.stream = {&FD_STREAM_OPS, NULL, STDOUT_FILENO},
+	.mode = WIRE_TEXT, .mask = ALL_RESPONSES, .stats = SS_STDOUT
+};
+static _Thread_local struct out_buf OUT_STDERR = {
+	.stream = {&FD_STREAM_OPS, NULL, STDERR_FILENO},
+	.mode = WIRE_TEXT, .mask = ALL_RESPONSES, .stats = SS_STDERR
+};
+static _Thread_local struct response_sink **SINKS = NULL;	/* Registered sinks */
+static _Thread_local size_t num_sinks = 0;	/* Number of registered sinks */
+static _Thread_local size_t sinks_size = 0;	/* Allocated length of SINKS */
+static _Thread_local uint64_t next_sink_id = 1;	/* ID to give the next sink */
+static _Thread_local struct response_sink *pull_sink = NULL;	/* See set_pull_sink */
+static _Thread_local enum flush_policy flush_policy = FLUSH_EACH;
+static _Thread_local char response_tag[TAG_PREFIX_LEN];	/* See set_response_tag */
+static _Thread_local size_t response_tag_len = 0;	/* 0 if no tag is set */
+static _Thread_local uint64_t flush_latency = 0;	/* See set_flush_policy */
+static _Thread_local uint64_t push_interval[NUM_RESPONSES];	/* See set_push_interval */
+static _Thread_local bool push_dedup[NUM_RESPONSES];	/* See set_push_dedup */
+
 /* Sends a response to standard out and, for certain responses, standard error.
  * This is the base function for all system responses.
+ *
+ * If a pull sink is set (see set_pull_sink), pull responses go there instead
+ * of standard out.  Push responses for standard out also go to every sink,
+ * and go to any target only if its mask allows (see set_response_mask), and
+ * coalescing doesn't hold them back.  The response is rendered once for each
+ * encoding in use, and copied to every other target in that encoding.
+ *
+ * Responses are buffered, and written out according to the flush policy set
+ * with set_flush_policy.  Anything else writing to standard out or standard
+ * error directly should call flush_responses first to keep output in order.
  */
 enum response
 vresponse(enum response code, const char *format, va_list ap)
 {
-	va_list		ap2;
+	size_t		pos;
+	int		mode;
+	bool		coalesce;
+	struct out_buf *out;
 	const struct r_data *r;
+	struct rendering done[NUM_WIRE_MODES] = {{NULL, 0, NULL}};
+	struct small_line small[NUM_WIRE_MODES] = {{-1, {'\0'}}, {-1, {'\0'}}};
 
 	r = &(RESPONSES[(int)code]);
-	va_copy(ap2, ap);
+	coalesce = !r->pull && (push_interval[code] != 0 || push_dedup[code]);
+	if (capture_enabled)
+		capture_vresponse(code, format, ap);
 
-	if (r->send_to_stdout) {
-		printf("%s ", r->name);
-		vprintf(format, ap);
-		printf("\n");
-                fflush(stdout);
-	}
-	if (r->send_to_stderr) {
-		fprintf(stderr, "%s ", r->name);
-		vfprintf(stderr, format, ap2);
-		fprintf(stderr, "\n");
-                fflush(stderr);
+	for (pos = 0; (out = next_target(r, &pos)) != NULL;) {
+		if (coalesce && render_small(out, code, format, ap, small))
+			hold_line(out, code, small[out->mode].line,
+				  (size_t)small[out->mode].len);
+		else
+			send_to(out, code, format, ap, done);
 	}
+
+	/* Flushing moves buffers around, so only do it once they're copied */
+	for (pos = 0; (out = next_target(r, &pos)) != NULL;)
+		maybe_flush(out, r);
+
+	for (mode = 0; mode < NUM_WIRE_MODES; mode++)
+		SAFE_FREE(&(done[mode].heap));
+	if (capture_failed)
+		report_capture_failure();
+
 	return code;
 }
 
@@ -116,19 +305,1218 @@ response(enum response code, const char *format,...)
 	return code;
 }
 
+/* Sends a response whose body has already been rendered: the 'len' bytes at
+ * 'body', which shouldn't contain any newlines.  This is routed and buffered
+ * exactly as 'vresponse' would, but skips the formatting work.
+ */
+enum response
+response_str(enum response code, const char *body, size_t len)
+{
+	put_response(code, body, len, NULL, 0);
+
+	return code;
+}
+
+/* Sends a response whose body is the unsigned integer 'value', such as an
+ * R_TIME in microseconds.  This skips the formatter entirely, and in binary
+ * goes out as a WF_U64 field rather than as text.
+ */
+enum response
+response_u64(enum response code, uint64_t value)
+{
+	char		digits[U64_DIGITS];
+	char		frame[WIRE_U64_FRAME];
+
+	encode_u64_frame(frame, code, value);
+	put_response(code, digits, format_u64(value, digits), frame,
+		     WIRE_U64_FRAME);
+
+	return code;
+}
+
+/* Sends a response whose body is the word 'word', then a space and 'arg' if
+ * 'arg' isn't NULL, as with the OKAY echoing a command.  This skips the
+ * formatter, unless the body is too long for a small buffer.
+ */
+enum response
+response_word_arg(enum response code, const char *word, const char *arg)
+{
+	char		body[WORD_ARG_LEN];
+	size_t		word_len;
+	size_t		arg_len = 0;
+
+	word_len = strlen(word);
+	if (arg != NULL)
+		arg_len = strlen(arg);
+
+	if (WORD_ARG_LEN < word_len + 1 + arg_len) {
+		if (arg == NULL)
+			response(code, "%s", word);
+		else
+			response(code, "%s %s", word, arg);
+	} else {
+		memcpy(body, word, word_len);
+		if (arg != NULL) {
+			body[word_len] = ' ';
+			memcpy(body + word_len + 1, arg, arg_len);
+			arg_len++;
+		}
+		put_response(code, body, word_len + arg_len, NULL, 0);
+	}
+
+	return code;
+}
+
+/* Writes out all buffered responses.
+ *
+ * Programs using a flush policy other than FLUSH_EACH should call this once
+ * per pass of their main loop; reactor_run calls it before waiting.  Sinks
+ * are only written to as far as they can be without waiting (see
+ * sink_pending).
+ */
+void
+flush_responses(void)
+{
+	size_t		i;
+	uint64_t	now = 0;
+
+	/* Send anything coalescing has been holding back for long enough */
+	for (i = 0; i < NUM_RESPONSES && now == 0; i++)
+		if (push_interval[i] != 0)
+			now = monotonic_usecs();
+	if (now != 0) {
+		release_held(&OUT_STDOUT, now);
+		release_held(&OUT_STDERR, now);
+		for (i = 0; i < num_sinks; i++)
+			release_held(&(SINKS[i]->out), now);
+	}
+
+	push_out(&OUT_STDOUT);
+	push_out(&OUT_STDERR);
+	for (i = 0; i < num_sinks; i++)
+		push_out(&(SINKS[i]->out));
+
+	if (capture_enabled)
+		flush_capture();
+	if (capture_failed)
+		report_capture_failure();
+}
+
+/* Coalesces push responses with code 'code' so that each target gets at
+ * most one every 'interval' microseconds: the newest, with the others thrown
+ * away.  The newest is sent once the interval is up, by the next call to
+ * flush_responses.  An interval of 0, the default, stops coalescing.
+ *
+ * This is meant for high-frequency pushes such as R_TIME.
+ */
+void
+set_push_interval(enum response code, uint64_t interval)
+{
+	push_interval[(int)code] = interval;
+}
+
+/* Sets whether push responses with code 'code' are thrown away when they
+ * are identical to the last one each target got, as repeated R_QNUMs often
+ * are.  This is off by default.
+ */
+void
+set_push_dedup(enum response code, bool dedup)
+{
+	push_dedup[(int)code] = dedup;
+}
+
+/* Sets which push responses go to the target of pull responses: the pull
+ * sink, or standard out if there is none (see set_pull_sink).  'mask' has a
+ * RESPONSE_BIT for each response wanted.  Pull responses always go through.
+ */
+void
+set_response_mask(uint32_t mask)
+{
+	if (pull_sink == NULL)
+		OUT_STDOUT.mask = mask;
+	else
+		pull_sink->out.mask = mask;
+}
+
+/* Reads a mask for set_response_mask out of 'names', which lists response
+ * names (such as "STAT QMOD") separated by space, or is "*" for all of them.
+ * Returns false, leaving *mask undefined, if any name is unknown.
+ */
+bool
+parse_response_mask(const char *names, uint32_t *mask)
+{
+	int		i;
+	size_t		len;
+	bool		ok = true;
+
+	*mask = 0;
+	if (strcmp(names, "*") == 0)
+		*mask = ALL_RESPONSES;
+	else
+		while (ok && *names != '\0') {
+			for (len = 0;
+			     names[len] != '\0' && names[len] != ' ';
+			     len++);
+
+			for (i = 0; i < NUM_RESPONSES; i++)
+				if (len == PREFIX_LEN - 1 &&
+				    memcmp(RESPONSES[i].prefix, names, len) == 0)
+					break;
+
+			if (i < NUM_RESPONSES)
+				*mask |= RESPONSE_BIT(i);
+			else if (len != 0)
+				ok = false;
+
+			names += len;
+			if (*names == ' ')
+				names++;
+		}
+
+	return ok;
+}
+
+/* Registers a new sink writing responses to 'fd', which is put into
+ * non-blocking mode.  Returns NULL, having reported why, if it can't.
+ * This is a wrapper around 'open_stream_sink'.
+ */
+struct response_sink *
+open_sink(int fd)
+{
+	int		flags;
+	struct stream	stream = fd_stream(fd);
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		error(E_INTERNAL_ERROR, "%s", MSG_IO_NONBLOCK);
+		return NULL;
+	}
+
+	return open_stream_sink(&stream);
+}
+
+/* Registers a new sink writing responses to 'stream' (see stream.h), which
+ * is copied, and whose writes MUST NOT block.  Returns NULL, having reported
+ * why, if it can't.
+ *
+ * If a sink falls so far behind that its buffer fills up, it is dropped and
+ * marked broken, so that one slow client can't stall the rest; the program
+ * should then close it with close_sink.  Writing to a sink whose reader has
+ * gone away raises SIGPIPE, which programs with sinks should ignore.
+ */
+struct response_sink *
+open_stream_sink(const struct stream *stream)
+{
+	size_t		size;
+	struct response_sink **sinks;
+	struct response_sink *sink = NULL;
+
+	if (num_sinks == sinks_size) {
+		size = (sinks_size == 0) ? 4 : sinks_size * 2;
+		sinks = realloc(SINKS, size * sizeof(*sinks));
+		if (sinks != NULL) {
+			SINKS = sinks;
+			sinks_size = size;
+		}
+	}
+	if (num_sinks < sinks_size)
+		sink = malloc(sizeof(*sink));
+
+	if (sink == NULL)
+		error(E_NO_MEM, "%s", MSG_IO_NOSINK);
+
+	if (sink != NULL) {
+		memset(sink, 0, sizeof(*sink));
+		sink->id = next_sink_id++;
+		sink->out.mask = ALL_RESPONSES;
+		sink->out.stats = SS_SINKS;
+		sink->out.stream = *stream;
+		sink->out.len = 0;
+		sink->out.since = 0;
+		sink->out.mode = WIRE_TEXT;
+		sink->out.nonblock = true;
+		sink->out.broken = false;
+
+		SINKS[num_sinks++] = sink;
+	}
+
+	return sink;
+}
+
+/* Unregisters and frees 'sink', throwing away anything still buffered for
+ * it.  The descriptor is left open.
+ */
+void
+close_sink(struct response_sink *sink)
+{
+	size_t		i;
+
+	for (i = 0; i < num_sinks && SINKS[i] != sink; i++);
+	if (i < num_sinks) {
+		SINKS[i] = SINKS[--num_sinks];
+
+		if (pull_sink == sink)
+			pull_sink = NULL;
+		free(sink);
+	}
+}
+
+/* Finds the sink with the given ID, or NULL if it has been closed. */
+struct response_sink *
+find_sink(uint64_t id)
+{
+	size_t		i;
+
+	for (i = 0; i < num_sinks; i++)
+		if (SINKS[i]->id == id)
+			return SINKS[i];
+
+	return NULL;
+}
+
+/* Returns the ID of 'sink', which stays unique even after it is closed. */
+uint64_t
+sink_id(const struct response_sink *sink)
+{
+	return sink->id;
+}
+
+/* Returns true if 'sink' has been dropped (see open_sink). */
+bool
+sink_broken(const struct response_sink *sink)
+{
+	return sink->out.broken;
+}
+
+/* Returns true if 'sink' has responses its descriptor wasn't ready for, in
+ * which case the program should wait for it to become writable and call
+ * flush_responses.
+ */
+bool
+sink_pending(const struct response_sink *sink)
+{
+	return sink->out.len != 0;
+}
+
+/* Sets which push responses 'sink' gets (see set_response_mask). */
+void
+set_sink_mask(struct response_sink *sink, uint32_t mask)
+{
+	sink->out.mask = mask;
+}
+
+/* Sends pull responses to 'sink' instead of standard out from now on, or
+ * back to standard out if 'sink' is NULL.  Programs taking commands from
+ * several clients set this to each client's sink while running its commands.
+ */
+void
+set_pull_sink(struct response_sink *sink)
+{
+	pull_sink = sink;
+}
+
+/* Gets the sink set with set_pull_sink, or NULL if there is none. */
+struct response_sink *
+get_pull_sink(void)
+{
+	return pull_sink;
+}
+
+/* Sets the tag to put at the start of every pull response (see enum
+ * response) until further notice, so that clients sending several commands
+ * at once can tell which command each answer is for.  The tag is the first
+ * 'len' bytes of 'tag', and is rendered as an '@', the tag and a space.
+ *
+ * A NULL or empty tag stops tagging.  Tags longer than MAX_TAG_LEN are
+ * cut short.
+ */
+void
+set_response_tag(const char *tag, size_t len)
+{
+	if (tag == NULL || len == 0)
+		response_tag_len = 0;
+	else {
+		if (MAX_TAG_LEN < len)
+			len = MAX_TAG_LEN;
+
+		response_tag[0] = '@';
+		memcpy(response_tag + 1, tag, len);
+		response_tag[len + 1] = ' ';
+		response_tag_len = len + 2;
+	}
+}
+
+/* Sets the encoding of pull responses (see enum wire_mode): those to the pull
+ * sink, if one is set, and otherwise all of those to standard out.  Standard
+ * error is for logs, and always gets text.
+ *
+ * Only later responses are affected: whatever is already buffered stays as
+ * it is, and goes out ahead of them as usual, so a slow sink isn't forced to
+ * take it all at once.
+ */
+void
+set_response_mode(enum wire_mode mode)
+{
+	int		i;
+	struct out_buf *out;
+	struct held_push *h;
+
+	out = (pull_sink == NULL) ? &OUT_STDOUT : &(pull_sink->out);
+	if (out->mode == mode)
+		return;
+
+	/* Anything held for coalescing is in the old encoding, so send it now */
+	for (i = 0; i < NUM_RESPONSES; i++) {
+		h = &(out->held[i]);
+		if (h->pending_len != 0)
+			append_line(out, h->pending, h->pending_len);
+		h->pending_len = 0;
+		h->last_len = 0;
+	}
+
+	out->mode = mode;
+}
+
+/* Sends everything that would go to standard out to 'stream' (see
+ * stream.h) instead, such as a shared-memory ring attached as the producer;
+ * it is copied, and NULL goes back to standard out.  Anything already
+ * buffered is written out first.
+ *
+ * When the stream is full, responses wait for room (see stream_wait) as
+ * they would for a blocking standard out; if the stream's reader goes away,
+ * they are dropped.
+ */
+void
+set_stdout_stream(const struct stream *stream)
+{
+	push_out(&OUT_STDOUT);
+	OUT_STDOUT.stream = (stream == NULL) ? fd_stream(STDOUT_FILENO) : *stream;
+	OUT_STDOUT.broken = false;
+}
+
+/* Gets the calling thread's response buffers ready now, rather than when
+ * the first responses go out, so that sending them costs no page faults or
+ * allocations.  This is part of cuppa_init.
+ */
+enum error
+prepare_responses(void)
+{
+	struct response_sink **sinks;
+	enum error	err = E_OK;
+
+	/* Touch the unused parts of the buffers, so they're paged in */
+	memset(OUT_STDOUT.data + OUT_STDOUT.len, 0, OUT_BUF_LEN - OUT_STDOUT.len);
+	memset(OUT_STDERR.data + OUT_STDERR.len, 0, OUT_BUF_LEN - OUT_STDERR.len);
+
+	if (sinks_size == 0) {
+		sinks = realloc(SINKS, 4 * sizeof(*sinks));
+		if (sinks == NULL)
+			err = error(E_NO_MEM, "%s", MSG_IO_NOSINK);
+		else {
+			SINKS = sinks;
+			sinks_size = 4;
+		}
+	}
+
+	return err;
+}
+
+/* Sets when buffered responses are written out (see enum flush_policy).
+ *
+ * If 'max_latency' is not 0, sending a response also flushes its buffer if
+ * the oldest response in it has been waiting at least that many
+ * microseconds.  A buffer is always flushed when it runs out of room.
+ */
+void
+set_flush_policy(enum flush_policy policy, uint64_t max_latency)
+{
+	flush_responses();
+
+	flush_policy = policy;
+	flush_latency = max_latency;
+}
+
 /* Returns true if input is waiting on standard in. */
 int
 input_waiting(void)
 {
-	fd_set		rfds;
-	struct timeval	tv;
+	return fd_waiting(STDIN_FILENO);
+}
+
+/* Returns true if input is waiting on the given file descriptor.
+ *
+ * This costs a system call every time, so programs that would otherwise call
+ * it on every pass of their main loop should consider a reactor instead.
+ */
+int
+fd_waiting(int fd)
+{
+	struct pollfd	pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/* Sets up an empty reactor.  It MUST be released with free_reactor. */
+void
+init_reactor(struct reactor *reactor)
+{
+	reactor->fds = NULL;
+	reactor->watches = NULL;
+	reactor->num_fds = 0;
+	reactor->size = 0;
+	reactor->timers = NULL;
+	reactor->num_timers = 0;
+	reactor->timers_size = 0;
+}
+
+/* Releases the storage held by 'reactor', unscheduling its timers.  The
+ * descriptors are left open.
+ */
+void
+free_reactor(struct reactor *reactor)
+{
+	SAFE_FREE(&(reactor->fds));
+	SAFE_FREE(&(reactor->watches));
+	reactor->num_fds = 0;
+	reactor->size = 0;
+	free_reactor_timers(reactor);
+}
+
+/* Watches 'fd' for input, calling 'handler' with 'data' and the descriptor
+ * whenever reactor_run finds input (or end of file, or an error) waiting on
+ * it.  Watching a descriptor that is already watched replaces its handler.
+ */
+enum error
+reactor_add(struct reactor *reactor, int fd, io_handler handler, void *data)
+{
+	size_t		i;
+	size_t		size;
+	struct pollfd  *fds;
+	struct reactor_watch *watches;
+	enum error	err = E_OK;
+
+	for (i = 0; i < reactor->num_fds && reactor->fds[i].fd != fd; i++);
 
-	/* Watch stdin (fd 0) to see when it has input. */
-	FD_ZERO(&rfds);
-	FD_SET(0, &rfds);
-	/* Stop checking immediately. */
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
+	if (i == reactor->size) {
+		size = (reactor->size == 0) ? 4 : reactor->size * 2;
 
-	return select(1, &rfds, NULL, NULL, &tv);
+		fds = realloc(reactor->fds, size * sizeof(*fds));
+		if (fds != NULL)
+			reactor->fds = fds;
+		watches = (fds == NULL) ? NULL :
+		    realloc(reactor->watches, size * sizeof(*watches));
+		if (watches != NULL) {
+			reactor->watches = watches;
+			reactor->size = size;
+		} else
+			err = error(E_NO_MEM, "%s", MSG_IO_NOWATCH);
+	}
+	if (err == E_OK) {
+		if (i == reactor->num_fds)
+			reactor->num_fds++;
+
+		reactor->fds[i].fd = fd;
+		reactor->fds[i].events = POLLIN;
+		reactor->fds[i].revents = 0;
+		reactor->watches[i].handler = handler;
+		reactor->watches[i].data = data;
+		reactor->watches[i].again = false;
+	}
+
+	return err;
+}
+
+/* Stops watching 'fd'.  This is safe to call from inside a handler. */
+void
+reactor_remove(struct reactor *reactor, int fd)
+{
+	size_t		i;
+
+	/* Actually removing the watch is left to tidy_reactor */
+	for (i = 0; i < reactor->num_fds; i++)
+		if (reactor->fds[i].fd == fd) {
+			reactor->fds[i].fd = -1;
+			reactor->watches[i].handler = NULL;
+		}
+}
+
+/* Sets whether the reactor also calls the handler for 'fd' when it becomes
+ * writable, for handlers with output waiting (see sink_pending).
+ */
+void
+reactor_want_output(struct reactor *reactor, int fd, bool want)
+{
+	size_t		i;
+
+	for (i = 0; i < reactor->num_fds; i++)
+		if (reactor->fds[i].fd == fd)
+			reactor->fds[i].events = want ? POLLIN | POLLOUT : POLLIN;
+}
+
+/* Makes the next reactor_run call the handler for 'fd' without waiting for
+ * more input, for handlers that had to leave input unprocessed.
+ */
+void
+reactor_again(struct reactor *reactor, int fd)
+{
+	size_t		i;
+
+	for (i = 0; i < reactor->num_fds; i++)
+		if (reactor->fds[i].fd == fd)
+			reactor->watches[i].again = true;
+}
+
+/* Waits up to 'timeout' microseconds (forever if negative, not at all if 0)
+ * for input on any of the reactor's descriptors, or until its next timer is
+ * due, then calls the handlers of the descriptors that have input and the
+ * timers that are due.
+ *
+ * Returns E_OK if the wait timed out or was interrupted by a signal;
+ * otherwise, stops at and returns the first error a handler returns.
+ */
+enum error
+reactor_run(struct reactor *reactor, int64_t timeout)
+{
+	int		ready;
+	int		timeout_ms;
+	size_t		i;
+	size_t		num_fds;
+	struct reactor_watch *w;
+	enum error	err = E_OK;
+
+	/* Don't leave anything sitting in the buffers while we sleep */
+	drain_response_queue();
+	flush_responses();
+	tidy_reactor(reactor);
+
+	for (i = 0; i < reactor->num_fds; i++)
+		if (reactor->watches[i].again)
+			timeout = 0;
+	timeout = reactor_timeout(reactor, timeout);
+
+	/* Round up, so we never wake up before the caller wanted */
+	if (timeout < 0)
+		timeout_ms = -1;
+	else if (timeout / 1000 >= INT_MAX)
+		timeout_ms = INT_MAX;
+	else
+		timeout_ms = (int)((timeout + 999) / 1000);
+
+	ready = poll(reactor->fds, (nfds_t)reactor->num_fds, timeout_ms);
+	if (ready == -1 && errno != EINTR)
+		err = error(E_INTERNAL_ERROR, "%s", MSG_IO_POLL);
+
+	/* Handlers added during this loop won't have been polled yet */
+	num_fds = reactor->num_fds;
+	for (i = 0; i < num_fds && ready != -1 && err == E_OK; i++) {
+		w = &(reactor->watches[i]);
+		if (w->handler != NULL &&
+		    (w->again || reactor->fds[i].revents != 0)) {
+			w->again = false;
+			err = w->handler(w->data, reactor->fds[i].fd);
+		}
+	}
+	if (err == E_OK)
+		err = reactor_run_timers(reactor);
+
+	return err;
+}
+
+/* Gets the array of descriptors the reactor is watching, and its length.
+ *
+ * Programs with their own poll loop can watch these descriptors alongside
+ * their own, then call reactor_run with a zero timeout when any of them
+ * (or the last reactor_run's handlers, through reactor_again) need
+ * attention.  Entries with negative descriptors should be skipped.
+ */
+const struct pollfd *
+reactor_fds(const struct reactor *reactor, size_t *num_fds)
+{
+	*num_fds = reactor->num_fds;
+
+	return reactor->fds;
+}
+
+/* Removes the watches marked as removed by reactor_remove. */
+static void
+tidy_reactor(struct reactor *reactor)
+{
+	size_t		i;
+	size_t		j;
+
+	for (i = 0, j = 0; i < reactor->num_fds; i++)
+		if (reactor->watches[i].handler != NULL) {
+			reactor->fds[j] = reactor->fds[i];
+			reactor->watches[j] = reactor->watches[i];
+			j++;
+		}
+	reactor->num_fds = j;
+}
+
+/* Steps through the output buffers that a response with data 'r' goes to,
+ * returning NULL once there are no more.  Start *pos at 0.
+ */
+static struct out_buf *
+next_target(const struct r_data *r, size_t *pos)
+{
+	size_t		i;
+	struct out_buf *out = NULL;
+
+	/* Positions are the pull target, then each sink, then stderr */
+	while (out == NULL && *pos < num_sinks + 2) {
+		i = (*pos)++;
+
+		if (i == 0 && r->pull && pull_sink != NULL)
+			out = &(pull_sink->out);
+		else if (i == 0 && (r->routes & ROUTE_OUT))
+			out = &OUT_STDOUT;
+		else if (0 < i && i <= num_sinks && !r->pull &&
+			 (r->routes & ROUTE_OUT))
+			out = &(SINKS[i - 1]->out);
+		else if (i == num_sinks + 1 && (r->routes & ROUTE_ERR))
+			out = &OUT_STDERR;
+
+		if (out != NULL && out->broken)
+			out = NULL;
+		else if (out != NULL && !r->pull &&
+			 (out->mask & RESPONSE_BIT(r - RESPONSES)) == 0)
+			out = NULL;
+	}
+
+	return out;
+}
+
+/* Sends a response with a pre-rendered body (see response_str) to all of its
+ * targets.  If 'frame' isn't NULL, it is a whole binary frame to send in its
+ * place to binary targets, unless the frame would need to carry a tag.
+ */
+static void
+put_response(enum response code,
+	     const char *body,
+	     size_t len,
+	     const char *frame,
+	     size_t frame_len)
+{
+	size_t		pos;
+	size_t		hlen;
+	bool		coalesce;
+	struct out_buf *out;
+	const struct r_data *r;
+	char		small[HELD_LEN];
+
+	r = &(RESPONSES[(int)code]);
+	coalesce = !r->pull && (push_interval[code] != 0 || push_dedup[code]);
+	if (capture_enabled)
+		capture_out(code, body, len);
+
+	for (pos = 0; (out = next_target(r, &pos)) != NULL;) {
+		hlen = head_len(out->mode, code);
+		if (frame != NULL && out->mode == WIRE_BINARY &&
+		    hlen == WIRE_STR_HEAD) {
+			if (coalesce)
+				hold_line(out, code, frame, frame_len);
+			else
+				append_line(out, frame, frame_len);
+		} else if (coalesce && hlen + len + 1 <= HELD_LEN) {
+			write_head(small, out->mode, code, len);
+			memcpy(small + hlen, body, len);
+			small[hlen + len] = (out->mode == WIRE_BINARY) ? '\0' : '\n';
+			hold_line(out, code, small, hlen + len + 1);
+		} else
+			put_line(out, code, body, len);
+		maybe_flush(out, r);
+	}
+
+	/* Only now is 'body' (which may be the error buffer) finished with */
+	if (capture_failed)
+		report_capture_failure();
+}
+
+/* Renders a push response for coalescing into 'small' (one per encoding) in
+ * the encoding of 'out', unless that was already tried.  Returns false if it
+ * doesn't fit, in which case the response should be sent as normal.
+ */
+static bool
+render_small(struct out_buf *out,
+	     enum response code,
+	     const char *format,
+	     va_list ap,
+	     struct small_line *small)
+{
+	int		len;
+	va_list		ap2;
+	struct small_line *sl = &(small[out->mode]);
+
+	if (sl->len == -1) {
+		va_copy(ap2, ap);
+		len = format_line(sl->line, HELD_LEN, out->mode, code,
+				  format, ap2);
+		va_end(ap2);
+
+		sl->len = (0 < len && len <= HELD_LEN) ? len : -2;
+	}
+
+	return sl->len != -2;
+}
+
+/* Sends the rendered push response 'line' to 'out', unless coalescing says
+ * to throw it away or hold it back (see set_push_interval, set_push_dedup).
+ */
+static void
+hold_line(struct out_buf *out, enum response code, const char *line, size_t len)
+{
+	uint64_t	now;
+	struct held_push *h = &(out->held[(int)code]);
+
+	if (push_dedup[code]) {
+		if (h->last_len == len && memcmp(h->last, line, len) == 0)
+			return;
+		memcpy(h->last, line, len);
+		h->last_len = len;
+	}
+
+	if (push_interval[code] != 0) {
+		now = monotonic_usecs();
+		if (now - h->sent < push_interval[code]) {
+			memcpy(h->pending, line, len);
+			h->pending_len = len;
+			return;
+		}
+		h->sent = now;
+		h->pending_len = 0;
+	}
+
+	append_line(out, line, len);
+}
+
+/* Sends whatever push responses 'out' has been holding back whose interval
+ * had run out by 'now'.
+ */
+static void
+release_held(struct out_buf *out, uint64_t now)
+{
+	int		i;
+	struct held_push *h;
+
+	for (i = 0; i < NUM_RESPONSES; i++) {
+		h = &(out->held[i]);
+		if (h->pending_len != 0 && push_interval[i] <= now - h->sent) {
+			append_line(out, h->pending, h->pending_len);
+			h->pending_len = 0;
+			h->sent = now;
+		}
+	}
+}
+
+/* Sends a response to the output buffer 'out', rendering it unless 'done'
+ * already holds a rendering in the buffer's encoding.  'done' (one per
+ * encoding) is filled in with any new rendering; its heap buffers MUST be
+ * freed by the caller.
+ */
+static void
+send_to(struct out_buf *out,
+	enum response code,
+	const char *format,
+	va_list ap,
+	struct rendering *done)
+{
+	va_list		ap2;
+	struct rendering *r = &(done[out->mode]);
+
+	if (r->line == NULL) {
+		va_copy(ap2, ap);
+		r->line = send_line(out, code, format, ap2, &(r->len),
+				    &(r->heap));
+		va_end(ap2);
+	} else if (r->heap != NULL)
+		write_now(out, r->heap, r->len);
+	else
+		append_line(out, r->line, r->len);
+}
+
+/* Renders a response into the output buffer 'out' (see render_line), and
+ * writes it straight out if it was too long to buffer.
+ */
+static char    *
+send_line(struct out_buf *out,
+	  enum response code,
+	  const char *format,
+	  va_list ap,
+	  size_t *len,
+	  char **heap)
+{
+	char           *line;
+
+	line = render_line(out, code, format, ap, len, heap);
+	if (*heap != NULL)
+		write_now(out, *heap, *len);
+
+	return line;
+}
+
+/* Renders a response with the given code, format and arguments into the
+ * output buffer 'out', in its encoding, flushing it first if there isn't
+ * enough room.  Returns a pointer to the response in the buffer, and sets
+ * *len to its length.
+ *
+ * If the response is too long to ever fit in the buffer, it is instead
+ * rendered into a heap buffer whose pointer is returned through *heap, and
+ * which the caller MUST free.  Returns NULL, and renders nothing, if the
+ * format is bad or a large enough heap buffer can't be found.
+ */
+static char    *
+render_line(struct out_buf *out,
+	    enum response code,
+	    const char *format,
+	    va_list ap,
+	    size_t *len,
+	    char **heap)
+{
+	int		need;
+	size_t		room;
+	char           *line = NULL;
+	va_list		ap2;
+	va_list		ap3;
+
+	va_copy(ap2, ap);
+	va_copy(ap3, ap);
+
+	room = OUT_BUF_LEN - out->len;
+	need = format_line(out->data + out->len, room, out->mode, code,
+			   format, ap);
+	if (need > 0 && (size_t)need > room && (size_t)need <= OUT_BUF_LEN &&
+	    out->len != 0) {
+		flush_out(out);
+		room = OUT_BUF_LEN;
+		need = format_line(out->data, room, out->mode, code,
+				   format, ap2);
+	}
+
+	if (need > 0 && (size_t)need <= room) {
+		line = out->data + out->len;
+		if (out->len == 0)
+			out->since = (flush_latency == 0) ? 0 : monotonic_usecs();
+		out->len += (size_t)need;
+	} else if (need > 0) {
+		/* The extra byte is for vsnprintf's terminator */
+		*heap = malloc((size_t)need + 1);
+		if (*heap != NULL)
+			format_line(*heap, (size_t)need + 1, out->mode, code,
+				    format, ap3);
+		line = *heap;
+	}
+	if (line != NULL)
+		*len = (size_t)need;
+
+	va_end(ap2);
+	va_end(ap3);
+
+	return line;
+}
+
+/* Formats a response into 'buf', which has room for 'room' bytes, in the
+ * encoding 'mode', returning the length of the full response.  If this is
+ * more than 'room', the contents of 'buf' are undefined.
+ *
+ * In text, a response is its name, a space, the rendered format and a
+ * newline; in binary, it is a frame with the rendered format as its only
+ * field.  Either way, the body starts with any tag set for the response.
+ * Returns -1 if the format couldn't be rendered.
+ */
+static int
+format_line(char *buf,
+	    size_t room,
+	    enum wire_mode mode,
+	    enum response code,
+	    const char *format,
+	    va_list ap)
+{
+	int		body;
+	int		head;
+	int		need = -1;
+
+	head = (int)head_len(mode, code);
+
+	if (room >= (size_t)head)
+		body = vsnprintf(buf + head, room - (size_t)head, format, ap);
+	else
+		body = vsnprintf(NULL, 0, format, ap);
+
+	if (body >= 0 && body < INT_MAX - head) {
+		/* Text puts a newline where vsnprintf put its terminator */
+		need = head + body + 1;
+		if ((size_t)need <= room) {
+			write_head(buf, mode, code, (size_t)body);
+			if (mode == WIRE_TEXT)
+				buf[head + body] = '\n';
+		}
+	}
+
+	return need;
+}
+
+/* Renders the body of a response for capture (see capture.h), which only
+ * happens once however many targets the response goes to.
+ */
+static void
+capture_vresponse(enum response code, const char *format, va_list ap)
+{
+	int		len;
+	char		small[CAPTURE_BODY_LEN];
+	char	       *body = small;
+	va_list		aq;
+
+	va_copy(aq, ap);
+	len = vsnprintf(small, sizeof(small), format, aq);
+	va_end(aq);
+
+	if ((size_t)len >= sizeof(small) && len < INT_MAX) {
+		body = malloc((size_t)len + 1);
+		if (body != NULL) {
+			va_copy(aq, ap);
+			vsnprintf(body, (size_t)len + 1, format, aq);
+			va_end(aq);
+		}
+	}
+	if (0 <= len && body != NULL)
+		capture_out(code, body, (size_t)len);
+
+	if (body != small)
+		free(body);
+}
+
+/* Returns the length of the head of a response with code 'code' in the
+ * encoding 'mode': everything before its rendered body.
+ */
+static size_t
+head_len(enum wire_mode mode, enum response code)
+{
+	size_t		len;
+
+	len = (mode == WIRE_BINARY) ? WIRE_STR_HEAD : PREFIX_LEN;
+	if (RESPONSES[(int)code].pull)
+		len += response_tag_len;
+
+	return len;
+}
+
+/* Writes the head of a response (see head_len) with a body 'len' bytes long
+ * into the start of 'buf'.
+ */
+static void
+write_head(char *buf,
+	   enum wire_mode mode,
+	   enum response code,
+	   size_t len)
+{
+	size_t		tag_len = 0;
+
+	if (RESPONSES[(int)code].pull)
+		tag_len = response_tag_len;
+
+	if (mode == WIRE_BINARY) {
+		/* The tag is part of the string field */
+		encode_str_frame(buf, code, tag_len + len);
+		buf += WIRE_STR_HEAD;
+	} else {
+		memcpy(buf, RESPONSES[(int)code].prefix, PREFIX_LEN);
+		buf += PREFIX_LEN;
+	}
+	memcpy(buf, response_tag, tag_len);
+}
+
+/* Copies an already rendered line into the output buffer 'out', flushing to
+ * make room if necessary.
+ */
+static void
+append_line(struct out_buf *out, const char *line, size_t len)
+{
+	if (OUT_BUF_LEN - out->len < len)
+		flush_out(out);
+
+	if (out->len == 0)
+		out->since = (flush_latency == 0) ? 0 : monotonic_usecs();
+	memcpy(out->data + out->len, line, len);
+	out->len += len;
+}
+
+/* Adds a response with the given code and pre-rendered body to the output
+ * buffer 'out', in its encoding, flushing to make room if necessary.
+ * Responses too long to buffer are written straight out.
+ */
+static void
+put_line(struct out_buf *out,
+	 enum response code,
+	 const char *body,
+	 size_t len)
+{
+	char		head[MAX_HEAD_LEN];
+	char           *p;
+	size_t		hlen;
+
+	hlen = head_len(out->mode, code);
+	write_head(head, out->mode, code, len);
+
+	/* The last byte is the text newline or the binary terminator */
+	if (OUT_BUF_LEN - out->len < hlen + len + 1)
+		flush_out(out);
+
+	if (hlen + len + 1 <= OUT_BUF_LEN) {
+		if (out->len == 0)
+			out->since = (flush_latency == 0) ? 0 : monotonic_usecs();
+
+		p = out->data + out->len;
+		memcpy(p, head, hlen);
+		memcpy(p + hlen, body, len);
+		p[hlen + len] = (out->mode == WIRE_BINARY) ? '\0' : '\n';
+		out->len += hlen + len + 1;
+	} else {
+		out_write(out, head, hlen);
+		out_write(out, body, len);
+		out_write(out, (out->mode == WIRE_BINARY) ? "" : "\n", 1);
+	}
+}
+
+/* Flushes 'out', which has just had response 'r' added, if the flush
+ * policy says it should be.
+ */
+static void
+maybe_flush(struct out_buf *out, const struct r_data *r)
+{
+	bool		flush;
+
+	switch (flush_policy) {
+	case FLUSH_EACH:
+		flush = true;
+		break;
+	case FLUSH_URGENT:
+		flush = r->urgent;
+		break;
+	default:
+		flush = false;
+		break;
+	}
+
+	if (!flush && flush_latency != 0)
+		flush = (flush_latency <= monotonic_usecs() - out->since);
+
+	if (flush)
+		push_out(out);
+}
+
+/* Writes 'len' bytes from 'buf' straight to the descriptor of 'out', after
+ * anything already buffered there.
+ */
+static void
+write_now(struct out_buf *out, const char *buf, size_t len)
+{
+	flush_out(out);
+	out_write(out, buf, len);
+}
+
+/* Writes out and empties the output buffer 'out', to make room in it.  Sinks
+ * that can't take all of it straight away are dropped.
+ */
+static void
+flush_out(struct out_buf *out)
+{
+	push_out(out);
+	if (out->len != 0) {
+		out->broken = true;
+		out->len = 0;
+	}
+}
+
+/* Writes out as much of the output buffer 'out' as its stream will take
+ * (all of it, unless the output is non-blocking), keeping the rest, then
+ * flushes the stream.
+ */
+static void
+push_out(struct out_buf *out)
+{
+	size_t		done;
+
+	if (out->len != 0 && !out->nonblock) {
+		write_wait(out, out->data, out->len);
+		if (stats_enabled)
+			stats_add_bytes(out->stats, out->len);
+		out->len = 0;
+	} else if (out->len != 0 && !out->broken) {
+		done = write_some(out, out->data, out->len);
+		if (stats_enabled)
+			stats_add_bytes(out->stats, done);
+		memmove(out->data, out->data + done, out->len - done);
+		out->len -= done;
+	}
+	if (out->broken)
+		out->len = 0;
+	else
+		stream_flush(&(out->stream));
+}
+
+/* Writes 'len' bytes from 'buf' to the stream of 'out', which MUST have
+ * nothing buffered.  On a sink, whatever the stream won't take straight
+ * away is buffered, and the sink dropped if that doesn't fit.
+ */
+static void
+out_write(struct out_buf *out, const char *buf, size_t len)
+{
+	size_t		done = 0;
+
+	if (!out->nonblock) {
+		write_wait(out, buf, len);
+		done = len;
+	} else if (!out->broken) {
+		done = write_some(out, buf, len);
+		if (OUT_BUF_LEN < len - done)
+			out->broken = true;
+		else if (!out->broken && done < len) {
+			memcpy(out->data, buf + done, len - done);
+			out->len = len - done;
+			out->since = (flush_latency == 0) ? 0 : monotonic_usecs();
+		}
+	}
+	if (stats_enabled)
+		stats_add_bytes(out->stats, done);
+}
+
+/* Writes as much of 'buf' as the non-blocking stream of 'out' will take
+ * without waiting, returning how much that was.  'out' is marked broken if
+ * the stream fails.
+ */
+static size_t
+write_some(struct out_buf *out, const char *buf, size_t len)
+{
+	ssize_t		num_written;
+	size_t		done = 0;
+
+	while (done < len && !out->broken) {
+		num_written = stream_write(&(out->stream), buf + done, len - done);
+		if (num_written > 0)
+			done += (size_t)num_written;
+		else if (num_written == -1 &&
+			 (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		else
+			out->broken = true;
+	}
+
+	return done;
+}
+
+/* Writes all of 'buf' to the blocking output 'out', waiting if need be.
+ * Output is dropped if the stream fails, as stdio would, and all later
+ * output too if its reader has gone away.
+ */
+static void
+write_wait(struct out_buf *out, const char *buf, size_t len)
+{
+	if (!out->broken &&
+	    !stream_write_all(&(out->stream), buf, len) &&
+	    errno == EPIPE)
+		out->broken = true;
 }
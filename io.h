@@ -34,36 +34,165 @@
 #ifndef CUPPA_IO_H
 #define CUPPA_IO_H
 
+#include <poll.h>		/* struct pollfd */
 #include <stdarg.h>		/* vresponse */
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* int64_t, uint32_t, uint64_t */
 
-/* Four-character response codes.
+#include "errors.h"		/* enum error */
+
+/* Longest tag that can be put on pull responses (see set_response_tag). */
+#define MAX_TAG_LEN 32
+
+/* Where a response goes (see RESPONSE_LIST). */
+#define ROUTE_OUT 0x1		/* To standard out, or the client */
+#define ROUTE_ERR 0x2		/* To standard error */
+
+/* Every four-character response code, as X(NAME, ROUTES, URGENT, PULL):
+ * ROUTES says where it goes, URGENT whether FLUSH_URGENT writes it straight
+ * out, and PULL whether it answers a command (and so carries its tag and
+ * goes to the pull sink).  Both enum response and the routing table in io.c
+ * are generated from this, so they can't disagree.
  *
- * NOTE: If you're adding new responses here, PLEASE update RESPONSES in io.c.
+ * NOTE: Names MUST be four characters long.  Binary frames and response
+ * masks carry codes by number, so new codes MUST go on the end.
  */
+#define RESPONSE_LIST(X) \
+	/* 'Pull' responses (initiated by client command) */ \
+	X(OKAY, ROUTE_OUT, true, true)	/* Request valid, produced answer */ \
+	X(WHAT, ROUTE_OUT, true, true)	/* Request was invalid/user error */ \
+	X(FAIL, ROUTE_OUT | ROUTE_ERR, true, true)	/* Environment's fault */ \
+	X(OOPS, ROUTE_OUT | ROUTE_ERR, true, true)	/* Programmer's fault */ \
+	X(NOPE, ROUTE_OUT | ROUTE_ERR, true, true)	/* Valid, but forbidden */ \
+	/* 'Push' responses (initiated by server) */ \
+	X(OHAI, ROUTE_OUT, true, false)	/* Server starting up */ \
+	X(TTFN, ROUTE_OUT, true, false)	/* Server shutting down */ \
+	X(STAT, ROUTE_OUT, false, false)	/* Server changing state */ \
+	X(TIME, ROUTE_OUT, false, false)	/* Current song time */ \
+	X(DBUG, ROUTE_ERR, false, false)	/* Debug information */ \
+	/* Queue-specific responses */ \
+	X(QENT, ROUTE_OUT, false, false)	/* Information about a Queue ENTry */ \
+	X(QMOD, ROUTE_OUT, false, false)	/* Queue MODification */ \
+	X(QPOS, ROUTE_OUT, false, false)	/* Queue POSition changed */ \
+	X(QNUM, ROUTE_OUT, false, false)	/* Number of queue items */ \
+	/* Late additions, kept last so older codes keep their numbers */ \
+	X(PERF, ROUTE_OUT, false, true)	/* Statistics, answering STATS */
+
+/* Four-character response codes, R_NAME for each NAME in RESPONSE_LIST. */
 enum response {
-	/* 'Pull' responses (initiated by client command) */
-	R_OKAY,			/* Request was valid and produced an answer */
-	R_WHAT,			/* Request was invalid/user error */
-	R_FAIL,			/* Error, pointing blame at environment */
-	R_OOPS,			/* Error, pointing blame at programmer */
-	R_NOPE,			/* Request was probably valid, but forbidden. */
-	/* 'Push' responses (initiated by server) */
-	R_OHAI,			/* Server starting up */
-	R_TTFN,			/* Server shutting down */
-	R_STAT,			/* Server changing state */
-	R_TIME,			/* Server sending current song time */
-	R_DBUG,			/* Debug information */
-	/* Queue-specific responses */
-	R_QENT,			/* Requested information about a Queue ENTry */
-	R_QMOD,			/* A command caused a Queue MODification */
-	R_QPOS,			/* The current Queue POSition has changed */
-	R_QNUM,			/* Reminder of current number of queue items */
+#define X(name, routes, urgent, pull) R_##name,
+	RESPONSE_LIST(X)
+#undef X
 	/*--------------------------------------------------------------------*/
 	NUM_RESPONSES		/* Number of items in enum */
 };
 
+/* Bit for a response in a response mask (see set_response_mask). */
+#define RESPONSE_BIT(code) (UINT32_C(1) << (code))
+/* Mask with every response in it. */
+#define ALL_RESPONSES (RESPONSE_BIT(NUM_RESPONSES) - 1)
+
+/* Encodings a command stream or response stream can use. */
+enum wire_mode {
+	WIRE_TEXT,		/* Four-character words and newline-ended lines */
+	WIRE_BINARY,		/* Length-prefixed binary frames (see wire.h) */
+	/*--------------------------------------------------------------------*/
+	NUM_WIRE_MODES		/* Number of items in enum */
+};
+
+/* When buffered responses are written out.  Whatever the policy, responses
+ * are also written whenever their buffer fills up, and by flush_responses.
+ */
+enum flush_policy {
+	FLUSH_EACH,		/* Write every response as soon as it is sent */
+	FLUSH_URGENT,		/* Write on pull responses, OHAI and TTFN */
+	FLUSH_MANUAL		/* Only write on flush_responses or latency */
+};
+
+/* A client that responses can be sent to, besides standard out.  Set up with
+ * open_sink (or open_stream_sink) and release with close_sink.
+ */
+struct response_sink;
+
+/* A stream responses can be written to (see stream.h). */
+struct stream;
+
+/* A deadline a reactor runs a handler at (see timer.h). */
+struct timer;
+
+/* Handler called by a reactor when a descriptor it watches is readable (or,
+ * if asked for with reactor_want_output, writable).
+ */
+typedef enum error (*io_handler) (void *data, int fd);
+
+/* What a reactor does when a given descriptor becomes readable. */
+struct reactor_watch {
+	io_handler	handler;	/* Handler, or NULL if removed */
+	void	       *data;	/* User data passed to the handler */
+	bool		again;	/* Call handler next run even without input */
+};
+
+/*
+ * Reactor - waits on a set of descriptors at once, calling a handler for each
+ * descriptor that has input, and for each timer that is due (see timer.h),
+ * so programs can sleep until there is something to do instead of
+ * repeatedly polling.
+ *
+ * Set up with init_reactor and release with free_reactor.  Don't touch the
+ * fields directly.
+ */
+struct reactor {
+	struct pollfd  *fds;	/* Descriptors being watched, for poll */
+	struct reactor_watch *watches;	/* Handler data for each of 'fds' */
+	size_t		num_fds;	/* Number of descriptors in use */
+	size_t		size;	/* Allocated length of both arrays */
+	struct timer  **timers;	/* Scheduled timers, as a min-heap */
+	size_t		num_timers;	/* Number of timers scheduled */
+	size_t		timers_size;	/* Allocated length of 'timers' */
+};
+
 enum response	response(enum response code, const char *format,...);
 enum response	vresponse(enum response code, const char *format, va_list ap);
+enum response	response_str(enum response code, const char *body, size_t len);
+enum response	response_u64(enum response code, uint64_t value);
+enum response
+response_word_arg(enum response code,
+		  const char *word,
+		  const char *arg);
+void		flush_responses(void);
+enum error	prepare_responses(void);
+void		set_flush_policy(enum flush_policy policy, uint64_t max_latency);
+void		set_response_mode(enum wire_mode mode);
+void		set_stdout_stream(const struct stream *stream);
+void		set_response_tag(const char *tag, size_t len);
+struct response_sink *open_sink(int fd);
+struct response_sink *open_stream_sink(const struct stream *stream);
+void		close_sink(struct response_sink *sink);
+struct response_sink *find_sink(uint64_t id);
+uint64_t	sink_id(const struct response_sink *sink);
+bool		sink_broken(const struct response_sink *sink);
+bool		sink_pending(const struct response_sink *sink);
+void		set_sink_mask(struct response_sink *sink, uint32_t mask);
+void		set_response_mask(uint32_t mask);
+bool		parse_response_mask(const char *names, uint32_t *mask);
+void		set_push_interval(enum response code, uint64_t interval);
+void		set_push_dedup(enum response code, bool dedup);
+void		set_pull_sink(struct response_sink *sink);
+struct response_sink *get_pull_sink(void);
 int		input_waiting(void);
+int		fd_waiting(int fd);
+void		init_reactor(struct reactor *reactor);
+void		free_reactor(struct reactor *reactor);
+enum error
+reactor_add(struct reactor *reactor,
+	    int fd,
+	    io_handler handler,
+	    void *data);
+void		reactor_remove(struct reactor *reactor, int fd);
+void		reactor_want_output(struct reactor *reactor, int fd, bool want);
+void		reactor_again(struct reactor *reactor, int fd);
+enum error	reactor_run(struct reactor *reactor, int64_t timeout);
+const struct pollfd *reactor_fds(const struct reactor *reactor, size_t *num_fds);
 
 #endif				/* !CUPPA_IO_H */
@@ -33,17 +33,85 @@
 
 #define MSG(name, contents) const char * name = contents
 
+MSG(MSG_CAP_BADLOG,
+    "Capture log is cut short or malformed");
+MSG(MSG_CAP_READ,
+    "Couldn't read capture log");
+MSG(MSG_CAP_WRITE,
+    "Couldn't write capture log, stopping capture");
+MSG(MSG_CMD_ARGC,
+    "Wrong number of arguments");
 MSG(MSG_CMD_ARGN,
     "Expecting no argument, got one");
 MSG(MSG_CMD_ARGU,
     "Expecting an argument, didn't get one");
+MSG(MSG_CMD_BADINT,
+    "Expecting a whole number");
+MSG(MSG_CMD_BADMASK,
+    "Expecting response names, or '*'");
+MSG(MSG_CMD_BADSPEC,
+    "Command has an invalid argument spec");
+MSG(MSG_CMD_BADSTATS,
+    "Expecting no argument, 'on', 'off' or 'reset'");
+MSG(MSG_CMD_BADTAG,
+    "Command tag is empty or too long");
+MSG(MSG_CMD_BADTIME,
+    "Expecting a time, optionally in us, ms or s");
 MSG(MSG_CMD_HITEND,
     "Hit end of commands list without stopping");
+MSG(MSG_CMD_LONGLINE,
+    "Command line too long, ignoring it");
+MSG(MSG_CMD_NOBUF,
+    "Couldn't make room to read in command");
+MSG(MSG_CMD_NOJOB,
+    "Too many commands still running");
 MSG(MSG_CMD_NOPROP,
     "Command type is PROPAGATE, but propagate stream is NULL");
 MSG(MSG_CMD_NOSUCH,
     "Command not recognised");
 MSG(MSG_CMD_NOWORD,
     "Need at least a command word");
-MSG(MSG_ERR_NOMEM,
-    "(ran out of memory to write error!)");
+MSG(MSG_CMD_NUL,
+    "Command line contains a null byte");
+MSG(MSG_CMD_PROPW,
+    "Couldn't forward command to propagate target");
+MSG(MSG_CMD_READ,
+    "Couldn't read from command stream");
+MSG(MSG_CMD_STANDBY,
+    "On standby, waiting to take over");
+MSG(MSG_IO_NONBLOCK,
+    "Couldn't stop client output from blocking");
+MSG(MSG_IO_NOSINK,
+    "Couldn't make room for client output");
+MSG(MSG_IO_NOTIMER,
+    "Couldn't make room to schedule timer");
+MSG(MSG_IO_NOWATCH,
+    "Couldn't make room to watch descriptor");
+MSG(MSG_IO_POLL,
+    "Couldn't poll for input");
+MSG(MSG_SHM_BADRING,
+    "Shared memory doesn't hold a ring");
+MSG(MSG_SHM_BADSIZE,
+    "Ring size must be a power of two, and at least 4096");
+MSG(MSG_SHM_MAP,
+    "Couldn't map shared memory for ring");
+MSG(MSG_SRV_ACCEPT,
+    "Couldn't accept client");
+MSG(MSG_SRV_LISTEN,
+    "Couldn't listen for clients");
+MSG(MSG_SRV_LONGPATH,
+    "Socket path too long");
+MSG(MSG_SRV_MANYLISTEN,
+    "Already listening on too many sockets");
+MSG(MSG_SRV_NOADDR,
+    "Couldn't find address to listen on");
+MSG(MSG_SRV_NOCLIENT,
+    "Couldn't make room for client");
+MSG(MSG_WIRE_BADFRAME,
+    "Malformed command frame");
+MSG(MSG_WIRE_BIGFRAME,
+    "Command frame too long, discarding input");
+MSG(MSG_WIRE_CTRL,
+    "Command frame contains a line break or null byte");
+MSG(MSG_WIRE_NOSUCH,
+    "Expecting 'text' or 'binary'");
@@ -40,12 +40,46 @@
  * order if possible?
  */
 
+const char     *MSG_CAP_BADLOG;	/* Capture log cut short or malformed */
+const char     *MSG_CAP_READ;	/* Couldn't read a capture log */
+const char     *MSG_CAP_WRITE;	/* Couldn't write a capture log */
+const char     *MSG_CMD_ARGC;	/* Command got the wrong number of arguments */
 const char     *MSG_CMD_ARGN;	/* Nullary command got an argument */
 const char     *MSG_CMD_ARGU;	/* Unary command got no arguments */
+const char     *MSG_CMD_BADINT;	/* NARG command expected an integer */
+const char     *MSG_CMD_BADMASK;	/* SUBSCRIBE given unknown response */
+const char     *MSG_CMD_BADSPEC;	/* NARG command has a bad spec */
+const char     *MSG_CMD_BADSTATS;	/* STATS given unknown argument */
+const char     *MSG_CMD_BADTAG;	/* Command tag was empty or too long */
+const char     *MSG_CMD_BADTIME;	/* NARG command expected a time */
 const char     *MSG_CMD_HITEND; /* Accidentally reached end of commands list */
+const char     *MSG_CMD_LONGLINE;	/* Command line over CMD_MAX_LINE */
+const char     *MSG_CMD_NOBUF;	/* Couldn't grow the command buffer */
+const char     *MSG_CMD_NOJOB;	/* Too many asynchronous commands running */
 const char     *MSG_CMD_NOPROP; /* Command type is PROPAGATE but prop is NULL */
 const char     *MSG_CMD_NOSUCH;	/* No command with the given word */
 const char     *MSG_CMD_NOWORD;	/* No command word given */
-const char     *MSG_ERR_NOMEM;	/* For when the error routine runs out of mem */
+const char     *MSG_CMD_NUL;	/* Command line had a '\0' in it */
+const char     *MSG_CMD_PROPW;	/* Couldn't forward a PROPAGATE command */
+const char     *MSG_CMD_READ;	/* Reading from command stream failed */
+const char     *MSG_CMD_STANDBY;	/* Command sent before standby taken over */
+const char     *MSG_IO_NONBLOCK;	/* Couldn't make a sink non-blocking */
+const char     *MSG_IO_NOSINK;	/* Couldn't allocate a sink */
+const char     *MSG_IO_NOTIMER;	/* Couldn't grow a reactor's timers */
+const char     *MSG_IO_NOWATCH;	/* Couldn't grow a reactor */
+const char     *MSG_IO_POLL;	/* Reactor couldn't poll its descriptors */
+const char     *MSG_SHM_BADRING;	/* Shared memory isn't a ring */
+const char     *MSG_SHM_BADSIZE;	/* Ring size not a big enough power of 2 */
+const char     *MSG_SHM_MAP;	/* Couldn't map a ring */
+const char     *MSG_SRV_ACCEPT;	/* Couldn't accept a client */
+const char     *MSG_SRV_LISTEN;	/* Couldn't listen on a socket */
+const char     *MSG_SRV_LONGPATH;	/* Unix socket path too long */
+const char     *MSG_SRV_MANYLISTEN;	/* Too many listening sockets */
+const char     *MSG_SRV_NOADDR;	/* Couldn't look up a listening address */
+const char     *MSG_SRV_NOCLIENT;	/* Couldn't allocate a client */
+const char     *MSG_WIRE_BADFRAME;	/* Command frame was malformed */
+const char     *MSG_WIRE_BIGFRAME;	/* Command frame was over the limit */
+const char     *MSG_WIRE_CTRL;	/* Command frame had a line break or '\0' */
+const char     *MSG_WIRE_NOSUCH;	/* WIRE command given unknown encoding */
 
 #endif				/* !CUPPA_MESSAGES_H  */
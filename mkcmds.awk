@@ -0,0 +1,334 @@
+#!/usr/bin/awk -f
+################################################################################
+# mkcmds.awk - generates command tables with prebuilt dispatch indices
+#   Part of cuppa, the Common URY Playout Package Architecture
+#
+# Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+#
+# Copyright (c) 2012, University Radio York Computing Team
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice,
+#    this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+#
+# Usage: awk -f mkcmds.awk [-v word_len=N] player.cmds > player_cmds.c
+#
+# Reads a description of one or more command tables and writes them out as C,
+# each behind a CMD_INDEX entry holding its dispatch index (see cmd.h), so
+# programs don't build indices at run time.  Exits non-zero, writing nothing
+# useful, if a table has a word twice, a word that doesn't fit in WORD_LEN
+# (word_len, 5 by default), or anything else it can't make sense of; build
+# rules should write to a temporary file and only move it into place if
+# this succeeds.
+#
+# Descriptions have one item per line; blank lines and lines starting with
+# '#' are ignored:
+#
+#   include "file.h"        #include a header, such as one declaring the
+#                           command functions
+#   table NAME              start the table NAME (a const struct cmd[])
+#   ncmd WORD FUNC          NCMD(WORD, FUNC)
+#   ucmd WORD FUNC          UCMD(WORD, FUNC)
+#   acmd WORD FUNC          ACMD(WORD, FUNC)
+#   narg WORD FUNC SPEC     NARG(WORD, FUNC, SPEC)
+#   ncmd_lww WORD FUNC      NCMD_LWW(WORD, FUNC), and likewise for ucmd_lww
+#                           and narg_lww (with a SPEC)
+#   reject WORD REASON...   REJECT(WORD, REASON), the reason running to the
+#                           end of the line
+#   propagate WORD          PROPAGATE(WORD), and likewise for ignore, wire,
+#                           subscribe and stats
+#   end                     finish the table, adding END_CMDS
+#
+# A WORD of '*' stands for ANY.  Entries keep their order, so the usual
+# top-down rules apply to ANY.
+#
+# NOTE: The index layout here MUST match index_slot in cmd.c.
+
+BEGIN {
+	if (word_len == "")
+		word_len = 5;
+
+	for (i = 32; i < 127; i++)
+		ORD[sprintf("%c", i)] = i;
+
+	MACRO["ncmd"] = "NCMD";
+	MACRO["ucmd"] = "UCMD";
+	MACRO["acmd"] = "ACMD";
+	MACRO["narg"] = "NARG";
+	MACRO["ncmd_lww"] = "NCMD_LWW";
+	MACRO["ucmd_lww"] = "UCMD_LWW";
+	MACRO["narg_lww"] = "NARG_LWW";
+	MACRO["reject"] = "REJECT";
+	MACRO["propagate"] = "PROPAGATE";
+	MACRO["ignore"] = "IGNORE";
+	MACRO["wire"] = "WIRE";
+	MACRO["subscribe"] = "SUBSCRIBE";
+	MACRO["stats"] = "STATS";
+
+	# Number of fields after the word, or -1 for the rest of the line
+	NARGS["ncmd"] = 1;
+	NARGS["ucmd"] = 1;
+	NARGS["acmd"] = 1;
+	NARGS["narg"] = 2;
+	NARGS["ncmd_lww"] = 1;
+	NARGS["ucmd_lww"] = 1;
+	NARGS["narg_lww"] = 2;
+	NARGS["reject"] = -1;
+	NARGS["propagate"] = 0;
+	NARGS["ignore"] = 0;
+	NARGS["wire"] = 0;
+	NARGS["subscribe"] = 0;
+	NARGS["stats"] = 0;
+
+	failed = 0;
+	table = "";
+	num_includes = 0;
+	num_tables = 0;
+}
+
+/^[ \t]*(#|$)/ {
+	next;
+}
+
+$1 == "include" {
+	if (NF != 2 || $2 !~ /^("[^"]+"|<[^>]+>)$/)
+		fail("expecting include \"file.h\" or include <file.h>");
+	else
+		INCLUDES[++num_includes] = $2;
+	next;
+}
+
+$1 == "table" {
+	if (table != "")
+		fail("table " table " isn't finished");
+	else if (NF != 2 || $2 !~ /^[A-Za-z_][A-Za-z_0-9]*$/)
+		fail("expecting table NAME");
+	else if ($2 in TABLE_LINE)
+		fail("table " $2 " already defined on line " TABLE_LINE[$2]);
+	else {
+		table = $2;
+		TABLE_LINE[table] = NR;
+		TABLES[++num_tables] = table;
+		COUNT[table] = 0;
+	}
+	next;
+}
+
+$1 == "end" {
+	if (table == "")
+		fail("end outside of a table");
+	table = "";
+	next;
+}
+
+$1 in MACRO {
+	if (table == "") {
+		fail($1 " outside of a table");
+		next;
+	}
+	if (NF < 2 || (NARGS[$1] >= 0 && NF != NARGS[$1] + 2) ||
+	    (NARGS[$1] < 0 && NF < 3)) {
+		fail("wrong number of fields for " $1);
+		next;
+	}
+
+	word = $2;
+	if (word != "*") {
+		if (!check_word(word))
+			next;
+		if ((table, word) in SEEN) {
+			fail("duplicate word '" word "' (first on line " \
+			     SEEN[table, word] ")");
+			next;
+		}
+		SEEN[table, word] = NR;
+	}
+
+	if (NARGS[$1] == 2 && !check_spec($4))
+		next;
+
+	n = ++COUNT[table];
+	WORD[table, n] = word;
+	ENTRY[table, n] = entry($1, word);
+	next;
+}
+
+{
+	fail("don't know what '" $1 "' is");
+}
+
+END {
+	if (table != "")
+		fail("table " table " isn't finished");
+	if (failed)
+		exit 1;
+
+	print "/* Generated by mkcmds.awk from " FILENAME "; DO NOT EDIT. */";
+	print "";
+	print "#include <stddef.h>\t\t/* NULL */";
+	print "#include <stdint.h>\t\t/* uint32_t */";
+	print "";
+	print "#include \"cmd.h\"\t\t/* struct cmd, struct cmd_prebuilt */";
+	for (i = 1; i <= num_includes; i++)
+		print "#include " INCLUDES[i];
+
+	for (t = 1; t <= num_tables; t++)
+		emit(TABLES[t]);
+}
+
+# Reports an error on the current line, and makes sure the run fails.
+function fail(msg)
+{
+	printf("mkcmds: %s:%d: %s\n", FILENAME, FNR, msg) > "/dev/stderr";
+	failed = 1;
+}
+
+# Returns true if 'word' can be a packed command word (see pack_word).
+function check_word(word)
+{
+	if (length(word) > word_len - 1) {
+		fail("word '" word "' is longer than " word_len - 1 \
+		     " characters");
+		return 0;
+	}
+	if (word !~ /^[!-~]+$/ || word ~ /["\\]/) {
+		fail("word '" word "' has characters that can't be packed");
+		return 0;
+	}
+	return 1;
+}
+
+# Returns true if 'spec' is a valid NARG argument spec.
+function check_spec(spec)
+{
+	if (spec !~ /^[iuwr]*$/ || spec ~ /r./) {
+		fail("spec '" spec "' isn't made of i, u, w and a final r");
+		return 0;
+	}
+	if (length(spec) > 8) {
+		fail("spec '" spec "' has more than CMD_MAX_ARGS arguments");
+		return 0;
+	}
+	return 1;
+}
+
+# Renders the entry for a command of kind 'kind' and word 'word', taking
+# anything else from the current line.
+function entry(kind, word,	w, reason)
+{
+	w = (word == "*") ? "ANY" : "\"" word "\"";
+
+	if (NARGS[kind] == 2)
+		return MACRO[kind] "(" w ", " $3 ", \"" $4 "\")";
+	if (NARGS[kind] == 1)
+		return MACRO[kind] "(" w ", " $3 ")";
+	if (kind == "reject") {
+		reason = $0;
+		sub(/^[ \t]*[^ \t]+[ \t]+[^ \t]+[ \t]+/, "", reason);
+		return "REJECT(" w ", \"" escape(reason) "\")";
+	}
+	return MACRO[kind] "(" w ")";
+}
+
+# Returns 'str' with its quotes and backslashes escaped for a C string.
+function escape(str,	i, c, out)
+{
+	out = "";
+	for (i = 1; i <= length(str); i++) {
+		c = substr(str, i, 1);
+		out = out ((c == "\\" || c == "\"") ? "\\" c : c);
+	}
+	return out;
+}
+
+# Returns the packed form of 'word' (see pack_word).
+function pack(word,	i, key, scale)
+{
+	key = 0;
+	scale = 1;
+	for (i = 1; i <= length(word); i++) {
+		key += ORD[substr(word, i, 1)] * scale;
+		scale *= 256;
+	}
+	return key;
+}
+
+# Returns (a * b) mod 2^32, for a and b below 2^32, without going beyond the
+# 53 bits of precision awk's numbers have.
+function mul32(a, b,	lo, hi)
+{
+	lo = b % 65536;
+	hi = (b - lo) / 65536;
+	return ((a * hi) % 65536 * 65536 + a * lo) % 4294967296;
+}
+
+# Writes out table 't' and its index.
+function emit(t,	n, bits, slots, i, key, slot, any, KEYS, ENTRIES)
+{
+	n = COUNT[t];
+	for (bits = 3; 2 ^ bits < (n + 1) * 2; bits++);
+	slots = 2 ^ bits;
+
+	for (slot = 0; slot < slots; slot++) {
+		KEYS[slot] = 0;
+		ENTRIES[slot] = "NULL";
+	}
+
+	any = "NULL";
+	for (i = 1; i <= n; i++) {
+		if (WORD[t, i] == "*") {
+			if (any == "NULL")
+				any = "&" t "[" i "]";
+			continue;
+		}
+
+		key = pack(WORD[t, i]);
+		slot = int(mul32(key, 2654435761) / 2 ^ (32 - bits));
+		while (KEYS[slot] != 0)
+			slot = (slot + 1) % slots;
+		KEYS[slot] = key;
+		ENTRIES[slot] = "&" t "[" i "]";
+	}
+
+	print "";
+	print "extern const struct cmd " t "[];";
+	print "";
+	print "static const uint32_t " t "_keys[" slots "] = {";
+	for (slot = 0; slot < slots; slot++)
+		printf("\t%.0fu,\n", KEYS[slot]);
+	print "};";
+	print "";
+	print "static const struct cmd *const " t "_entries[" slots "] = {";
+	for (slot = 0; slot < slots; slot++)
+		print "\t" ENTRIES[slot] ",";
+	print "};";
+	print "";
+	print "static const struct cmd_prebuilt " t "_index = {";
+	print "\t" bits ", " t "_keys, " t "_entries, " any;
+	print "};";
+	print "";
+	print "const struct cmd " t "[] = {";
+	print "\tCMD_INDEX(&" t "_index),";
+	for (i = 1; i <= n; i++)
+		print "\t" ENTRY[t, i] ",";
+	print "\tEND_CMDS";
+	print "};";
+}
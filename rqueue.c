@@ -0,0 +1,210 @@
+/*******************************************************************************
+ * rqueue.c - lock-free queue of responses from other threads
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdarg.h>		/* va_list etc. */
+#include <stdatomic.h>		/* atomic_* */
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* intptr_t */
+#include <stdio.h>		/* vsnprintf */
+
+#include "errors.h"		/* dbug */
+#include "io.h"			/* response_str */
+#include "rqueue.h"		/* queue functions */
+
+/* The default queue, drained by the main command loop. */
+static struct rqueue DEFAULT_QUEUE;
+/* Queue the calling thread drains (see set_drained_queue). */
+static _Thread_local struct rqueue *drained = &DEFAULT_QUEUE;
+
+/* Sets up an empty response queue. */
+void
+init_rqueue(struct rqueue *queue)
+{
+	size_t		i;
+
+	for (i = 0; i < RQUEUE_LEN; i++)
+		atomic_init(&(queue->slots[i].seq), 0);
+	atomic_init(&(queue->head), 0);
+	queue->tail = 0;
+	atomic_init(&(queue->num_dropped), 0);
+}
+
+/* Queues a response to be sent by the command loop thread.
+ * This is a wrapper around 'vqueue_response'.
+ */
+bool
+queue_response(enum response code, const char *format,...)
+{
+	bool		queued;
+	va_list		ap;
+
+	/* LINTED lint doesn't seem to like va_start */
+	va_start(ap, format);
+	queued = vqueue_response(code, format, ap);
+	va_end(ap);
+
+	return queued;
+}
+
+/* Queues a response on the default queue, to be sent by the main command
+ * loop thread.  This never blocks, and is safe to call from any thread.
+ *
+ * Returns false if the queue was full, in which case the response is lost.
+ */
+bool
+vqueue_response(enum response code, const char *format, va_list ap)
+{
+	return vrqueue_response(&DEFAULT_QUEUE, code, format, ap);
+}
+
+/* As 'queue_response', but on 'queue', such as a context's (see ctx.h).
+ * This is a wrapper around 'vrqueue_response'.
+ */
+bool
+rqueue_response(struct rqueue *queue, enum response code, const char *format,...)
+{
+	bool		queued;
+	va_list		ap;
+
+	/* LINTED lint doesn't seem to like va_start */
+	va_start(ap, format);
+	queued = vrqueue_response(queue, code, format, ap);
+	va_end(ap);
+
+	return queued;
+}
+
+/* As 'vqueue_response', but on 'queue'. */
+bool
+vrqueue_response(struct rqueue *queue,
+		 enum response code,
+		 const char *format,
+		 va_list ap)
+{
+	int		len;
+	size_t		pos;
+	size_t		index;
+	intptr_t	dif;
+	struct rq_slot *slot = NULL;
+
+	pos = atomic_load_explicit(&(queue->head), memory_order_relaxed);
+	while (slot == NULL) {
+		index = pos & (RQUEUE_LEN - 1);
+		dif = (intptr_t)(atomic_load_explicit(&(queue->slots[index].seq),
+						       memory_order_acquire) +
+				 index - pos);
+
+		if (dif < 0) {
+			/* The drainer hasn't got to this slot yet: full */
+			atomic_fetch_add_explicit(&(queue->num_dropped),
+						  1,
+						  memory_order_relaxed);
+			return false;
+		}
+		if (dif > 0)
+			pos = atomic_load_explicit(&(queue->head),
+						   memory_order_relaxed);
+		else if (atomic_compare_exchange_weak_explicit(&(queue->head),
+							       &pos,
+							       pos + 1,
+							   memory_order_relaxed,
+							  memory_order_relaxed))
+			slot = &(queue->slots[index]);
+	}
+
+	len = vsnprintf(slot->text, RQUEUE_TEXT_LEN, format, ap);
+	if (len < 0)
+		len = 0;
+	else if (len >= RQUEUE_TEXT_LEN)
+		len = RQUEUE_TEXT_LEN - 1;
+
+	slot->code = code;
+	slot->len = (size_t)len;
+
+	/* Hand the slot over to the drainer */
+	atomic_store_explicit(&(slot->seq), pos + 1 - index,
+			      memory_order_release);
+
+	return true;
+}
+
+/* Makes the calling thread drain 'queue' from now on, or the default queue
+ * if 'queue' is NULL.  run_cuppa_ctx does this for the context's queue.
+ */
+void
+set_drained_queue(struct rqueue *queue)
+{
+	drained = (queue == NULL) ? &DEFAULT_QUEUE : queue;
+}
+
+/* Sends every response in the calling thread's queue (see
+ * set_drained_queue), returning how many there were.
+ *
+ * This MUST only be called from the command loop thread owning the queue.
+ */
+size_t
+drain_response_queue(void)
+{
+	size_t		index;
+	size_t		dropped;
+	size_t		num_sent;
+	struct rq_slot *slot;
+	struct rqueue  *queue = drained;
+
+	for (num_sent = 0;; num_sent++) {
+		index = queue->tail & (RQUEUE_LEN - 1);
+		slot = &(queue->slots[index]);
+
+		/* Stop at the first slot its producer hasn't finished with */
+		if (atomic_load_explicit(&(slot->seq), memory_order_acquire) +
+		    index != queue->tail + 1)
+			break;
+
+		response_str(slot->code, slot->text, slot->len);
+
+		/* Hand the slot back to the producers for the next lap */
+		atomic_store_explicit(&(slot->seq),
+				      queue->tail + RQUEUE_LEN - index,
+				      memory_order_release);
+		queue->tail++;
+	}
+
+	dropped = atomic_exchange_explicit(&(queue->num_dropped),
+					   0,
+					   memory_order_relaxed);
+	if (dropped != 0)
+		dbug("response queue full, dropped %zu responses", dropped);
+
+	return num_sent;
+}
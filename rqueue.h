@@ -0,0 +1,107 @@
+/*******************************************************************************
+ * rqueue.h - lock-free queue of responses from other threads
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CUPPA_RQUEUE_H
+#define CUPPA_RQUEUE_H
+
+#include <stdarg.h>		/* va_list */
+#include <stdatomic.h>		/* atomic_size_t */
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+
+#include "io.h"			/* enum response */
+
+/*
+ * The response queue lets threads other than the one running the command
+ * loop (audio callbacks, decoders) send responses without touching stdio,
+ * taking locks or allocating.  Any number of threads may queue responses;
+ * only the command loop thread may drain them, which reactor_run does
+ * automatically.
+ *
+ * queue_response sends to the process's default queue, drained by the main
+ * command loop.  Each context (see ctx.h) has a queue of its own, drained
+ * by the thread running it; threads feeding a context send to that queue
+ * with rqueue_response.
+ *
+ * Queued responses are rendered on the spot into a fixed-size record (long
+ * ones are truncated), so keep formats simple on real-time threads.  If the
+ * queue is full the response is dropped rather than waiting for room; the
+ * number dropped is reported as a debug message when the queue is drained.
+ */
+
+/* Number of responses a queue can hold; MUST be a power of two. */
+#define RQUEUE_LEN 256
+/* Maximum length of a queued response body, plus its terminator. */
+#define RQUEUE_TEXT_LEN 256
+
+/*
+ * A queued response.
+ *
+ * This is a bounded multi-producer queue in the style of Dmitry Vyukov's,
+ * where each slot's sequence number says whose turn it is to use the slot.
+ * To let the queue start out zeroed, sequence numbers are stored minus the
+ * slot's index.
+ */
+struct rq_slot {
+	atomic_size_t	seq;	/* Sequence number, less the slot index */
+	enum response	code;	/* Response code */
+	size_t		len;	/* Length of rendered body */
+	char		text [RQUEUE_TEXT_LEN];	/* Rendered body */
+};
+
+/* A response queue.  Set up with init_rqueue, or by zeroing a static one.
+ * Don't touch the fields directly.
+ */
+struct rqueue {
+	struct rq_slot	slots [RQUEUE_LEN];	/* The queue itself */
+	atomic_size_t	head;	/* Position of the next slot to fill */
+	size_t		tail;	/* Position of the next slot to drain */
+	atomic_size_t	num_dropped;	/* Responses lost to a full queue */
+};
+
+void		init_rqueue(struct rqueue *queue);
+bool		queue_response(enum response code, const char *format,...);
+bool		vqueue_response(enum response code, const char *format, va_list ap);
+bool
+rqueue_response(struct rqueue *queue,
+		enum response code,
+		const char *format,...);
+bool
+vrqueue_response(struct rqueue *queue,
+		 enum response code,
+		 const char *format,
+		 va_list ap);
+void		set_drained_queue(struct rqueue *queue);
+size_t		drain_response_queue(void);
+
+#endif				/* !CUPPA_RQUEUE_H */
@@ -0,0 +1,396 @@
+/*******************************************************************************
+ * server.c - multi-client command server
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <errno.h>		/* errno, EAGAIN, EINTR */
+#include <fcntl.h>		/* fcntl, O_NONBLOCK, FD_CLOEXEC */
+#include <netdb.h>		/* getaddrinfo */
+#include <stdbool.h>		/* bool */
+#include <stdint.h>		/* int64_t */
+#include <stdlib.h>		/* malloc, realloc, free */
+#include <string.h>		/* memset, strlen, strcpy */
+#include <sys/socket.h>		/* socket, bind, listen, accept */
+#include <sys/un.h>		/* struct sockaddr_un */
+#include <unistd.h>		/* close, unlink */
+
+#include "cmd.h"		/* drain_commands, struct cmd_reader */
+#include "errors.h"		/* error, DBUG, severity */
+#include "io.h"			/* struct reactor, sinks */
+#include "messages.h"		/* MSG_SRV_* */
+#include "rqueue.h"		/* drain_response_queue */
+#include "server.h"		/* struct server */
+#include "utils.h"		/* SAFE_FREE */
+
+/* Number of pending connections each listening socket can hold. */
+#define LISTEN_BACKLOG 16
+
+/* A client connected to a server. */
+struct server_client {
+	struct server  *server;	/* Server the client is connected to */
+	int		fd;	/* Socket connected to the client */
+	struct cmd_reader reader;	/* Commands from the client */
+	struct response_sink *sink;	/* Responses to the client */
+};
+
+static enum error handle_accept(void *data, int fd);
+static enum error handle_client(void *data, int fd);
+static enum error add_client(struct server *server, int fd);
+static void	drop_client(struct server *server, size_t i);
+static void	reap_clients(struct server *server);
+static bool	set_nonblocking(int fd);
+static enum error open_listener(int domain, const struct sockaddr *addr, socklen_t len, int *fd);
+
+/* Sets up a server running commands from 'cmds', with user data 'usr', on
+ * 'reactor'.  It MUST be released with free_server.
+ */
+void
+init_server(struct server *server,
+	    struct reactor *reactor,
+	    void *usr,
+	    const struct cmd *cmds)
+{
+	server->usr = usr;
+	server->cmds = cmds;
+	server->prop = NULL;
+	server->budget.max_cmds = 0;
+	server->budget.max_usecs = 0;
+	server->reactor = reactor;
+	server->num_listeners = 0;
+	server->clients = NULL;
+	server->num_clients = 0;
+	server->size = 0;
+}
+
+/* Disconnects every client and stops listening.  The listening sockets are
+ * left open.
+ */
+void
+free_server(struct server *server)
+{
+	size_t		i;
+
+	while (server->num_clients != 0)
+		drop_client(server, server->num_clients - 1);
+	SAFE_FREE(&(server->clients));
+	server->size = 0;
+
+	for (i = 0; i < server->num_listeners; i++)
+		reactor_remove(server->reactor, server->listeners[i]);
+	server->num_listeners = 0;
+}
+
+/* Starts accepting clients on the listening socket 'fd' (see listen_unix and
+ * listen_tcp), which is put into non-blocking mode.
+ */
+enum error
+server_listen(struct server *server, int fd)
+{
+	enum error	err = E_OK;
+
+	if (server->num_listeners == SERVER_MAX_LISTENERS)
+		err = error(E_BAD_CONFIG, "%s", MSG_SRV_MANYLISTEN);
+	else if (!set_nonblocking(fd))
+		err = error(E_INTERNAL_ERROR, "%s", MSG_IO_NONBLOCK);
+	else
+		err = reactor_add(server->reactor, fd, handle_accept, server);
+
+	if (err == E_OK)
+		server->listeners[server->num_listeners++] = fd;
+
+	return err;
+}
+
+/* As reactor_run, on the server's reactor, but also keeps clients' output
+ * flowing and disconnects clients that have gone away or fallen behind.
+ */
+enum error
+server_run(struct server *server, int64_t timeout)
+{
+	size_t		i;
+	struct server_client *c;
+	enum error	err;
+
+	drain_response_queue();
+	flush_responses();
+	reap_clients(server);
+
+	/* Wake up when clients can take the responses they're waiting for */
+	for (i = 0; i < server->num_clients; i++) {
+		c = server->clients[i];
+		reactor_want_output(server->reactor, c->fd, sink_pending(c->sink));
+	}
+
+	err = reactor_run(server->reactor, timeout);
+	reap_clients(server);
+
+	return err;
+}
+
+/* Makes a Unix domain socket listening at 'path', which is replaced if it
+ * already exists, and puts its descriptor in *fd.
+ */
+enum error
+listen_unix(const char *path, int *fd)
+{
+	struct sockaddr_un addr;
+	enum error	err = E_OK;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (sizeof(addr.sun_path) <= strlen(path))
+		err = error(E_BAD_CONFIG, "%s", MSG_SRV_LONGPATH);
+	else {
+		strcpy(addr.sun_path, path);
+		unlink(path);
+		err = open_listener(AF_UNIX,
+				    (const struct sockaddr *)&addr,
+				    sizeof(addr),
+				    fd);
+	}
+
+	return err;
+}
+
+/* Makes a TCP socket listening on 'port' at the address 'host' (or all
+ * addresses if NULL), and puts its descriptor in *fd.  Both may be names.
+ */
+enum error
+listen_tcp(const char *host, const char *port, int *fd)
+{
+	struct addrinfo	hints;
+	struct addrinfo *addrs = NULL;
+	struct addrinfo *a;
+	int		on = 1;
+	enum error	err = E_OK;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if (getaddrinfo(host, port, &hints, &addrs) != 0)
+		err = error(E_BAD_CONFIG, "%s", MSG_SRV_NOADDR);
+
+	/* Take the first address that works, quietly trying the rest */
+	for (a = addrs; err == E_OK && a != NULL; a = a->ai_next) {
+		*fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (*fd == -1)
+			continue;
+
+		/* Don't stop restarted servers from taking the port back */
+		setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(*fd, a->ai_addr, a->ai_addrlen) == 0 &&
+		    listen(*fd, LISTEN_BACKLOG) == 0)
+			break;
+		close(*fd);
+	}
+	if (err == E_OK && a == NULL)
+		err = error(E_BAD_CONFIG, "%s", MSG_SRV_LISTEN);
+
+	if (addrs != NULL)
+		freeaddrinfo(addrs);
+
+	return err;
+}
+
+/* Reactor handler for listening sockets: accepts every waiting client. */
+static enum error
+handle_accept(void *data, int fd)
+{
+	int		client_fd;
+	struct server  *server = data;
+	enum error	err = E_OK;
+
+	while (err == E_OK || severity(err) == ES_NORMAL) {
+		client_fd = accept(fd, NULL, NULL);
+		if (client_fd == -1 && errno == EINTR)
+			continue;
+		if (client_fd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != ECONNABORTED)
+				error(E_INTERNAL_ERROR, "%s", MSG_SRV_ACCEPT);
+			break;
+		}
+
+		fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+		err = add_client(server, client_fd);
+		if (err != E_OK)
+			close(client_fd);
+	}
+
+	/* Failing to take a client is the client's problem, not the server's */
+	if (err != E_OK && severity(err) == ES_NORMAL)
+		err = E_OK;
+
+	return err;
+}
+
+/* Reactor handler for clients: runs whatever commands have arrived, with
+ * pull responses going back to the client.
+ */
+static enum error
+handle_client(void *data, int fd)
+{
+	struct server_client *c = data;
+	struct server  *s = c->server;
+	enum error	err;
+
+	set_pull_sink(c->sink);
+	err = drain_commands(s->usr, s->cmds, &(c->reader), s->prop,
+			     &(s->budget));
+	set_pull_sink(NULL);
+
+	/* Carry on past bad commands, and anything the budget held back */
+	if (cmd_waiting(&(c->reader)))
+		reactor_again(s->reactor, fd);
+
+	/* Errors in one client's commands don't concern the rest */
+	if (err != E_OK && severity(err) == ES_NORMAL)
+		err = E_OK;
+
+	return err;
+}
+
+/* Connects a client on the socket 'fd'. */
+static enum error
+add_client(struct server *server, int fd)
+{
+	size_t		size;
+	struct server_client **clients;
+	struct server_client *c = NULL;
+	enum error	err = E_OK;
+
+	if (server->num_clients == server->size) {
+		size = (server->size == 0) ? 4 : server->size * 2;
+		clients = realloc(server->clients, size * sizeof(*clients));
+		if (clients != NULL) {
+			server->clients = clients;
+			server->size = size;
+		}
+	}
+	if (server->num_clients < server->size)
+		c = malloc(sizeof(*c));
+	if (c == NULL)
+		err = error(E_NO_MEM, "%s", MSG_SRV_NOCLIENT);
+
+	if (err == E_OK) {
+		c->server = server;
+		c->fd = fd;
+		init_cmd_reader(&(c->reader), fd);
+
+		/* This also makes the socket non-blocking for the reader */
+		c->sink = open_sink(fd);
+		if (c->sink == NULL)
+			err = E_INTERNAL_ERROR;	/* open_sink said why */
+	}
+	if (err == E_OK) {
+		err = reactor_add(server->reactor, fd, handle_client, c);
+		if (err != E_OK)
+			close_sink(c->sink);
+	}
+
+	if (err == E_OK) {
+		server->clients[server->num_clients++] = c;
+		DBUG(DL_NORMAL, "client connected on %d", fd);
+	} else
+		SAFE_FREE(&c);
+
+	return err;
+}
+
+/* Disconnects the i-th client of 'server'. */
+static void
+drop_client(struct server *server, size_t i)
+{
+	struct server_client *c = server->clients[i];
+
+	DBUG(DL_NORMAL, "client disconnected from %d", c->fd);
+
+	reactor_remove(server->reactor, c->fd);
+	close_sink(c->sink);
+	free_cmd_reader(&(c->reader));
+	close(c->fd);
+	free(c);
+
+	server->clients[i] = server->clients[--server->num_clients];
+}
+
+/* Disconnects clients that have hung up, once everything they sent before
+ * hanging up has been run, or whose output has been dropped for falling
+ * behind.
+ */
+static void
+reap_clients(struct server *server)
+{
+	size_t		i;
+	struct server_client *c;
+
+	for (i = server->num_clients; i > 0; i--) {
+		c = server->clients[i - 1];
+		if (sink_broken(c->sink) ||
+		    (c->reader.eof && !cmd_waiting(&(c->reader))))
+			drop_client(server, i - 1);
+	}
+}
+
+/* Puts 'fd' into non-blocking mode, returning false if it can't. */
+static bool
+set_nonblocking(int fd)
+{
+	int		flags;
+
+	flags = fcntl(fd, F_GETFL);
+
+	return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+/* Makes a socket listening at the address 'addr', 'len' bytes long, in the
+ * given domain, and puts its descriptor in *fd.
+ */
+static enum error
+open_listener(int domain, const struct sockaddr *addr, socklen_t len, int *fd)
+{
+	enum error	err = E_OK;
+
+	*fd = socket(domain, SOCK_STREAM, 0);
+	if (*fd == -1)
+		err = error(E_INTERNAL_ERROR, "%s", MSG_SRV_LISTEN);
+	else if (bind(*fd, addr, len) == -1 || listen(*fd, LISTEN_BACKLOG) == -1) {
+		err = error(E_BAD_CONFIG, "%s", MSG_SRV_LISTEN);
+		close(*fd);
+	}
+
+	return err;
+}
@@ -0,0 +1,89 @@
+/*******************************************************************************
+ * server.h - multi-client command server
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CUPPA_SERVER_H
+#define CUPPA_SERVER_H
+
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* int64_t */
+
+#include "cmd.h"		/* struct cmd, struct cmd_budget, struct cmd_prop */
+#include "errors.h"		/* enum error */
+#include "io.h"			/* struct reactor */
+
+/* Most listening sockets one server can accept clients on. */
+#define SERVER_MAX_LISTENERS 4
+
+/* A client connected to a server.  Don't touch the fields directly. */
+struct server_client;
+
+/*
+ * Command server - accepts clients on Unix or TCP sockets, and runs the
+ * commands each of them sends through the same command set, as if each
+ * were the sole client on standard in.
+ *
+ * Pull responses (OKAY and the errors) go to the client whose command
+ * caused them; push responses go to every client, as well as standard out.
+ * Clients are served without blocking, and one that falls too far behind on
+ * its responses is disconnected rather than being allowed to hold up the
+ * rest.  Programs with servers should ignore SIGPIPE.
+ *
+ * Set up with init_server, then fill in 'prop' and 'budget' if needed and
+ * add listening sockets with server_listen.  Run with server_run in place of
+ * reactor_run, and release with free_server.  Don't touch the other fields.
+ */
+struct server {
+	void	       *usr;	/* User data to pass to commands */
+	const struct cmd *cmds;	/* END_CMDS-terminated command set */
+	const struct cmd_prop *prop;	/* PROPAGATE targets, or NULL if none */
+	struct cmd_budget budget;	/* Limits on each client's batches */
+	struct reactor *reactor;	/* Reactor the server runs on */
+	int		listeners [SERVER_MAX_LISTENERS];	/* Sockets */
+	size_t		num_listeners;	/* Number of sockets in use */
+	struct server_client **clients;	/* Connected clients */
+	size_t		num_clients;	/* Number of connected clients */
+	size_t		size;	/* Allocated length of 'clients' */
+};
+
+void
+init_server(struct server *server,
+	    struct reactor *reactor,
+	    void *usr,
+	    const struct cmd *cmds);
+void		free_server(struct server *server);
+enum error	server_listen(struct server *server, int fd);
+enum error	server_run(struct server *server, int64_t timeout);
+enum error	listen_unix(const char *path, int *fd);
+enum error	listen_tcp(const char *host, const char *port, int *fd);
+
+#endif				/* !CUPPA_SERVER_H */
@@ -0,0 +1,377 @@
+/*******************************************************************************
+ * shm.c - shared-memory ring transport
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <errno.h>		/* errno, EINTR */
+#include <fcntl.h>		/* fcntl, O_NONBLOCK */
+#include <stdatomic.h>		/* atomic_* */
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* uint32_t, uint64_t */
+#include <string.h>		/* memcpy */
+#include <sys/mman.h>		/* mmap, munmap */
+#include <sys/stat.h>		/* fstat */
+#include <time.h>		/* nanosleep */
+#include <unistd.h>		/* ftruncate, read, write */
+
+#include "errors.h"		/* error */
+#include "messages.h"		/* MSG_SHM_* */
+#include "shm.h"		/* struct shm_ring */
+
+/* Size of a cache line, which the two ends of the ring keep apart. */
+#define CACHE_LINE 64
+/* How long a producer waits for room before trying again, in nsecs. */
+#define SHM_BACKOFF 50000
+
+/* The other process may be using these, so they must not be locks. */
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "rings need lock-free atomics");
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2, "rings need lock-free atomics");
+
+/*
+ * The shared part of a ring.  Positions count bytes since the ring was made,
+ * and are only reduced modulo the size on access, so the ring is empty when
+ * they are equal and full when they are 'size' apart.
+ */
+struct shm_area {
+	_Alignas(CACHE_LINE) _Atomic uint64_t head;	/* Next byte to write */
+	_Alignas(CACHE_LINE) _Atomic uint64_t tail;	/* Next byte to read */
+	_Alignas(CACHE_LINE) atomic_uint sleeping;	/* Consumer waiting? */
+	atomic_uint	gone;	/* One side has detached? */
+	uint64_t	size;	/* Bytes of data; a power of two */
+	_Alignas(CACHE_LINE) char data[];	/* The ring itself */
+};
+
+static enum error map_ring(struct shm_ring *ring, int fd, size_t len, int bell);
+static size_t	take(struct shm_ring *ring, char *buf, size_t len);
+static bool	sane(struct shm_ring *ring, uint64_t head, uint64_t tail);
+static void	ring_bell(const struct shm_ring *ring);
+static void	clear_bell(const struct shm_ring *ring);
+
+/* Lays out a new ring holding 'size' bytes, which MUST be a power of two of
+ * at least SHM_MIN_RING, in the shared memory 'fd' (resizing it to fit), and
+ * attaches to it as the producer, with 'bell' as the write end of the
+ * doorbell.
+ */
+enum error
+shm_ring_create(struct shm_ring *ring, int fd, size_t size, int bell)
+{
+	size_t		len;
+	enum error	err = E_OK;
+
+	len = sizeof(struct shm_area) + size;
+	if (size < SHM_MIN_RING || (size & (size - 1)) != 0 || len < size)
+		err = error(E_BAD_CONFIG, "%s", MSG_SHM_BADSIZE);
+	else if (ftruncate(fd, (off_t)len) == -1)
+		err = error(E_BAD_CONFIG, "%s", MSG_SHM_MAP);
+	else
+		err = map_ring(ring, fd, len, bell);
+
+	if (err == E_OK) {
+		atomic_init(&(ring->area->head), 0);
+		atomic_init(&(ring->area->tail), 0);
+		/* Nobody has read yet, so the first write must ring */
+		atomic_init(&(ring->area->sleeping), 1);
+		atomic_init(&(ring->area->gone), 0);
+		ring->area->size = size;
+		ring->size = size;
+	}
+
+	return err;
+}
+
+/* Attaches to the ring laid out in the shared memory 'fd' as the consumer,
+ * with 'bell' as the read end of the doorbell.  The header is checked
+ * against the mapping, as the memory may not be a ring at all, or may have
+ * been scribbled on.
+ */
+enum error
+shm_ring_attach(struct shm_ring *ring, int fd, int bell)
+{
+	uint64_t	size;
+	uint64_t	head;
+	uint64_t	tail;
+	struct stat	st;
+	enum error	err = E_OK;
+
+	if (fstat(fd, &st) == -1 ||
+	    (size_t)st.st_size < sizeof(struct shm_area) + SHM_MIN_RING)
+		err = error(E_BAD_CONFIG, "%s", MSG_SHM_BADRING);
+	else
+		err = map_ring(ring, fd, (size_t)st.st_size, bell);
+
+	if (err == E_OK) {
+		/* The size must be the one shm_ring_create would have made */
+		size = ring->area->size;
+		head = atomic_load_explicit(&(ring->area->head),
+					    memory_order_acquire);
+		tail = atomic_load_explicit(&(ring->area->tail),
+					    memory_order_acquire);
+		ring->size = (size_t)size;
+
+		if (size != ring->map_len - sizeof(struct shm_area) ||
+		    size < SHM_MIN_RING || (size & (size - 1)) != 0 ||
+		    !sane(ring, head, tail)) {
+			shm_ring_detach(ring);
+			err = error(E_BAD_CONFIG, "%s", MSG_SHM_BADRING);
+		}
+	}
+
+	return err;
+}
+
+/* Detaches from a ring, telling the other side.  Neither descriptor is
+ * closed.
+ */
+void
+shm_ring_detach(struct shm_ring *ring)
+{
+	if (ring->area == NULL)
+		return;
+
+	atomic_store(&(ring->area->gone), 1);
+	ring_bell(ring);
+
+	munmap(ring->area, ring->map_len);
+	ring->area = NULL;
+}
+
+/* Returns this side's doorbell descriptor; consumers should wait for it to
+ * become readable once shm_ring_read comes back empty.
+ */
+int
+shm_ring_bell(const struct shm_ring *ring)
+{
+	return ring->bell;
+}
+
+/* Copies as much of 'buf' into the ring as there is room for, returning how
+ * much that was, and wakes the consumer if it was waiting.  Only the
+ * producer may call this.
+ */
+size_t
+shm_ring_write(struct shm_ring *ring, const char *buf, size_t len)
+{
+	size_t		at;
+	size_t		first;
+	uint64_t	head;
+	uint64_t	tail;
+	struct shm_area *area = ring->area;
+
+	if (atomic_load_explicit(&(area->gone), memory_order_relaxed))
+		return 0;
+
+	head = atomic_load_explicit(&(area->head), memory_order_relaxed);
+	tail = atomic_load_explicit(&(area->tail), memory_order_acquire);
+	if (!sane(ring, head, tail))
+		return 0;
+	if (ring->size - (size_t)(head - tail) < len)
+		len = ring->size - (size_t)(head - tail);
+	if (len == 0)
+		return 0;
+
+	at = (size_t)head & (ring->size - 1);
+	first = (ring->size - at < len) ? ring->size - at : len;
+	memcpy(area->data + at, buf, first);
+	memcpy(area->data, buf + first, len - first);
+	atomic_store_explicit(&(area->head), head + len, memory_order_release);
+
+	/* Pairs with the fence in shm_ring_read, so one of us sees the other */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&(area->sleeping), memory_order_relaxed))
+		ring_bell(ring);
+
+	return len;
+}
+
+/* Copies all of 'buf' into the ring, waiting for room if need be.  Returns
+ * false, having given up, if the consumer has gone.
+ */
+bool
+shm_ring_write_all(struct shm_ring *ring, const char *buf, size_t len)
+{
+	size_t		done;
+	struct timespec	wait = {0, SHM_BACKOFF};
+
+	while (len != 0) {
+		done = shm_ring_write(ring, buf, len);
+		if (shm_ring_gone(ring))
+			return false;
+		if (done == 0)
+			nanosleep(&wait, NULL);
+
+		buf += done;
+		len -= done;
+	}
+
+	return true;
+}
+
+/* Copies up to 'len' bytes out of the ring into 'buf', returning how many.
+ * If there are none, this sets '*eof' if the producer has gone, and
+ * otherwise arranges for the doorbell to ring when more arrive.  Only the
+ * consumer may call this.
+ */
+size_t
+shm_ring_read(struct shm_ring *ring, char *buf, size_t len, bool *eof)
+{
+	size_t		num_read;
+	struct shm_area *area = ring->area;
+
+	*eof = false;
+	if (atomic_load_explicit(&(area->sleeping), memory_order_relaxed)) {
+		atomic_store_explicit(&(area->sleeping), 0,
+				      memory_order_relaxed);
+		clear_bell(ring);
+	}
+
+	num_read = take(ring, buf, len);
+	if (num_read == 0 && len != 0) {
+		/* Say we're waiting, then check nothing came in meanwhile */
+		atomic_store_explicit(&(area->sleeping), 1,
+				      memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		num_read = take(ring, buf, len);
+
+		/* Anything written before the producer went is visible now */
+		if (num_read == 0 && atomic_load_explicit(&(area->gone),
+						     memory_order_acquire)) {
+			num_read = take(ring, buf, len);
+			*eof = (num_read == 0);
+		}
+	}
+	if (ring->corrupt)
+		*eof = true;
+
+	return num_read;
+}
+
+/* Returns true if the other side has detached from the ring. */
+bool
+shm_ring_gone(const struct shm_ring *ring)
+{
+	return ring->corrupt ||
+	    atomic_load_explicit(&(ring->area->gone), memory_order_acquire);
+}
+
+/* Maps 'len' bytes of the shared memory 'fd' for 'ring'. */
+static enum error
+map_ring(struct shm_ring *ring, int fd, size_t len, int bell)
+{
+	void	       *area;
+	enum error	err = E_OK;
+
+	area = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (area == MAP_FAILED)
+		err = error(E_BAD_CONFIG, "%s", MSG_SHM_MAP);
+	else {
+		ring->area = area;
+		ring->map_len = len;
+		ring->bell = bell;
+		ring->corrupt = false;
+
+		/* Neither ringing nor clearing the doorbell may block */
+		fcntl(bell, F_SETFL, fcntl(bell, F_GETFL) | O_NONBLOCK);
+	}
+
+	return err;
+}
+
+/* Copies up to 'len' bytes out of the ring, returning how many. */
+static size_t
+take(struct shm_ring *ring, char *buf, size_t len)
+{
+	size_t		at;
+	size_t		first;
+	uint64_t	head;
+	uint64_t	tail;
+	struct shm_area *area = ring->area;
+
+	tail = atomic_load_explicit(&(area->tail), memory_order_relaxed);
+	head = atomic_load_explicit(&(area->head), memory_order_acquire);
+	if (!sane(ring, head, tail))
+		return 0;
+	if ((size_t)(head - tail) < len)
+		len = (size_t)(head - tail);
+	if (len == 0)
+		return 0;
+
+	at = (size_t)tail & (ring->size - 1);
+	first = (ring->size - at < len) ? ring->size - at : len;
+	memcpy(buf, area->data + at, first);
+	memcpy(buf + first, area->data, len - first);
+	atomic_store_explicit(&(area->tail), tail + len, memory_order_release);
+
+	return len;
+}
+
+/* Returns true if the positions 'head' and 'tail', as read from the shared
+ * header, are no more than a ring apart.  Otherwise the other side has gone
+ * wrong (or is hostile), and the ring is marked as corrupt, so that it looks
+ * to have gone from now on.  This can't report the error itself, as it may
+ * be sending a response at the time.
+ */
+static bool
+sane(struct shm_ring *ring, uint64_t head, uint64_t tail)
+{
+	if (ring->size < head - tail)
+		ring->corrupt = true;
+
+	return !ring->corrupt;
+}
+
+/* Rings the doorbell.  A full doorbell has already been rung, so failing to
+ * write to it doesn't matter.
+ */
+static void
+ring_bell(const struct shm_ring *ring)
+{
+	uint64_t	one = 1;	/* What an eventfd wants */
+	ssize_t		num_written;
+
+	do
+		num_written = write(ring->bell, &one, sizeof(one));
+	while (num_written == -1 && errno == EINTR);
+}
+
+/* Empties the doorbell, so it can be waited on again. */
+static void
+clear_bell(const struct shm_ring *ring)
+{
+	char		buf[64];
+	ssize_t		num_read;
+
+	do
+		num_read = read(ring->bell, buf, sizeof(buf));
+	while (num_read > 0 || (num_read == -1 && errno == EINTR));
+}
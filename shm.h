@@ -0,0 +1,101 @@
+/*******************************************************************************
+ * shm.h - shared-memory ring transport
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CUPPA_SHM_H
+#define CUPPA_SHM_H
+
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+
+#include "errors.h"		/* enum error */
+
+/*
+ * Shared-memory rings - a single-producer, single-consumer byte ring in
+ * memory shared between two processes on the same host, so that commands and
+ * responses can pass between them without a system call or kernel copy each.
+ * Use one ring for each direction.
+ *
+ * The memory comes from a descriptor both processes have (from memfd_create
+ * or shm_open, say, inherited over fork); the producer lays the ring out with
+ * shm_ring_create, and the consumer maps it with shm_ring_attach.
+ *
+ * Each ring also has a doorbell: a descriptor the producer writes to when the
+ * consumer has gone to sleep waiting for data, which the consumer polls (for
+ * example in a reactor).  An eventfd works, as do the two ends of a pipe,
+ * with the write end going to the producer.  While the consumer keeps up, the
+ * doorbell isn't touched, and neither is the kernel.  The consumer starts out
+ * asleep, so the first write rings; after that it only goes back to sleep
+ * when a read finds the ring empty, so a consumer that waits on the doorbell
+ * MUST keep reading until then first.
+ *
+ * A ring that fills up makes the producer wait, backing off between tries;
+ * size rings for the worst burst expected.  Either side detaching tells the
+ * other it has gone: the consumer then sees end of file once the ring is
+ * empty, and the producer's writes fail.
+ *
+ * Neither side trusts the other with its memory: shm_ring_attach refuses
+ * headers that don't describe the mapping, and a ring whose shared positions
+ * stop making sense is treated as gone from then on.
+ *
+ * Rings are used by the rest of cuppa as streams (see ring_stream in
+ * stream.h), so commands can be read from one with init_stream_reader (see
+ * cmd.h), and responses sent down one with set_stdout_stream or
+ * open_stream_sink (see io.h).
+ */
+
+/* Smallest allowed ring size, in bytes. */
+#define SHM_MIN_RING 4096
+
+/* One process's handle on a ring.  Don't touch the fields directly. */
+struct shm_ring {
+	struct shm_area *area;	/* Shared header and data */
+	size_t		map_len;	/* Length of the mapping of 'area' */
+	size_t		size;	/* Bytes of data the ring holds */
+	int		bell;	/* This side's doorbell descriptor */
+	bool		corrupt;	/* Shared positions stopped making sense? */
+};
+
+enum error
+shm_ring_create(struct shm_ring *ring,
+		int fd,
+		size_t size,
+		int bell);
+enum error	shm_ring_attach(struct shm_ring *ring, int fd, int bell);
+void		shm_ring_detach(struct shm_ring *ring);
+int		shm_ring_bell(const struct shm_ring *ring);
+size_t		shm_ring_write(struct shm_ring *ring, const char *buf, size_t len);
+bool		shm_ring_write_all(struct shm_ring *ring, const char *buf, size_t len);
+size_t		shm_ring_read(struct shm_ring *ring, char *buf, size_t len, bool *eof);
+bool		shm_ring_gone(const struct shm_ring *ring);
+
+#endif				/* !CUPPA_SHM_H */
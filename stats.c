@@ -0,0 +1,442 @@
+/*******************************************************************************
+ * stats.c - counters and latency histograms for the command loop
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <inttypes.h>		/* PRIu64 */
+#include <stdatomic.h>		/* atomic_* */
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* uint32_t, uint64_t */
+
+#include "constants.h"		/* WORD_LEN */
+#include "errors.h"		/* enum error, error_name, error_blame */
+#include "io.h"			/* response */
+#include "stats.h"		/* enum stats_stream */
+#include "utils.h"		/* pack_word */
+
+/* Number of distinct command words counted; MUST be a power of two.  Words
+ * past this many are counted together as "other".
+ */
+#define NUM_WORD_STATS 64
+/* Binary logarithm of the number of latency buckets per power of two. */
+#define LAT_SUB_BITS 3
+#define LAT_SUBS (1 << LAT_SUB_BITS)
+/* Latencies of 2^LAT_TOP_BIT usecs (about 19 hours) and up share a bucket. */
+#define LAT_TOP_BIT 36
+#define NUM_LAT_BUCKETS ((LAT_TOP_BIT - LAT_SUB_BITS + 1) * LAT_SUBS)
+
+/* Count of runs of one command word.  Slots are claimed by setting 'key',
+ * and never given back until reset_stats.
+ */
+struct word_stat {
+	_Atomic uint32_t key;	/* Packed word (see pack_word); 0 if unused */
+	atomic_uint_fast64_t count;	/* Number of times run */
+};
+
+/* Names of the error blame factors, as shown in dumps. */
+static const char *BLAME_NAMES[NUM_ERROR_BLAMES] = {
+	"USER",			/* EB_USER */
+	"POLICY",		/* EB_POLICY */
+	"ENVIRONMENT",		/* EB_ENVIRONMENT */
+	"PROGRAMMER",		/* EB_PROGRAMMER */
+};
+
+/* Names of the counted streams, as shown in dumps. */
+static const char *STREAM_NAMES[NUM_STATS_STREAMS] = {
+	"in",			/* SS_IN */
+	"stdout",		/* SS_STDOUT */
+	"stderr",		/* SS_STDERR */
+	"sinks",		/* SS_SINKS */
+};
+
+/* Percentiles given in dumps, in tenths of a percent. */
+static const unsigned PERCENTILES[] = {500, 900, 990, 999};
+
+#ifndef CUPPA_NO_STATS
+atomic_bool	stats_on = false;
+#endif
+
+static struct word_stat WORDS[NUM_WORD_STATS];
+static atomic_uint_fast64_t other_words;	/* Runs of uncounted words */
+static atomic_uint_fast64_t ERROR_COUNTS[NUM_ERRORS];
+static atomic_uint_fast64_t BLAME_COUNTS[NUM_ERROR_BLAMES];
+static atomic_uint_fast64_t LATENCIES[NUM_LAT_BUCKETS];
+static atomic_uint_fast64_t max_latency;	/* Longest latency seen */
+static atomic_uint_fast64_t BYTES[NUM_STATS_STREAMS];
+
+static void	dump_words(void);
+static void	dump_errors(void);
+static void	dump_latencies(void);
+static uint64_t	sum_latencies(void);
+static size_t	lat_bucket(uint64_t usecs);
+static uint64_t	lat_lower(size_t bucket);
+static uint64_t	lat_upper(size_t bucket);
+static unsigned	top_bit(uint64_t value);
+static void	bump(atomic_uint_fast64_t *counter, uint64_t amount);
+static uint64_t	take(atomic_uint_fast64_t *counter);
+
+/* Turns statistics on or off.  Turning them off keeps what has been counted
+ * so far; use reset_stats to clear it.
+ */
+void
+set_stats_enabled(bool enabled)
+{
+#ifdef CUPPA_NO_STATS
+	(void)enabled;
+#else
+	atomic_store_explicit(&stats_on, enabled, memory_order_relaxed);
+#endif
+}
+
+/* Zeroes every statistic.
+ *
+ * Counts made by other threads while this runs may or may not survive.
+ */
+void
+reset_stats(void)
+{
+	size_t		i;
+
+	for (i = 0; i < NUM_WORD_STATS; i++) {
+		atomic_store_explicit(&(WORDS[i].key), 0, memory_order_relaxed);
+		atomic_store_explicit(&(WORDS[i].count), 0,
+				      memory_order_relaxed);
+	}
+	atomic_store_explicit(&other_words, 0, memory_order_relaxed);
+	for (i = 0; i < NUM_ERRORS; i++)
+		atomic_store_explicit(&(ERROR_COUNTS[i]), 0,
+				      memory_order_relaxed);
+	for (i = 0; i < NUM_ERROR_BLAMES; i++)
+		atomic_store_explicit(&(BLAME_COUNTS[i]), 0,
+				      memory_order_relaxed);
+	for (i = 0; i < NUM_LAT_BUCKETS; i++)
+		atomic_store_explicit(&(LATENCIES[i]), 0, memory_order_relaxed);
+	atomic_store_explicit(&max_latency, 0, memory_order_relaxed);
+	for (i = 0; i < NUM_STATS_STREAMS; i++)
+		atomic_store_explicit(&(BYTES[i]), 0, memory_order_relaxed);
+}
+
+/* Sends every non-zero statistic as PERF responses, one per line:
+ *
+ *   PERF cmd WORD COUNT
+ *   PERF error NAME COUNT
+ *   PERF blame NAME COUNT
+ *   PERF bytes STREAM COUNT
+ *   PERF latency LOW HIGH COUNT       (one per non-empty bucket, in usecs)
+ *   PERF latencies COUNT max MAX p50 P50 p90 P90 p99 P99 p99.9 P999
+ *
+ * Percentiles are the top of the bucket they fall in, so overestimate by at
+ * most an eighth.
+ */
+void
+dump_stats(void)
+{
+	size_t		i;
+	uint64_t	bytes;
+
+	dump_words();
+	dump_errors();
+
+	for (i = 0; i < NUM_STATS_STREAMS; i++) {
+		bytes = take(&(BYTES[i]));
+		if (bytes != 0)
+			response(R_PERF, "bytes %s %" PRIu64,
+				 STREAM_NAMES[i], bytes);
+	}
+
+	dump_latencies();
+}
+
+/* Counts one run of the command 'word'. */
+void
+stats_count_cmd(const char *word)
+{
+	size_t		i;
+	size_t		n;
+	uint32_t	key;
+	uint32_t	found;
+
+	if (!stats_enabled)
+		return;
+
+	if (!pack_word(word, &key)) {
+		bump(&other_words, 1);
+		return;
+	}
+
+	/* Open addressing; a slot's key only ever goes from 0 to one word */
+	i = (size_t)((key * UINT32_C(2654435761)) >> 26) & (NUM_WORD_STATS - 1);
+	for (n = 0; n < NUM_WORD_STATS; n++, i = (i + 1) & (NUM_WORD_STATS - 1)) {
+		found = atomic_load_explicit(&(WORDS[i].key),
+					     memory_order_relaxed);
+		if (found == 0 &&
+		    atomic_compare_exchange_strong_explicit(&(WORDS[i].key),
+							    &found,
+							    key,
+							  memory_order_relaxed,
+							 memory_order_relaxed))
+			found = key;
+		if (found == key) {
+			bump(&(WORDS[i].count), 1);
+			return;
+		}
+	}
+
+	bump(&other_words, 1);
+}
+
+/* Counts one error thrown with 'code', against the code and its blame. */
+void
+stats_count_error(enum error code)
+{
+	if (!stats_enabled)
+		return;
+
+	bump(&(ERROR_COUNTS[code]), 1);
+	bump(&(BLAME_COUNTS[error_blame(code)]), 1);
+}
+
+/* Records a command latency of 'usecs' microseconds. */
+void
+stats_add_latency(uint64_t usecs)
+{
+	uint64_t	max;
+
+	if (!stats_enabled)
+		return;
+
+	bump(&(LATENCIES[lat_bucket(usecs)]), 1);
+
+	max = atomic_load_explicit(&max_latency, memory_order_relaxed);
+	while (max < usecs &&
+	       !atomic_compare_exchange_weak_explicit(&max_latency,
+						      &max,
+						      usecs,
+						      memory_order_relaxed,
+						      memory_order_relaxed));
+}
+
+/* Counts 'bytes' bytes of traffic on 'stream'. */
+void
+stats_add_bytes(enum stats_stream stream, uint64_t bytes)
+{
+	if (stats_enabled)
+		bump(&(BYTES[stream]), bytes);
+}
+
+/* Sends the per-word counts. */
+static void
+dump_words(void)
+{
+	size_t		i;
+	size_t		j;
+	uint32_t	key;
+	uint64_t	count;
+	char		word[WORD_LEN];
+
+	for (i = 0; i < NUM_WORD_STATS; i++) {
+		key = atomic_load_explicit(&(WORDS[i].key),
+					   memory_order_relaxed);
+		count = take(&(WORDS[i].count));
+		if (key == 0 || count == 0)
+			continue;
+
+		for (j = 0; j < WORD_LEN - 1; j++)
+			word[j] = (char)((key >> (8 * j)) & 0xFF);
+		word[WORD_LEN - 1] = '\0';
+
+		response(R_PERF, "cmd %s %" PRIu64, word, count);
+	}
+
+	count = take(&other_words);
+	if (count != 0)
+		response(R_PERF, "cmd * %" PRIu64, count);
+}
+
+/* Sends the per-error and per-blame counts. */
+static void
+dump_errors(void)
+{
+	size_t		i;
+	uint64_t	count;
+
+	for (i = 0; i < NUM_ERRORS; i++) {
+		count = take(&(ERROR_COUNTS[i]));
+		if (count != 0)
+			response(R_PERF, "error %s %" PRIu64,
+				 error_name((enum error)i), count);
+	}
+	for (i = 0; i < NUM_ERROR_BLAMES; i++) {
+		count = take(&(BLAME_COUNTS[i]));
+		if (count != 0)
+			response(R_PERF, "blame %s %" PRIu64,
+				 BLAME_NAMES[i], count);
+	}
+}
+
+/* Sends the latency histogram and its summary. */
+static void
+dump_latencies(void)
+{
+	size_t		i;
+	size_t		p;
+	uint64_t	count;
+	uint64_t	total;
+	uint64_t	seen;
+	uint64_t	want;
+	uint64_t	at[sizeof(PERCENTILES) / sizeof(PERCENTILES[0])];
+
+	total = sum_latencies();
+	if (total == 0)
+		return;
+
+	seen = 0;
+	p = 0;
+	for (i = 0; i < NUM_LAT_BUCKETS; i++) {
+		count = take(&(LATENCIES[i]));
+		if (count == 0)
+			continue;
+
+		response(R_PERF, "latency %" PRIu64 " %" PRIu64 " %" PRIu64,
+			 lat_lower(i), lat_upper(i), count);
+
+		/* Other threads may have added more since we summed */
+		seen += count;
+		for (; p < sizeof(at) / sizeof(at[0]); p++) {
+			want = (total * PERCENTILES[p] + 999) / 1000;
+			if (seen < want)
+				break;
+			at[p] = lat_upper(i);
+		}
+	}
+	for (; p < sizeof(at) / sizeof(at[0]); p++)
+		at[p] = lat_upper(NUM_LAT_BUCKETS - 1);
+
+	response(R_PERF,
+		 "latencies %" PRIu64 " max %" PRIu64 " p50 %" PRIu64
+		 " p90 %" PRIu64 " p99 %" PRIu64 " p99.9 %" PRIu64,
+		 total,
+		 atomic_load_explicit(&max_latency, memory_order_relaxed),
+		 at[0], at[1], at[2], at[3]);
+}
+
+/* Returns the number of latencies recorded so far. */
+static uint64_t
+sum_latencies(void)
+{
+	size_t		i;
+	uint64_t	total = 0;
+
+	for (i = 0; i < NUM_LAT_BUCKETS; i++)
+		total += take(&(LATENCIES[i]));
+
+	return total;
+}
+
+/*
+ * Latencies go in log-linear buckets, as in HdrHistogram: below LAT_SUBS
+ * usecs each value has its own bucket, and above that each power of two is
+ * split into LAT_SUBS equal buckets, so every bucket is at most an eighth
+ * as wide as the values in it.
+ */
+
+/* Returns the bucket that a latency of 'usecs' goes in. */
+static size_t
+lat_bucket(uint64_t usecs)
+{
+	unsigned	bit;
+
+	if (usecs < LAT_SUBS)
+		return (size_t)usecs;
+
+	bit = top_bit(usecs);
+	if (LAT_TOP_BIT <= bit)
+		return NUM_LAT_BUCKETS - 1;
+
+	return (size_t)(bit - LAT_SUB_BITS + 1) * LAT_SUBS +
+	    (size_t)((usecs >> (bit - LAT_SUB_BITS)) & (LAT_SUBS - 1));
+}
+
+/* Returns the smallest latency that goes in 'bucket'. */
+static uint64_t
+lat_lower(size_t bucket)
+{
+	unsigned	bit;
+
+	if (bucket < LAT_SUBS)
+		return (uint64_t)bucket;
+
+	bit = (unsigned)(bucket / LAT_SUBS) + LAT_SUB_BITS - 1;
+	return (uint64_t)(LAT_SUBS + bucket % LAT_SUBS) << (bit - LAT_SUB_BITS);
+}
+
+/* Returns the largest latency that goes in 'bucket'. */
+static uint64_t
+lat_upper(size_t bucket)
+{
+	if (bucket == NUM_LAT_BUCKETS - 1)
+		return UINT64_MAX;
+
+	return lat_lower(bucket + 1) - 1;
+}
+
+/* Returns the position of the highest set bit in 'value', which MUST be
+ * non-zero.
+ */
+static unsigned
+top_bit(uint64_t value)
+{
+	unsigned	bit = 0;
+	unsigned	shift;
+
+	for (shift = 32; shift != 0; shift /= 2)
+		if ((value >> shift) != 0) {
+			value >>= shift;
+			bit += shift;
+		}
+
+	return bit;
+}
+
+/* Adds 'amount' to 'counter', without ordering it against anything else. */
+static void
+bump(atomic_uint_fast64_t *counter, uint64_t amount)
+{
+	atomic_fetch_add_explicit(counter, amount, memory_order_relaxed);
+}
+
+/* Reads 'counter', without ordering it against anything else. */
+static uint64_t
+take(atomic_uint_fast64_t *counter)
+{
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
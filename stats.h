@@ -0,0 +1,87 @@
+/*******************************************************************************
+ * stats.h - counters and latency histograms for the command loop
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CUPPA_STATS_H
+#define CUPPA_STATS_H
+
+#include <stdatomic.h>		/* atomic_bool */
+#include <stdbool.h>		/* bool */
+#include <stdint.h>		/* uint64_t */
+
+#include "errors.h"		/* enum error */
+
+/*
+ * Statistics - counts of commands run (by word) and errors thrown (by error
+ * and by blame), a histogram of how long commands take from the read that
+ * completed them to their OKAY, and how many bytes have gone in and out of
+ * each kind of stream.
+ *
+ * Statistics are off until turned on with set_stats_enabled (or a STATS
+ * command; see cmd.h), and each hook checks stats_enabled before doing any
+ * work, including reading the clock.  Define CUPPA_NO_STATS to compile them
+ * out altogether.
+ *
+ * Counters are bumped with relaxed atomics, never locks, so any thread may
+ * record into or dump them; dumps taken while counters are moving are not a
+ * consistent snapshot, but every count in them is one that happened.
+ */
+
+/* Streams whose traffic is counted. */
+enum stats_stream {
+	SS_IN,			/* Command readers */
+	SS_STDOUT,		/* Standard out */
+	SS_STDERR,		/* Standard error */
+	SS_SINKS,		/* Response sinks (see open_sink) */
+	/*--------------------------------------------------------------------*/
+	NUM_STATS_STREAMS	/* Number of items in enum */
+};
+
+#ifdef CUPPA_NO_STATS
+#define stats_enabled false
+#else
+/* Run-time switch; use set_stats_enabled to change it.  Any thread may flip
+ * it, so hooks read it through stats_enabled, a relaxed load.
+ */
+extern atomic_bool stats_on;
+#define stats_enabled atomic_load_explicit(&stats_on, memory_order_relaxed)
+#endif
+
+void		set_stats_enabled(bool enabled);
+void		reset_stats(void);
+void		dump_stats(void);
+void		stats_count_cmd(const char *word);
+void		stats_count_error(enum error code);
+void		stats_add_latency(uint64_t usecs);
+void		stats_add_bytes(enum stats_stream stream, uint64_t bytes);
+
+#endif				/* !CUPPA_STATS_H */
@@ -0,0 +1,303 @@
+/*******************************************************************************
+ * stream.c - pluggable byte streams for commands and responses
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <errno.h>		/* errno, EINTR, EAGAIN, EPIPE */
+#include <poll.h>		/* poll */
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <sys/types.h>		/* ssize_t */
+#include <sys/uio.h>		/* writev, struct iovec */
+#include <time.h>		/* nanosleep */
+#include <unistd.h>		/* read, write */
+
+#include "io.h"			/* fd_waiting */
+#include "shm.h"		/* shm_ring_* */
+#include "stream.h"		/* struct stream, struct stream_ops */
+
+/* How long to back off, in nsecs, before trying a full ring (or a stream
+ * that has no descriptor to poll) again.
+ */
+#define RING_BACKOFF 50000
+
+static ssize_t	fd_read(const struct stream *stream, char *buf, size_t len);
+static ssize_t
+fd_write(const struct stream *stream,
+	 const char *buf,
+	 size_t len);
+static ssize_t
+fd_writev(const struct stream *stream,
+	  const struct iovec *iov,
+	  int num_iov);
+static ssize_t	ring_read(const struct stream *stream, char *buf, size_t len);
+static ssize_t
+ring_write(const struct stream *stream,
+	   const char *buf,
+	   size_t len);
+static void	ring_wait(const struct stream *stream, bool output);
+static void	poll_stream(const struct stream *stream, bool output);
+
+const struct stream_ops FD_STREAM_OPS = {
+	fd_read, fd_write, fd_writev, NULL, NULL, true
+};
+
+static const struct stream_ops RING_STREAM_OPS = {
+	ring_read, ring_write, NULL, ring_wait, NULL, false
+};
+
+/* Returns a stream reading from and writing to the descriptor 'fd'. */
+struct stream
+fd_stream(int fd)
+{
+	struct stream	stream = {&FD_STREAM_OPS, NULL, fd};
+
+	return stream;
+}
+
+/* Returns a stream reading from or writing to the shared-memory ring 'ring',
+ * depending on which side of it this is (see shm.h).  The stream's
+ * descriptor is the ring's doorbell, and full rings are waited on by
+ * backing off, as the doorbell only tells consumers about new data.
+ */
+struct stream
+ring_stream(struct shm_ring *ring)
+{
+	struct stream	stream = {&RING_STREAM_OPS, NULL, -1};
+
+	stream.data = ring;
+	stream.fd = shm_ring_bell(ring);
+
+	return stream;
+}
+
+/* Reads up to 'len' bytes from 'stream', retrying after signals. */
+ssize_t
+stream_read(const struct stream *stream, char *buf, size_t len)
+{
+	ssize_t		num_read;
+
+	do
+		num_read = stream->ops->read(stream, buf, len);
+	while (num_read == -1 && errno == EINTR);
+
+	return num_read;
+}
+
+/* Writes up to 'len' bytes to 'stream', retrying after signals. */
+ssize_t
+stream_write(const struct stream *stream, const char *buf, size_t len)
+{
+	ssize_t		num_written;
+
+	do
+		num_written = stream->ops->write(stream, buf, len);
+	while (num_written == -1 && errno == EINTR);
+
+	return num_written;
+}
+
+/* Writes all of 'buf' to 'stream', waiting for room if need be.  Returns
+ * false if the stream fails, in which case the rest is dropped.
+ */
+bool
+stream_write_all(const struct stream *stream, const char *buf, size_t len)
+{
+	ssize_t		num_written;
+
+	while (len != 0) {
+		num_written = stream_write(stream, buf, len);
+		if (num_written > 0) {
+			buf += num_written;
+			len -= (size_t)num_written;
+		} else if (num_written == -1 &&
+			   (errno == EAGAIN || errno == EWOULDBLOCK))
+			stream_wait(stream, true);
+		else
+			return false;
+	}
+
+	return true;
+}
+
+/* Writes out all of the 'num_iov' buffers in 'iov' to 'stream', waiting for
+ * room if need be.  'iov' is used up in the process.  Returns false if the
+ * stream fails.
+ */
+bool
+stream_writev_all(const struct stream *stream, struct iovec *iov, int num_iov)
+{
+	size_t		done;
+	ssize_t		num_written;
+
+	while (num_iov != 0) {
+		if (stream->ops->writev == NULL)
+			num_written = stream->ops->write(stream,
+							 iov->iov_base,
+							 iov->iov_len);
+		else
+			num_written = stream->ops->writev(stream,
+							  iov,
+							  num_iov);
+
+		if (num_written == -1 && errno == EINTR)
+			continue;
+		if (num_written == -1 &&
+		    (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			stream_wait(stream, true);
+			continue;
+		}
+		if (num_written <= 0 && iov->iov_len != 0)
+			return false;
+
+		/* Skip over everything that was written */
+		for (done = (size_t)(num_written < 0 ? 0 : num_written);
+		     num_iov != 0 && iov->iov_len <= done;
+		     iov++, num_iov--)
+			done -= iov->iov_len;
+		if (num_iov != 0) {
+			iov->iov_base = (char *)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+
+	return true;
+}
+
+/* Pushes out anything the stream itself is holding back. */
+void
+stream_flush(const struct stream *stream)
+{
+	if (stream->ops->flush != NULL)
+		stream->ops->flush(stream);
+}
+
+/* Waits until 'stream' looks ready for input or output.  This may return
+ * early, so try again afterwards.
+ */
+void
+stream_wait(const struct stream *stream, bool output)
+{
+	if (stream->ops->wait != NULL)
+		stream->ops->wait(stream, output);
+	else
+		poll_stream(stream, output);
+}
+
+/* Returns true if 'stream' may have input waiting, which for streams that
+ * must be polled costs a system call.
+ */
+bool
+stream_maybe_input(const struct stream *stream)
+{
+	return !stream->ops->polled || fd_waiting(stream->fd);
+}
+
+static ssize_t
+fd_read(const struct stream *stream, char *buf, size_t len)
+{
+	return read(stream->fd, buf, len);
+}
+
+static ssize_t
+fd_write(const struct stream *stream, const char *buf, size_t len)
+{
+	return write(stream->fd, buf, len);
+}
+
+static ssize_t
+fd_writev(const struct stream *stream, const struct iovec *iov, int num_iov)
+{
+	return writev(stream->fd, iov, num_iov);
+}
+
+static ssize_t
+ring_read(const struct stream *stream, char *buf, size_t len)
+{
+	size_t		num_read;
+	bool		eof;
+
+	num_read = shm_ring_read(stream->data, buf, len, &eof);
+	if (num_read == 0 && !eof && len != 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return (ssize_t)num_read;
+}
+
+static ssize_t
+ring_write(const struct stream *stream, const char *buf, size_t len)
+{
+	size_t		num_written;
+
+	num_written = shm_ring_write(stream->data, buf, len);
+	if (num_written == 0 && len != 0) {
+		errno = shm_ring_gone(stream->data) ? EPIPE : EAGAIN;
+		return -1;
+	}
+
+	return (ssize_t)num_written;
+}
+
+static void
+ring_wait(const struct stream *stream, bool output)
+{
+	struct timespec	wait = {0, RING_BACKOFF};
+
+	if (output)
+		nanosleep(&wait, NULL);
+	else
+		poll_stream(stream, false);
+}
+
+/* Waits on the descriptor of 'stream' until it is readable or writable.
+ * Streams without one can't be waited on properly, so back off instead of
+ * coming straight back to a caller that is bound to try again at once.
+ */
+static void
+poll_stream(const struct stream *stream, bool output)
+{
+	struct pollfd	pfd;
+	struct timespec	wait = {0, RING_BACKOFF};
+
+	if (stream->fd == -1) {
+		nanosleep(&wait, NULL);
+		return;
+	}
+
+	pfd.fd = stream->fd;
+	pfd.events = output ? POLLOUT : POLLIN;
+	pfd.revents = 0;
+	(void)poll(&pfd, 1, -1);
+}
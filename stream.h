@@ -0,0 +1,116 @@
+/*******************************************************************************
+ * stream.h - pluggable byte streams for commands and responses
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CUPPA_STREAM_H
+#define CUPPA_STREAM_H
+
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <sys/types.h>		/* ssize_t */
+#include <sys/uio.h>		/* struct iovec */
+
+/*
+ * Streams - what command readers read from (see init_stream_reader), what
+ * PROPAGATE commands are forwarded to (see struct cmd_prop), and what
+ * responses are written to (see open_stream_sink and set_stdout_stream).
+ *
+ * A stream is a small value: a table of operations, a pointer for the
+ * implementation and a descriptor that can be polled to wait on it, so that
+ * streams work with reactors.  Descriptors (fd_stream) are the default, and
+ * shared-memory rings (ring_stream) are built in; anything else, such as an
+ * in-process queue for tests, needs only fill in a struct stream_ops.
+ *
+ * Every operation follows the conventions of its system call: reads return
+ * 0 at end of file, and reads and writes that can't make progress without
+ * waiting return -1 with errno set to EAGAIN.  Command readers do their own
+ * line splitting and framing, so streams only ever read what is available.
+ */
+
+struct stream;
+
+/* Operations on a kind of stream.  Any of 'writev', 'wait' and 'flush' may
+ * be NULL, in which case writes are done one buffer at a time, waiting polls
+ * the descriptor (or, if there is none, sleeps briefly), and flushing does
+ * nothing.
+ */
+struct stream_ops {
+	ssize_t		(*read) (const struct stream *stream,
+				 char *buf,
+				 size_t len);
+	ssize_t		(*write) (const struct stream *stream,
+				  const char *buf,
+				  size_t len);
+	ssize_t		(*writev) (const struct stream *stream,
+				   const struct iovec *iov,
+				   int num_iov);
+	void		(*wait) (const struct stream *stream, bool output);
+	void		(*flush) (const struct stream *stream);
+	bool		polled;	/* Must the descriptor be polled to know if
+				 * there's input, as with pipes?  If not,
+				 * reading is taken to be cheap, and readers
+				 * read until nothing comes before waiting on
+				 * the descriptor. */
+};
+
+/* A stream.  Fill in with fd_stream, ring_stream or by hand. */
+struct stream {
+	const struct stream_ops *ops;	/* What kind of stream this is */
+	void	       *data;	/* For the implementation */
+	int		fd;	/* Descriptor to poll on, or -1 if none */
+};
+
+struct shm_ring;
+
+/* Operations of descriptor streams, for static initialisers. */
+extern const struct stream_ops FD_STREAM_OPS;
+
+struct stream	fd_stream(int fd);
+struct stream	ring_stream(struct shm_ring *ring);
+ssize_t		stream_read(const struct stream *stream, char *buf, size_t len);
+ssize_t
+stream_write(const struct stream *stream,
+	     const char *buf,
+	     size_t len);
+bool
+stream_write_all(const struct stream *stream,
+		 const char *buf,
+		 size_t len);
+bool
+stream_writev_all(const struct stream *stream,
+		  struct iovec *iov,
+		  int num_iov);
+void		stream_flush(const struct stream *stream);
+void		stream_wait(const struct stream *stream, bool output);
+bool		stream_maybe_input(const struct stream *stream);
+
+#endif				/* !CUPPA_STREAM_H */
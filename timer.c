@@ -0,0 +1,265 @@
+/*******************************************************************************
+ * timer.c - deadline timers run by reactors
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* int64_t, uint64_t */
+#include <stdlib.h>		/* realloc */
+
+#include "errors.h"		/* error */
+#include "io.h"			/* struct reactor */
+#include "messages.h"		/* MSG_IO_NOTIMER */
+#include "timer.h"		/* struct timer */
+#include "utils.h"		/* SAFE_FREE, monotonic_usecs */
+
+static void	place(struct reactor *reactor, size_t slot, struct timer *timer);
+static void	sift_up(struct reactor *reactor, size_t slot);
+static void	sift_down(struct reactor *reactor, size_t slot);
+static void	remove_slot(struct reactor *reactor, size_t slot);
+
+/* Sets up 'timer' to call 'handler' with 'data'.  It starts out not
+ * scheduled; see reactor_add_timer.
+ */
+void
+init_timer(struct timer *timer, timer_handler handler, void *data)
+{
+	timer->handler = handler;
+	timer->data = data;
+	timer->deadline = 0;
+	timer->period = 0;
+	timer->slot = 0;
+	timer->pending = false;
+}
+
+/* Schedules 'timer' on 'reactor' to go off 'delay' microseconds from now,
+ * then every 'period' microseconds after that, unless 'period' is 0.  A
+ * timer that was already scheduled is moved to its new deadline.
+ */
+enum error
+reactor_add_timer(struct reactor *reactor,
+		  struct timer *timer,
+		  uint64_t delay,
+		  uint64_t period)
+{
+	size_t		size;
+	struct timer  **timers;
+	enum error	err = E_OK;
+
+	if (timer->pending)
+		reactor_cancel_timer(reactor, timer);
+
+	if (reactor->num_timers == reactor->timers_size) {
+		size = (reactor->timers_size == 0) ? 4 : reactor->timers_size * 2;
+		timers = realloc(reactor->timers, size * sizeof(*timers));
+		if (timers == NULL)
+			err = error(E_NO_MEM, "%s", MSG_IO_NOTIMER);
+		else {
+			reactor->timers = timers;
+			reactor->timers_size = size;
+		}
+	}
+
+	if (err == E_OK) {
+		timer->deadline = monotonic_usecs() + delay;
+		timer->period = period;
+		timer->pending = true;
+		place(reactor, reactor->num_timers++, timer);
+		sift_up(reactor, timer->slot);
+	}
+
+	return err;
+}
+
+/* Unschedules 'timer', if it is scheduled on 'reactor'.  This is safe to
+ * call from inside a timer or descriptor handler.
+ */
+void
+reactor_cancel_timer(struct reactor *reactor, struct timer *timer)
+{
+	if (timer->pending) {
+		remove_slot(reactor, timer->slot);
+		timer->pending = false;
+	}
+}
+
+/* Returns true if 'timer' is scheduled to go off. */
+bool
+timer_pending(const struct timer *timer)
+{
+	return timer->pending;
+}
+
+/* Returns how long, in microseconds, a reactor can wait for input before
+ * its next timer is due, given that the caller wants to wait at most
+ * 'timeout' (forever if negative).  Programs with their own poll loop (see
+ * reactor_fds) can use this to bound their waits.
+ */
+int64_t
+reactor_timeout(const struct reactor *reactor, int64_t timeout)
+{
+	uint64_t	now;
+	uint64_t	deadline;
+	uint64_t	wait = 0;
+
+	if (reactor->num_timers == 0)
+		return timeout;
+
+	now = monotonic_usecs();
+	deadline = reactor->timers[0]->deadline;
+	if (now < deadline)
+		wait = deadline - now;
+
+	if (INT64_MAX < wait)
+		wait = INT64_MAX;
+	if (timeout < 0 || wait < (uint64_t)timeout)
+		timeout = (int64_t)wait;
+
+	return timeout;
+}
+
+/* Runs the handlers of every timer on 'reactor' whose deadline has passed,
+ * soonest first, rescheduling periodic ones.  reactor_run does this itself.
+ *
+ * Stops at and returns the first error a handler returns.
+ */
+enum error
+reactor_run_timers(struct reactor *reactor)
+{
+	uint64_t	now;
+	uint64_t	late;
+	struct timer   *timer;
+	enum error	err = E_OK;
+
+	if (reactor->num_timers == 0)
+		return E_OK;
+
+	now = monotonic_usecs();
+	while (err == E_OK && reactor->num_timers != 0 &&
+	       reactor->timers[0]->deadline <= now) {
+		timer = reactor->timers[0];
+
+		/* Reschedule first, so the handler is free to cancel it */
+		if (timer->period == 0) {
+			remove_slot(reactor, 0);
+			timer->pending = false;
+		} else {
+			late = now - timer->deadline;
+			timer->deadline += timer->period *
+			    (late / timer->period + 1);
+			sift_down(reactor, 0);
+		}
+
+		err = timer->handler(timer->data, now);
+	}
+
+	return err;
+}
+
+/* Unschedules every timer on 'reactor' and releases its heap.  This is part
+ * of free_reactor.
+ */
+void
+free_reactor_timers(struct reactor *reactor)
+{
+	size_t		i;
+
+	for (i = 0; i < reactor->num_timers; i++)
+		reactor->timers[i]->pending = false;
+
+	SAFE_FREE(&(reactor->timers));
+	reactor->num_timers = 0;
+	reactor->timers_size = 0;
+}
+
+/* Puts 'timer' in heap slot 'slot', telling it where it is. */
+static void
+place(struct reactor *reactor, size_t slot, struct timer *timer)
+{
+	reactor->timers[slot] = timer;
+	timer->slot = slot;
+}
+
+/* Moves the timer in 'slot' towards the top of the heap until its parent
+ * is due no later than it.
+ */
+static void
+sift_up(struct reactor *reactor, size_t slot)
+{
+	size_t		parent;
+	struct timer   *timer = reactor->timers[slot];
+
+	for (; slot != 0; slot = parent) {
+		parent = (slot - 1) / 2;
+		if (reactor->timers[parent]->deadline <= timer->deadline)
+			break;
+		place(reactor, slot, reactor->timers[parent]);
+	}
+	place(reactor, slot, timer);
+}
+
+/* Moves the timer in 'slot' towards the bottom of the heap until its
+ * children are due no earlier than it.
+ */
+static void
+sift_down(struct reactor *reactor, size_t slot)
+{
+	size_t		child;
+	struct timer   *timer = reactor->timers[slot];
+
+	for (; (child = slot * 2 + 1) < reactor->num_timers; slot = child) {
+		if (child + 1 < reactor->num_timers &&
+		    reactor->timers[child + 1]->deadline <
+		    reactor->timers[child]->deadline)
+			child++;
+		if (timer->deadline <= reactor->timers[child]->deadline)
+			break;
+		place(reactor, slot, reactor->timers[child]);
+	}
+	place(reactor, slot, timer);
+}
+
+/* Takes the timer in 'slot' out of the heap, filling the hole with the
+ * last timer.
+ */
+static void
+remove_slot(struct reactor *reactor, size_t slot)
+{
+	struct timer   *last;
+
+	last = reactor->timers[--reactor->num_timers];
+	if (slot != reactor->num_timers) {
+		place(reactor, slot, last);
+		sift_down(reactor, slot);
+		sift_up(reactor, last->slot);
+	}
+}
@@ -0,0 +1,91 @@
+/*******************************************************************************
+ * timer.h - deadline timers run by reactors
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CUPPA_TIMER_H
+#define CUPPA_TIMER_H
+
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* int64_t, uint64_t */
+
+#include "errors.h"		/* enum error */
+#include "io.h"			/* struct reactor */
+
+/*
+ * Timers - deadlines on the monotonic clock (see monotonic_usecs), kept by
+ * a reactor in a binary min-heap and run by reactor_run once they pass, so
+ * that programs sleep until the next deadline or input instead of polling.
+ * A TIME push at a steady rate, for example, is a periodic timer whose
+ * handler sends it:
+ *
+ *   init_timer(&time_timer, send_time, player);
+ *   reactor_add_timer(reactor, &time_timer, 0, USECS_IN_SEC / 10);
+ *
+ * Periodic timers are rescheduled from their last deadline, not from when
+ * they ran, so they don't drift; if the program falls so far behind that
+ * whole periods go by, those runs are skipped rather than made up in a
+ * burst.  Timers run at or after their deadlines, never before, though
+ * reactors wait in whole milliseconds.
+ *
+ * Set up with init_timer.  Timers MUST stay alive, and unmoved, while they
+ * are scheduled.  Don't touch the fields directly.
+ */
+
+/* Handler called by a reactor when a timer goes off.  'now' is the time it
+ * was run, on the monotonic clock.
+ */
+typedef enum error (*timer_handler) (void *data, uint64_t now);
+
+/* A timer.  See above. */
+struct timer {
+	timer_handler	handler;	/* Handler to call */
+	void	       *data;	/* User data passed to the handler */
+	uint64_t	deadline;	/* When it next goes off */
+	uint64_t	period;	/* Time between runs; 0 if it runs once */
+	size_t		slot;	/* Place in the reactor's heap, if pending */
+	bool		pending;	/* Scheduled on a reactor? */
+};
+
+void		init_timer(struct timer *timer, timer_handler handler, void *data);
+enum error
+reactor_add_timer(struct reactor *reactor,
+		  struct timer *timer,
+		  uint64_t delay,
+		  uint64_t period);
+void		reactor_cancel_timer(struct reactor *reactor, struct timer *timer);
+bool		timer_pending(const struct timer *timer);
+int64_t		reactor_timeout(const struct reactor *reactor, int64_t timeout);
+enum error	reactor_run_timers(struct reactor *reactor);
+void		free_reactor_timers(struct reactor *reactor);
+
+#endif				/* !CUPPA_TIMER_H */
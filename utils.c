@@ -31,19 +31,59 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <ctype.h>		/* isspace */
+#define _POSIX_C_SOURCE 200809
+
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* uint32_t, uint64_t */
 #include <stdlib.h>		/* NULL */
+#include <string.h>		/* memcpy */
+#include <time.h>		/* clock_gettime */
+
+#include "constants.h"		/* WORD_LEN */
+#include "utils.h"		/* struct line_tokens */
+
+#if WORD_LEN > 5
+#error "pack_word assumes command words fit into 32 bits"
+#endif
+
+/*
+ * tokenize_line classifies eight bytes at a time, packed into a uint64_t
+ * (SWAR), unless CUPPA_NO_SWAR is defined.  Each of the SWAR_* masks below
+ * has the top bit of a byte set exactly where that byte matches, with no
+ * false positives, so the first match is the lowest set byte.
+ */
+#define SWAR_ONES UINT64_C(0x0101010101010101)
+#define SWAR_HIGH UINT64_C(0x8080808080808080)
+#define SWAR_LOW UINT64_C(0x7F7F7F7F7F7F7F7F)
+
+/* Bytes of 'x' equal to zero. */
+#define SWAR_ZERO(x) (~((((x) & SWAR_LOW) + SWAR_LOW) | (x)) & SWAR_HIGH)
+
+enum scan_stop {
+	STOP_AT_NONSPACE,	/* Stop at the first non-space (or '\0') */
+	STOP_AT_SPACE,		/* Stop at the first space or '\0' */
+	STOP_AT_NUL		/* Stop at the first '\0' */
+};
+
+static bool	is_space(char c);
+static size_t	scan(const char *str, size_t from, size_t len, enum scan_stop stop);
+#ifndef CUPPA_NO_SWAR
+static uint64_t	load_bytes(const char *p);
+static uint64_t	match_bytes(uint64_t x, enum scan_stop stop);
+static size_t	first_byte(uint64_t mask);
+#endif
 
 /* Given a char pointer into a null-terminated string, returns the pointer
  * marking the location of that null terminator.  O(n).
  */
-char		*
+char           *
 endof(char *str)
 {
-	char		*p;
-	
-	for (p = str; p != NULL && p != '\0'; p++);
-	
+	char           *p;
+
+	for (p = str; p != NULL && *p != '\0'; p++);
+
 	return p;
 }
 
@@ -59,7 +99,7 @@ skip_space(char *str)
 	char           *p;
 
 	/* Note: \0 is NOT a space, so this terminates at string end */
-	for (p = str; p != NULL && isspace((int)*p); p++);
+	for (p = str; p != NULL && is_space(*p); p++);
 
 	return p;
 }
@@ -72,7 +112,7 @@ skip_nonspace(char *str)
 {
 	char           *p;
 
-	for (p = str; p != NULL && *p != '\0' && !isspace((int)*p); p++);
+	for (p = str; p != NULL && *p != '\0' && !is_space(*p); p++);
 
 	return p;
 }
@@ -83,23 +123,205 @@ nullify_space(char *str)
 {
 	char           *p;
 
-	for (p = str; p != NULL && isspace((int)*p); p++)
+	for (p = str; p != NULL && is_space(*p); p++)
 		*p = '\0';
 
 	return p;
 }
 
-/* As 'nullify_space', but acts on trailing space.  Supply with a pointer to
- * the terminator of a string; obviously, this function works in-place.
+/* As 'nullify_space', but acts on trailing space.  Supply with pointers to
+ * the start and the terminator of a string; obviously, this function works
+ * in-place, and never goes back past 'str'.  Returns the pointer marking the
+ * new terminator.
  */
-char		*
-nullify_tspace(char *end)
+char           *
+nullify_tspace(char *str, char *end)
 {
-	char		*p;
-	
-	for (p = end; p == '\0'; p--);
-	for (p = end; p != NULL && isspace((int)*p); p--)
-		*p = '\0';
+	char           *p;
+
+	if (str == NULL || end == NULL)
+		return end;
+
+	for (p = end; str < p && is_space(p[-1]); p--)
+		p[-1] = '\0';
+
+	return p;
+}
+
+/* Splits the first 'len' bytes of 'line' into a command word and argument,
+ * without modifying it, and puts their positions into 'tokens'.
+ *
+ * The word is the first run of non-space characters, and the argument is
+ * everything after the space following the word, less any trailing space.
+ * As with the other scanners, a '\0' ends the line early.  Space here means
+ * ASCII space, whatever the locale.
+ *
+ * The byte after each part is always a space, a '\0' or line[len], so the
+ * caller can terminate both parts in place.
+ */
+void
+tokenize_line(const char *line, size_t len, struct line_tokens *tokens)
+{
+	size_t		end;
+	size_t		p;
+
+	tokens->word = scan(line, 0, len, STOP_AT_NONSPACE);
+	end = scan(line, tokens->word, len, STOP_AT_SPACE);
+	tokens->word_len = end - tokens->word;
+
+	tokens->arg = scan(line, end, len, STOP_AT_NONSPACE);
+	if (tokens->arg < len && line[tokens->arg] != '\0')
+		end = scan(line, tokens->arg, len, STOP_AT_NUL);
+	else
+		end = tokens->arg;
+
+	/* Trailing space is rare and short, so isn't worth vectorising */
+	for (p = end; tokens->arg < p && is_space(line[p - 1]); p--);
+	tokens->arg_len = p - tokens->arg;
+}
+
+/* Packs a command word into a 32-bit integer key, one byte per character and
+ * with unused bytes zeroed, so words can be compared and hashed as integers.
+ * Returns false (leaving *key undefined) if the word is empty or longer than
+ * WORD_LEN - 1 characters, as such words have no packed form.
+ */
+bool
+pack_word(const char *word, uint32_t *key)
+{
+	int		i;
+
+	*key = 0;
+	for (i = 0; i < WORD_LEN - 1 && word[i] != '\0'; i++)
+		*key |= (uint32_t)(unsigned char)word[i] << (8 * i);
+
+	return i > 0 && word[i] == '\0';
+}
+
+/* Writes 'value' in decimal, without a terminator, into 'buf', which must have
+ * room for U64_DIGITS characters.  Returns the number of characters written.
+ */
+size_t
+format_u64(uint64_t value, char *buf)
+{
+	char		digits[U64_DIGITS];
+	size_t		i = U64_DIGITS;
+
+	/* Digits come out backwards, so fill from the end */
+	do {
+		digits[--i] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value != 0);
+
+	memcpy(buf, digits + i, U64_DIGITS - i);
+
+	return U64_DIGITS - i;
+}
+
+/* Returns the current time on the monotonic clock, in microseconds.  This is
+ * only useful for measuring intervals, as its epoch is arbitrary.
+ */
+uint64_t
+monotonic_usecs(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * USECS_IN_SEC +
+	    (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* Returns true if 'c' is ASCII white space (as isspace in the C locale). */
+static bool
+is_space(char c)
+{
+	return c == ' ' || ('\t' <= c && c <= '\r');
+}
+
+/* Returns the offset of the first byte in str[from..len) to satisfy 'stop'
+ * (see enum scan_stop), or 'len' if none do.
+ */
+static size_t
+scan(const char *str, size_t from, size_t len, enum scan_stop stop)
+{
+	size_t		p = from;
+#ifndef CUPPA_NO_SWAR
+	uint64_t	mask;
+
+	for (; p + sizeof(mask) <= len; p += sizeof(mask)) {
+		mask = match_bytes(load_bytes(str + p), stop);
+		if (mask != 0)
+			return p + first_byte(mask);
+	}
+#endif				/* !CUPPA_NO_SWAR */
+
+	for (; p < len; p++)
+		if (str[p] == '\0' ||
+		    (stop == STOP_AT_NONSPACE && !is_space(str[p])) ||
+		    (stop == STOP_AT_SPACE && is_space(str[p])))
+			break;
 
 	return p;
 }
+
+#ifndef CUPPA_NO_SWAR
+/* Loads eight bytes from 'p', the first into the lowest byte whatever the
+ * machine's byte order.  Compilers turn this into one load where they can.
+ */
+static uint64_t
+load_bytes(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+
+	return (uint64_t)u[0] | (uint64_t)u[1] << 8 |
+	    (uint64_t)u[2] << 16 | (uint64_t)u[3] << 24 |
+	    (uint64_t)u[4] << 32 | (uint64_t)u[5] << 40 |
+	    (uint64_t)u[6] << 48 | (uint64_t)u[7] << 56;
+}
+
+/* Returns a mask with the top bit set in each byte of 'x' satisfying 'stop'
+ * (see enum scan_stop).
+ */
+static uint64_t
+match_bytes(uint64_t x, enum scan_stop stop)
+{
+	uint64_t	low;
+	uint64_t	ctrl;
+	uint64_t	spc;
+	uint64_t	space;
+	uint64_t	nul;
+
+	nul = SWAR_ZERO(x);
+	if (stop == STOP_AT_NUL)
+		return nul;
+
+	/* Spaces are ' ' and '\t' to '\r', none of which have the top bit */
+	low = x & SWAR_LOW;
+	ctrl = ((low | SWAR_HIGH) - (uint64_t)'\t' * SWAR_ONES) &
+	    (((uint64_t)'\r' * SWAR_ONES | SWAR_HIGH) - low);
+	spc = x ^ ((uint64_t)' ' * SWAR_ONES);
+	space = ((ctrl & SWAR_HIGH) | SWAR_ZERO(spc)) & ~x & SWAR_HIGH;
+
+	if (stop == STOP_AT_SPACE)
+		return space | nul;
+	return ~space & SWAR_HIGH;
+}
+
+/* Returns the index of the lowest byte with its top bit set in 'mask', which
+ * MUST NOT be 0.
+ */
+static size_t
+first_byte(uint64_t mask)
+{
+#ifdef __GNUC__
+	return (size_t)__builtin_ctzll(mask) / 8;
+#else
+	size_t		i;
+
+	for (i = 0; (mask & 0x80) == 0; i++)
+		mask >>= 8;
+
+	return i;
+#endif				/* __GNUC__ */
+}
+#endif				/* !CUPPA_NO_SWAR */
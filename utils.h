@@ -34,6 +34,10 @@
 #ifndef CUPPA_UTILS_H
 #define CUPPA_UTILS_H
 
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* uint32_t, uint64_t */
+
 /* Frees and NULLifies the pointer pointed to by *ptr, if it is currently NULL.
  * Silently ignores the case of ptr being NULL itself.
  */
@@ -45,10 +49,31 @@
 		}			\
 } while (0)
 
+/* Longest decimal rendering of a uint64_t. */
+#define U64_DIGITS 20
+
+/* Where the command word and argument lie in a command line, as offsets
+ * into it.  A length of 0 means the line has no such part.  See
+ * tokenize_line.
+ */
+struct line_tokens {
+	size_t		word;	/* Offset of the command word */
+	size_t		word_len;	/* Length of the command word */
+	size_t		arg;	/* Offset of the argument */
+	size_t		arg_len;	/* Length of the argument */
+};
+
 char           *endof(char *str);
 char           *skip_space(char *str);
 char           *skip_nonspace(char *str);
 char           *nullify_space(char *str);
-char           *nullify_tspace(char *end);
+char           *nullify_tspace(char *str, char *end);
+void
+tokenize_line(const char *line,
+	      size_t len,
+	      struct line_tokens *tokens);
+bool		pack_word(const char *word, uint32_t *key);
+size_t		format_u64(uint64_t value, char *buf);
+uint64_t	monotonic_usecs(void);
 
 #endif				/* !CUPPA_UTILS_H */
@@ -0,0 +1,231 @@
+/*******************************************************************************
+ * wire.c - binary framed protocol encoding
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* uint32_t, uint64_t */
+#include <string.h>		/* memcpy, strcmp, strnlen */
+
+#include "constants.h"		/* WORD_LEN */
+#include "errors.h"		/* error */
+#include "io.h"			/* enum response */
+#include "messages.h"		/* MSG_WIRE_* */
+#include "wire.h"		/* frame layout */
+
+/* Length of a command word in a frame. */
+#define FRAME_WORD_LEN (WORD_LEN - 1)
+
+/* Names of the encodings, as given to WIRE commands. */
+static const char *WIRE_NAMES[NUM_WIRE_MODES] = {
+	"text",			/* WIRE_TEXT */
+	"binary"		/* WIRE_BINARY */
+};
+
+/* Reads a big-endian u32 from 'buf'. */
+uint32_t
+wire_get_u32(const char *buf)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+/* Writes 'value' into 'buf' as a big-endian u32. */
+void
+wire_put_u32(char *buf, uint32_t value)
+{
+	int		i;
+
+	for (i = 3; i >= 0; i--, value >>= 8)
+		buf[i] = (char)(value & 0xFF);
+}
+
+/* Writes 'value' into 'buf' as a big-endian u64. */
+void
+wire_put_u64(char *buf, uint64_t value)
+{
+	int		i;
+
+	for (i = 7; i >= 0; i--, value >>= 8)
+		buf[i] = (char)(value & 0xFF);
+}
+
+/* Returns true if any of the 'len' bytes at 'str' is a line break or null,
+ * which a frame's word and argument can't hold: they'd be mangled when the
+ * command is forwarded or captured as a line of text.
+ */
+static bool
+has_ctrl(const char *str, size_t len)
+{
+	size_t		i;
+
+	for (i = 0; i < len; i++)
+		if (str[i] == '\0' || str[i] == '\n' || str[i] == '\r')
+			return true;
+
+	return false;
+}
+
+/* Looks up the encoding called 'name', returning false if there isn't one. */
+bool
+parse_wire_mode(const char *name, enum wire_mode *mode)
+{
+	int		i;
+
+	for (i = 0; i < NUM_WIRE_MODES; i++)
+		if (strcmp(WIRE_NAMES[i], name) == 0) {
+			*mode = (enum wire_mode)i;
+			return true;
+		}
+
+	return false;
+}
+
+/* Decodes the command frame at the start of the 'len' bytes at 'buf'.
+ *
+ * On success, copies the command word into 'word' (which must have room for
+ * WORD_LEN bytes), points *arg at the argument inside 'buf' (or sets it to
+ * NULL if there is none, or it is empty), and sets *used to the frame's total
+ * length.  Words and arguments holding line breaks or nulls (other than the
+ * word's padding and the argument's terminator) are rejected.
+ *
+ * Returns E_INCOMPLETE if the frame hasn't all arrived yet.  Malformed frames
+ * are reported and *used set to the number of bytes to throw away; if the
+ * frame is too long to ever accept, that is all of them, as there is no way
+ * to find the start of the next frame.
+ */
+enum error
+decode_cmd_frame(char *buf,
+		 size_t len,
+		 size_t *used,
+		 char *word,
+		 char **arg)
+{
+	uint32_t	frame_len;
+	uint32_t	str_len;
+	size_t		i;
+	size_t		word_len;
+	char           *body;
+	enum error	err = E_OK;
+
+	if (len < WIRE_LEN_SIZE)
+		return E_INCOMPLETE;
+
+	frame_len = wire_get_u32(buf);
+	if (WIRE_MAX_FRAME < frame_len) {
+		*used = len;
+		return error(E_BAD_COMMAND, "%s", MSG_WIRE_BIGFRAME);
+	}
+	if (len - WIRE_LEN_SIZE < frame_len)
+		return E_INCOMPLETE;
+
+	*used = WIRE_LEN_SIZE + frame_len;
+	body = buf + WIRE_LEN_SIZE;
+
+	if (frame_len < FRAME_WORD_LEN)
+		err = error(E_BAD_COMMAND, "%s", MSG_WIRE_BADFRAME);
+	else {
+		/* Padding, once started, must run to the end of the word */
+		word_len = strnlen(body, FRAME_WORD_LEN);
+		for (i = word_len; i < FRAME_WORD_LEN; i++)
+			if (body[i] != '\0')
+				break;
+		if (has_ctrl(body, word_len) || i != FRAME_WORD_LEN)
+			err = error(E_BAD_COMMAND, "%s", MSG_WIRE_CTRL);
+	}
+	if (err == E_OK) {
+		memcpy(word, body, FRAME_WORD_LEN);
+		word[FRAME_WORD_LEN] = '\0';
+		*arg = NULL;
+
+		body += FRAME_WORD_LEN;
+		frame_len -= FRAME_WORD_LEN;
+	}
+
+	/* The only field a command can have is its argument, as a string */
+	if (err == E_OK && frame_len != 0) {
+		if (frame_len < 1 + 4 || body[0] != WF_STR)
+			err = error(E_BAD_COMMAND, "%s", MSG_WIRE_BADFRAME);
+		else {
+			str_len = wire_get_u32(body + 1);
+			if (str_len == 0 || str_len != frame_len - (1 + 4) ||
+			    body[1 + 4 + str_len - 1] != '\0')
+				err = error(E_BAD_COMMAND,
+					    "%s",
+					    MSG_WIRE_BADFRAME);
+			else if (has_ctrl(body + 1 + 4, str_len - 1))
+				err = error(E_BAD_COMMAND,
+					    "%s",
+					    MSG_WIRE_CTRL);
+			else if (str_len != 1)
+				*arg = body + 1 + 4;
+		}
+	}
+
+	return err;
+}
+
+/* Fills in the start of a response frame holding one string field, whose
+ * 'len' bytes of text (plus a NUL terminator) already sit WIRE_STR_HEAD
+ * bytes into 'buf'.  Returns the length of the whole frame.
+ */
+size_t
+encode_str_frame(char *buf, enum response code, size_t len)
+{
+	/* Everything but the length prefix: code, type, length, text, NUL */
+	wire_put_u32(buf, (uint32_t)(1 + 1 + 4 + len + 1));
+	buf[4] = (char)code;
+	buf[5] = (char)WF_STR;
+	wire_put_u32(buf + 6, (uint32_t)(len + 1));
+
+	return WIRE_STR_HEAD + len + 1;
+}
+
+/* Writes a whole response frame holding the one u64 field 'value' into
+ * 'buf', which must have room for WIRE_U64_FRAME bytes.  Returns the length
+ * of the frame.
+ */
+size_t
+encode_u64_frame(char *buf, enum response code, uint64_t value)
+{
+	/* Everything but the length prefix: code, type, value */
+	wire_put_u32(buf, 1 + 1 + 8);
+	buf[4] = (char)code;
+	buf[5] = (char)WF_U64;
+	wire_put_u64(buf + 6, value);
+
+	return WIRE_U64_FRAME;
+}
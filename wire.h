@@ -0,0 +1,90 @@
+/*******************************************************************************
+ * wire.h - binary framed protocol encoding
+ *   Part of cuppa, the Common URY Playout Package Architecture
+ *
+ * Contributors:  Matt Windsor <matt.windsor@ury.org.uk>
+ */
+
+/*-
+ * Copyright (c) 2012, University Radio York Computing Team
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CUPPA_WIRE_H
+#define CUPPA_WIRE_H
+
+#include <stdbool.h>		/* bool */
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* uint32_t, uint64_t */
+
+#include "constants.h"		/* WORD_LEN */
+#include "errors.h"		/* enum error */
+#include "io.h"			/* enum response, enum wire_mode */
+
+/*
+ * Binary frames.
+ *
+ * Clients that would rather not parse text can switch a connection to binary
+ * frames with a WIRE command (see cmd.h).  In binary mode, every command and
+ * response is a frame:
+ *
+ *   u32 length of the rest of the frame
+ *   ... then for commands:  4-byte command word, padded with NULs
+ *       or for responses:   u8 response code (enum response)
+ *   ... then any number of fields, each a u8 type (enum wire_field) followed
+ *       by the field data.
+ *
+ * All integers are unsigned and big-endian.  Commands carry at most one
+ * field, which must be a string holding the argument; generic responses
+ * carry their rendered text as one string field.  Responses sent through the
+ * typed response functions carry typed fields instead.
+ *
+ * The standard error stream is for logs, so is always text.
+ */
+
+#define WIRE_LEN_SIZE 4		/* Size of a frame's length prefix */
+#define WIRE_MAX_FRAME 65536	/* Largest frame accepted, bar the prefix */
+#define WIRE_STR_HEAD 10	/* Bytes before the body of a string response */
+#define WIRE_U64_FRAME 14	/* Bytes in a response with one u64 field */
+
+/* Types of field in a binary frame. */
+enum wire_field {
+	WF_STR = 1,		/* u32 length, then that many bytes ending in NUL */
+	WF_U64 = 2		/* u64 */
+};
+
+uint32_t	wire_get_u32(const char *buf);
+void		wire_put_u32(char *buf, uint32_t value);
+void		wire_put_u64(char *buf, uint64_t value);
+bool		parse_wire_mode(const char *name, enum wire_mode *mode);
+enum error
+decode_cmd_frame(char *buf,
+		 size_t len,
+		 size_t *used,
+		 char *word,
+		 char **arg);
+size_t		encode_str_frame(char *buf, enum response code, size_t len);
+size_t		encode_u64_frame(char *buf, enum response code, uint64_t value);
+
+#endif				/* !CUPPA_WIRE_H */